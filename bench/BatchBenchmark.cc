@@ -0,0 +1,116 @@
+/*
+ * Measures how many small notifications per second go from a
+ * TCPMessageSender to a TCPMessageReceiver over the loopback interface when
+ * they are sent
+ *  - one by one: one frame per notification
+ *  - in batches: 'batch' notifications per batch frame
+ *
+ * Usage: BatchBenchmark [notifications] [batch] [port]
+ */
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include <boost/asio.hpp>
+#include "TCPMessageReceiver.h"
+#include "TCPMessageSender.h"
+#include "ManaMessageProtobuf.pb.h"
+#include "URL.h"
+#include "Log.h"
+
+using namespace std;
+using namespace mana;
+
+class CountingHandler {
+public:
+    CountingHandler() : messages_(0) {}
+    void handle_message(ManaMessageProtobuf& msg, MessageReceiver<CountingHandler>* mr) {
+        messages_++;
+    }
+    atomic<unsigned long> messages_;
+};
+
+class NullHandler {
+public:
+    void handle_message(ManaMessageProtobuf& msg) {}
+};
+
+// a notification of a market data feed
+static void make_notification(ManaMessageProtobuf& buff, int n) {
+    buff.set_type(ManaMessageProtobuf_message_type_t_NOT);
+    buff.set_sender("publisher");
+    auto notification = buff.mutable_notification();
+    auto att = notification->add_attribute();
+    att->set_name("symbol");
+    att->mutable_value()->set_type(ManaMessageProtobuf_tag_type_t_STRING);
+    att->mutable_value()->set_string_value("SYM" + to_string(n % 500));
+    att = notification->add_attribute();
+    att->set_name("price");
+    att->mutable_value()->set_type(ManaMessageProtobuf_tag_type_t_INT);
+    att->mutable_value()->set_int_value(1000 + n % 97);
+}
+
+static void run(const string& name, const URL& url, boost::asio::io_service& io_srv,
+        CountingHandler& receiver, const vector<ManaMessageProtobuf>& msgs, size_t batch) {
+    NullHandler hndlr;
+    unique_ptr<TCPMessageSender<NullHandler>> sender(new TCPMessageSender<NullHandler>(io_srv, hndlr, url));
+    auto& ms = *sender;
+    if(!ms.connect()) {
+        cout << "Could not connect to " << url.url() << endl;
+        exit(-1);
+    }
+    const FrameFormat f(FRAME_VERSION_2, false, compression_none, DEFAULT_COMPRESSION_MIN_SIZE, true);
+    ms.set_frame_format(f);
+    const unsigned long target = receiver.messages_ + msgs.size();
+    auto start = chrono::steady_clock::now();
+    for(size_t i = 0; i < msgs.size(); i += batch) {
+        // framing is part of what is measured, as a publisher frames each time
+        if(batch == 1)
+            ms.send(msgs[i]);
+        else
+            ms.send(make_batch_frame(&msgs[i], min(batch, msgs.size() - i), f));
+    }
+    while(receiver.messages_ < target)
+        this_thread::sleep_for(chrono::microseconds(100));
+    auto duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    cout << name << ": " << duration.count() / 1000 << " ms, "
+         << static_cast<double>(msgs.size()) * 1000000 / duration.count() << " notifications/s, "
+         << ms.queue_stats().writes_ << " writes" << endl;
+    ms.disconnect();
+}
+
+int main(int argc, char* argv[]) {
+    const int num = argc > 1 ? atoi(argv[1]) : 200000;
+    const int batch = argc > 2 ? atoi(argv[2]) : 100;
+    const int port = argc > 3 ? atoi(argv[3]) : 2399;
+    if(num <= 0 || batch <= 0) {
+        cout << "Usage: BatchBenchmark [notifications] [batch] [port]" << endl;
+        return -1;
+    }
+    Log::ReportingLevel() = logWARNING;
+    URL url("tcp:127.0.0.1:" + to_string(port));
+    boost::asio::io_service io_srv;
+    boost::asio::io_service::work work(io_srv);
+    CountingHandler receiver;
+    unique_ptr<TCPMessageReceiver<CountingHandler>> mr(new TCPMessageReceiver<CountingHandler>(io_srv, receiver, url));
+    mr->start();
+    thread t1([&io_srv]() { io_srv.run(); });
+    thread t2([&io_srv]() { io_srv.run(); });
+
+    vector<ManaMessageProtobuf> msgs(num);
+    for(int i = 0; i < num; i++)
+        make_notification(msgs[i], i);
+    cout << num << " notifications of " << msgs[0].ByteSize() << " bytes" << endl;
+
+    run("one by one", url, io_srv, receiver, msgs, 1);
+    run("batches of " + to_string(batch), url, io_srv, receiver, msgs, batch);
+
+    io_srv.stop();
+    t1.join();
+    t2.join();
+    return 0;
+}
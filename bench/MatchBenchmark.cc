@@ -0,0 +1,109 @@
+/*
+ * Compares two ways of matching a received notification against a
+ * forwarding table:
+ *  - convert: to_ManaMessage() into a ManaMessage, then match (the old
+ *    broker path)
+ *  - view:    match a ManaProtobufMessage that reads the protobuf in place
+ *
+ * Usage: MatchBenchmark [notifications] [attributes per notification] [interfaces]
+ */
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <stdlib.h>
+#include <siena/fwdtable.h>
+#include "ManaFwdTypes.h"
+#include "ManaProtobufMessage.h"
+#include "ManaMessageProtobuf.pb.h"
+#include "common.h"
+
+using namespace std;
+using namespace mana;
+
+class CountingHandler : public siena::MatchMessageHandler {
+public:
+    CountingHandler() : matches_(0) {}
+    virtual bool output(siena::if_t iface, const siena::message& msg) {
+        matches_++;
+        return false;
+    }
+    unsigned long matches_;
+};
+
+static void make_notification(ManaMessageProtobuf& buff, int n, int attrs) {
+    buff.set_type(ManaMessageProtobuf_message_type_t_NOT);
+    buff.set_sender("publisher");
+    auto notification = buff.mutable_notification();
+    for(int a = 0; a < attrs; a++) {
+        auto att = notification->add_attribute();
+        att->set_name("attribute_" + to_string(a));
+        if(a % 2 == 0) {
+            att->mutable_value()->set_type(ManaMessageProtobuf_tag_type_t_INT);
+            att->mutable_value()->set_int_value(n % 100);
+        } else {
+            att->mutable_value()->set_type(ManaMessageProtobuf_tag_type_t_STRING);
+            att->mutable_value()->set_string_value("value_" + to_string(n % 100));
+        }
+    }
+}
+
+static void make_table(siena::FwdTable& table, int ifaces, int attrs) {
+    for(int i = 1; i <= ifaces; i++) {
+        mana_predicate pred;
+        // the even attributes are integers
+        int a = (i % ((attrs + 1) / 2)) * 2;
+        ManaFilter* f = new ManaFilter();
+        f->add("attribute_" + to_string(a), ops<int>::eq(), i % 100);
+        pred.add(f);
+        table.ifconfig(i, pred);
+    }
+    table.consolidate();
+}
+
+template <class F>
+static void run(const string& name, const vector<ManaMessageProtobuf>& msgs, F f) {
+    auto start = chrono::steady_clock::now();
+    unsigned long matches = 0;
+    for(auto& buff : msgs)
+        matches += f(buff);
+    auto duration = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+    cout << name << ": " << duration.count() / msgs.size() << " ns/notification, "
+         << matches << " matches" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    const int num = argc > 1 ? atoi(argv[1]) : 200000;
+    const int attrs = argc > 2 ? atoi(argv[2]) : 10;
+    const int ifaces = argc > 3 ? atoi(argv[3]) : 100;
+    if(num <= 0 || attrs <= 0 || ifaces <= 0) {
+        cout << "Usage: MatchBenchmark [notifications] [attributes per notification] [interfaces]" << endl;
+        return -1;
+    }
+    vector<ManaMessageProtobuf> msgs(num);
+    for(int n = 0; n < num; n++)
+        make_notification(msgs[n], n, attrs);
+    siena::FwdTable table;
+    make_table(table, ifaces, attrs);
+    cout << num << " notifications, " << attrs << " attributes, " << ifaces << " interfaces" << endl;
+
+    run("convert (to_ManaMessage only)", msgs, [](const ManaMessageProtobuf& buff) {
+        ManaMessage msg;
+        to_ManaMessage(buff, msg);
+        return 0ul;
+    });
+    run("convert + match", msgs, [&table](const ManaMessageProtobuf& buff) {
+        ManaMessage msg;
+        to_ManaMessage(buff, msg);
+        CountingHandler h;
+        table.match(msg, h);
+        return h.matches_;
+    });
+    run("view + match", msgs, [&table](const ManaMessageProtobuf& buff) {
+        ManaProtobufMessage msg(buff);
+        CountingHandler h;
+        table.match(msg, h);
+        return h.matches_;
+    });
+    return 0;
+}
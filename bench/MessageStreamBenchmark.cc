@@ -0,0 +1,141 @@
+/*
+ * Measures how fast MessageStream splits a stream of frames read in pieces
+ * of random sizes, as a connection does. Frames of random sizes, some of
+ * them larger than a read, are laid out in memory and fed to the stream a
+ * read at a time; the frames found are counted and checksummed to check
+ * that none was lost or damaged. No message is parsed: this is the framing
+ * alone. The frames are v1, v2, or v2 with a checksum (crc). With lz4 the
+ * messages are text-like and sent compressed, as a session that agreed on
+ * compression=lz4 does, so decompression is measured too; the checksum is
+ * of the decompressed messages.
+ *
+ * Usage: MessageStreamBenchmark [frames] [max frame bytes] [max read bytes] [rounds] [1|2|crc|lz4]
+ */
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include "MessageStream.h"
+#include "FrameFormat.h"
+#include "Crc32c.h"
+#include "Compression.h"
+#include "Log.h"
+
+using namespace std;
+using namespace mana;
+
+// cheap enough not to be what is measured, but a frame found at the wrong
+// place or with the wrong size changes it
+static unsigned long checksum(const byte* data, int size, unsigned long sum) {
+    sum = sum * 31 + size;
+    if(size > 0)
+        sum = (sum * 31 + data[0]) * 31 + data[size - 1];
+    return sum;
+}
+
+int main(int argc, char* argv[]) {
+    const int num = argc > 1 ? atoi(argv[1]) : 100000;
+    const int max_frame = argc > 2 ? atoi(argv[2]) : 4096;
+    const int max_read = argc > 3 ? atoi(argv[3]) : READ_BUFFER_SIZE;
+    const int rounds = argc > 4 ? atoi(argv[4]) : 10;
+    const string version = argc > 5 ? argv[5] : "1";
+    if(num <= 0 || max_frame <= 0 || max_frame > MAX_MSG_SIZE - FRAME_MAX_HEADER_SIZE - FRAME_CRC_SIZE ||
+        max_read <= 0 || rounds <= 0 || (version != "1" && version != "2" && version != "crc" && version != "lz4")) {
+        cout << "Usage: MessageStreamBenchmark [frames] [max frame bytes] [max read bytes] [rounds] [1|2|crc|lz4]" << endl;
+        return -1;
+    }
+    const FrameFormat format(version == "1" ? FRAME_VERSION_1 : FRAME_VERSION_2, version == "crc",
+        version == "lz4" ? compression_lz4 : compression_none);
+    Log::ReportingLevel() = logWARNING;
+    mt19937 rng(42);
+    // frames are mostly small, with one in a hundred as large as allowed
+    uniform_int_distribution<int> small_size(0, max_frame / 16 + 1);
+    uniform_int_distribution<int> percent(0, 99);
+    uniform_int_distribution<int> any_byte(0, 255); // separators in payloads too
+    // compressed messages are made of these, so they compress about as
+    // well as attribute names and values do
+    const char* words[] = {"subscription ", "notification ", "price = ", "symbol = ", "broker ", "42 ", "\xFE\x00 "};
+    uniform_int_distribution<int> any_word(0, 6);
+    vector<byte> stream;
+    vector<byte> message;
+    vector<byte> compressed;
+    unsigned long expected_sum = 0;
+    size_t message_bytes = 0;
+    for(int i = 0; i < num; i++) {
+        int size = percent(rng) == 0 ? max_frame : min(max_frame, small_size(rng));
+        message.resize(size);
+        for(int j = 0; j < size; ) {
+            if(format.codec_ == compression_none) {
+                message[j++] = static_cast<byte>(any_byte(rng));
+                continue;
+            }
+            for(const char* w = words[any_word(rng)]; *w != 0 && j < size; w++)
+                message[j++] = static_cast<byte>(*w);
+        }
+        expected_sum = checksum(message.data(), size, expected_sum);
+        message_bytes += size;
+        const byte* data = message.data();
+        byte flags = 0;
+        if(format.compresses(size)) {
+            compressed.resize(compressed_message_bound(size));
+            size_t n = compress_message(format.codec_, message.data(), size, compressed.data());
+            if(n > 0) {
+                data = compressed.data();
+                size = static_cast<int>(n);
+                flags = FRAME_FLAG_COMPRESSED;
+            }
+        }
+        size_t start = stream.size();
+        stream.resize(start + frame_size(format, size));
+        byte* frame = stream.data() + start;
+        size_t header_size = encode_frame_header(format, size, frame, flags);
+        memcpy(frame + header_size, data, size);
+        encode_frame_trailer(format, frame + header_size, size, frame + header_size + size);
+    }
+    // where the reads end, the same for every round
+    uniform_int_distribution<int> read_size(1, max_read);
+    vector<int> reads;
+    for(size_t done = 0; done < stream.size(); ) {
+        int n = min(static_cast<size_t>(read_size(rng)), stream.size() - done);
+        reads.push_back(n);
+        done += n;
+    }
+
+    MessageStream ms;
+    vector<FrameSpan> frames;
+    auto start = chrono::steady_clock::now();
+    for(int r = 0; r < rounds; r++) {
+        unsigned long found = 0, sum = 0;
+        const byte* data = stream.data();
+        for(int n : reads) {
+            ms.consume(data, n);
+            ms.frames(frames);
+            for(auto& f : frames)
+                sum = checksum(f.data_, f.size_, sum);
+            found += frames.size();
+            ms.release_frames();
+            data += n;
+        }
+        if(found != static_cast<unsigned long>(num) || sum != expected_sum || ms.pending_size() != 0) {
+            cout << "Round " << r << ": found " << found << " of " << num << " frames, "
+                 << (sum == expected_sum ? "checksum ok" : "checksum mismatch") << endl;
+            return -1;
+        }
+    }
+    auto duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    double bytes = static_cast<double>(stream.size()) * rounds;
+    cout << num << " frames, " << stream.size() << " bytes, " << reads.size() << " reads of at most "
+         << max_read << " bytes, " << rounds << " rounds, v" << static_cast<int>(format.version_)
+         << (format.flag_crc_ ? (crc32c_is_hardware() ? " frames with hardware CRC-32C" : " frames with software CRC-32C")
+             : " frames") << endl;
+    if(format.codec_ != compression_none)
+        cout << "messages of " << message_bytes << " bytes compressed with " << compression_name(format.codec_)
+             << " from " << format.compress_min_ << " bytes, " << static_cast<double>(message_bytes) / stream.size()
+             << " times smaller on the wire" << endl;
+    cout << bytes / duration.count() / 1000 << " GB/s, "
+         << static_cast<double>(num) * rounds / duration.count() << " million frames/s" << endl;
+    return 0;
+}
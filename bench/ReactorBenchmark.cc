@@ -0,0 +1,146 @@
+/*
+ * Compares the two ways the broker can run its io threads as their number
+ * grows. A TCPMessageReceiver accepts a number of connections, each sending
+ * small messages as fast as it can, and the messages it reads per second
+ * are measured with
+ *  - shared:   all the threads run one io_service
+ *  - per-core: every thread runs an io_service of its own, pinned to a
+ *              core, and the connections are spread over them
+ *
+ * Usage: ReactorBenchmark [connections] [messages per connection] [payload bytes] [max threads] [port]
+ */
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include <boost/asio.hpp>
+#include "TCPMessageReceiver.h"
+#include "TCPMessageSender.h"
+#include "PipelineStage.h"
+#include "ManaMessageProtobuf.pb.h"
+#include "URL.h"
+#include "Log.h"
+
+using namespace std;
+using namespace mana;
+
+class CountingHandler {
+public:
+    CountingHandler() : messages_(0) {}
+    void handle_message(ManaMessageProtobuf& msg, MessageReceiver<CountingHandler>* mr) {
+        messages_.fetch_add(1, std::memory_order_relaxed);
+    }
+    atomic<unsigned long> messages_;
+};
+
+class NullHandler {
+public:
+    void handle_message(ManaMessageProtobuf& msg) {}
+};
+
+static double run(bool per_core, size_t threads, int connections, int num, const ManaMessageProtobuf& msg, int port) {
+    URL url("tcp:127.0.0.1:" + to_string(port));
+    // the receiving side: one io_service, or one per thread
+    vector<unique_ptr<boost::asio::io_service>> reactors;
+    vector<boost::asio::io_service*> srvs;
+    for(size_t i = 0; i < (per_core ? threads : 1); i++) {
+        reactors.emplace_back(new boost::asio::io_service(per_core ? 1 : threads));
+        srvs.push_back(reactors.back().get());
+    }
+    vector<unique_ptr<boost::asio::io_service::work>> work;
+    for(auto s : srvs)
+        work.emplace_back(new boost::asio::io_service::work(*s));
+    CountingHandler receiver;
+    unique_ptr<TCPMessageReceiver<CountingHandler>> mr(new TCPMessageReceiver<CountingHandler>(*srvs[0], receiver, url));
+    if(per_core)
+        mr->set_connection_io_services(srvs);
+    mr->start();
+    vector<thread> io_threads;
+    for(size_t i = 0; i < threads; i++)
+        io_threads.push_back(thread([&srvs, per_core, i]() {
+            if(per_core)
+                pin_to_core(i);
+            srvs[per_core ? i : 0]->run();
+        }));
+
+    // the sending side runs on an io_service of its own
+    boost::asio::io_service client_srv;
+    boost::asio::io_service::work client_work(client_srv);
+    vector<thread> client_threads;
+    for(int i = 0; i < 2; i++)
+        client_threads.push_back(thread([&client_srv]() { client_srv.run(); }));
+    NullHandler hndlr;
+    vector<unique_ptr<TCPMessageSender<NullHandler>>> senders;
+    for(int i = 0; i < connections; i++) {
+        senders.emplace_back(new TCPMessageSender<NullHandler>(client_srv, hndlr, url));
+        if(!senders.back()->connect()) {
+            cout << "Could not connect to " << url.url() << endl;
+            exit(-1);
+        }
+    }
+    auto frame = make_frame(msg);
+    const unsigned long target = static_cast<unsigned long>(connections) * num;
+    auto start = chrono::steady_clock::now();
+    vector<thread> producers;
+    for(auto& s : senders) {
+        auto* ms = s.get();
+        producers.push_back(thread([ms, &frame, num]() {
+            for(int i = 0; i < num; i++)
+                ms->send(frame);
+        }));
+    }
+    for(auto& t : producers)
+        t.join();
+    while(receiver.messages_ < target)
+        this_thread::sleep_for(chrono::microseconds(100));
+    auto duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+
+    for(auto& s : senders)
+        s->disconnect();
+    client_srv.stop();
+    for(auto& t : client_threads)
+        t.join();
+    // handlers that are left are dropped with the io_services
+    work.clear();
+    for(auto s : srvs)
+        s->stop();
+    for(auto& t : io_threads)
+        t.join();
+    return static_cast<double>(target) * 1000000 / duration.count();
+}
+
+int main(int argc, char* argv[]) {
+    const int connections = argc > 1 ? atoi(argv[1]) : 16;
+    const int num = argc > 2 ? atoi(argv[2]) : 100000;
+    const int payload_size = argc > 3 ? atoi(argv[3]) : 100;
+    const size_t cores = max(1u, thread::hardware_concurrency());
+    const size_t max_threads = argc > 4 ? atoi(argv[4]) : cores;
+    const int port = argc > 5 ? atoi(argv[5]) : 2398;
+    if(connections <= 0 || num <= 0 || payload_size <= 0 || max_threads == 0) {
+        cout << "Usage: ReactorBenchmark [connections] [messages per connection] [payload bytes] [max threads] [port]" << endl;
+        return -1;
+    }
+    Log::ReportingLevel() = logWARNING;
+    ManaMessageProtobuf msg;
+    msg.set_sender("benchmark");
+    msg.set_type(ManaMessageProtobuf_message_type_t_HEARTBEAT);
+    // the receiver's stream resynchronizes on BUFF_SEPERATOR, so keep it out of the payload
+    string payload(payload_size, 'a');
+    msg.set_payload(payload);
+    cout << connections << " connections, " << num << " messages of " << payload_size << " bytes each, "
+         << cores << " cores" << endl;
+    cout << "threads\tshared (msgs/s)\tper-core (msgs/s)" << endl;
+    // each run listens on a port of its own so that it does not wait for
+    // the sockets of the previous one to go away
+    int next_port = port;
+    for(size_t threads = 1; threads <= max_threads; threads *= 2) {
+        double shared = run(false, threads, connections, num, msg, next_port++);
+        double per_core = run(true, threads, connections, num, msg, next_port++);
+        cout << threads << "\t" << static_cast<long>(shared) << "\t\t" << static_cast<long>(per_core) << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Measures the TCP throughput of large messages from a TCPMessageSender to a
+ * TCPMessageReceiver over the loopback interface, with frames written
+ *  - chunked: in MAX_PCKT_SIZE pieces, as TCP senders used to do
+ *  - whole:   in one piece, leaving the segmentation to the kernel
+ *
+ * Usage: ThroughputBenchmark [messages] [payload bytes] [port]
+ */
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <memory>
+#include <stdlib.h>
+#include <boost/asio.hpp>
+#include "TCPMessageReceiver.h"
+#include "TCPMessageSender.h"
+#include "ManaMessageProtobuf.pb.h"
+#include "URL.h"
+#include "Log.h"
+
+using namespace std;
+using namespace mana;
+
+class CountingHandler {
+public:
+    CountingHandler() : messages_(0), bytes_(0) {}
+    void handle_message(ManaMessageProtobuf& msg, MessageReceiver<CountingHandler>* mr) {
+        bytes_ += msg.payload().size();
+        messages_++;
+    }
+    atomic<unsigned long> messages_;
+    atomic<unsigned long> bytes_;
+};
+
+class NullHandler {
+public:
+    void handle_message(ManaMessageProtobuf& msg) {}
+};
+
+static void run(const string& name, const URL& url, boost::asio::io_service& io_srv,
+        CountingHandler& receiver, const ManaMessageProtobuf& msg, int num, size_t chunk_size) {
+    NullHandler hndlr;
+    unique_ptr<TCPMessageSender<NullHandler>> sender(new TCPMessageSender<NullHandler>(io_srv, hndlr, url));
+    auto& ms = *sender;
+    if(!ms.connect()) {
+        cout << "Could not connect to " << url.url() << endl;
+        exit(-1);
+    }
+    ms.set_write_chunk_size(chunk_size);
+    auto frame = make_frame(msg);
+    const unsigned long target = receiver.messages_ + num;
+    auto start = chrono::steady_clock::now();
+    for(int i = 0; i < num; i++)
+        ms.send(frame);
+    while(receiver.messages_ < target)
+        this_thread::sleep_for(chrono::microseconds(100));
+    auto duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    double mb = static_cast<double>(frame->size()) * num / (1024 * 1024);
+    cout << name << ": " << duration.count() / 1000 << " ms, " << mb * 1000000 / duration.count()
+         << " MB/s, " << ms.queue_stats().writes_ << " writes" << endl;
+    ms.disconnect();
+}
+
+int main(int argc, char* argv[]) {
+    const int num = argc > 1 ? atoi(argv[1]) : 200;
+    const int payload_size = argc > 2 ? atoi(argv[2]) : 1000000;
+    const int port = argc > 3 ? atoi(argv[3]) : 2399;
+    if(num <= 0 || payload_size <= 0 || payload_size + 100 > MAX_MSG_SIZE) {
+        cout << "Usage: ThroughputBenchmark [messages] [payload bytes] [port]" << endl;
+        return -1;
+    }
+    Log::ReportingLevel() = logWARNING;
+    URL url("tcp:127.0.0.1:" + to_string(port));
+    boost::asio::io_service io_srv;
+    boost::asio::io_service::work work(io_srv);
+    CountingHandler receiver;
+    unique_ptr<TCPMessageReceiver<CountingHandler>> mr(new TCPMessageReceiver<CountingHandler>(io_srv, receiver, url));
+    mr->start();
+    thread t1([&io_srv]() { io_srv.run(); });
+    thread t2([&io_srv]() { io_srv.run(); });
+
+    ManaMessageProtobuf msg;
+    msg.set_sender("benchmark");
+    msg.set_type(ManaMessageProtobuf_message_type_t_HEARTBEAT);
+    // the receiver's stream resynchronizes on BUFF_SEPERATOR, so keep it out of the payload
+    string payload(payload_size, 'a');
+    for(int i = 0; i < payload_size; i++)
+        payload[i] = static_cast<char>(32 + i % 200);
+    msg.set_payload(payload);
+    cout << num << " messages of " << payload_size << " bytes" << endl;
+
+    run("chunked (" + to_string(MAX_PCKT_SIZE) + " B writes)", url, io_srv, receiver, msg, num, MAX_PCKT_SIZE);
+    run("whole frames", url, io_srv, receiver, msg, num, 0);
+
+    io_srv.stop();
+    t1.join();
+    t2.join();
+    return 0;
+}
@@ -21,13 +21,17 @@
  */
 
 #include <memory>
+#include <algorithm>
 #include <assert.h>
 #include <thread>
+#include <unordered_map>
 #include "ManaException.h"
 #include "MessageReceiver.h"
 #include "TCPMessageReceiver.h"
 #include "UDPMessageReceiver.h"
 #include "ManaFwdTypes.h"
+#include "ManaProtobufMessage.h"
+#include "BufferPool.h"
 #include "Session.h"
 #include "Broker.h"
 #include "TaskScheduler.h"
@@ -40,19 +44,34 @@ using namespace std;
 namespace mana {
 
 
-Broker::Broker(const string& id, size_t t) : id_(id), num_of_threads_(t),
-    task_scheduler_(io_service_) {
-    message_match_handler_ = new BrokerMatchMessageHandler(this);
+Broker::Broker(const string& id, size_t t, size_t match_workers) :
+    fwd_table_(match_workers), id_(id), num_of_threads_(t),
+    stats_interval_(DEFAULT_STATS_INTERVAL_SECONDS), flag_passthrough_(true),
+    dispatch_policy_(DispatchPolicy::round_robin), execution_model_(ExecutionModel::shared_io_service),
+    next_reactor_(0), num_of_match_workers_(match_workers),
+    num_of_write_workers_(0), queue_capacity_(DEFAULT_STAGE_QUEUE_CAPACITY), flag_pin_workers_(true),
+    slow_latency_(DEFAULT_SLOW_LATENCY_MILLISECONDS), slow_queue_messages_(DEFAULT_SLOW_QUEUE_MESSAGES),
+    num_of_slow_lane_threads_(DEFAULT_SLOW_LANE_THREADS),
+    task_scheduler_(io_service_), next_match_worker_(0) {
+    reactors_.push_back(&io_service_);
 }
 
-Broker::~Broker() {
-    delete message_match_handler_;
-}
+Broker::~Broker() {}
 
 void Broker::add_transport(string str_url) {
 	URL url(str_url);
-	auto mr = MessageReceiver<Broker>::create(io_service_, *this, url);
-    message_receivers.push_back(mr);
+	// with reuseport=N, N sockets listen on the port, each with its own
+	// reader, and the kernel spreads the peers over them
+	const size_t sockets = max<size_t>(1, url.size_option("reuseport", 1));
+	for(size_t i = 0; i < sockets; i++) {
+		auto mr = MessageReceiver<Broker>::create(next_reactor(), *this, url);
+		if(execution_model_ == ExecutionModel::io_service_per_core)
+			mr->set_connection_io_services(reactors_);
+		message_receivers.push_back(mr);
+	}
+    if(sockets > 1) {
+        FILE_LOG(logINFO) << "Broker: " << sockets << " sockets will listen on " << url.url();
+    }
 }
 
 void Broker::start() {
@@ -71,21 +90,85 @@ void Broker::start() {
     	FILE_LOG(logERROR) << "Broker::start(): No active transport. Terminating.";
     	exit(-1);
     }
+    if(stats_interval_ > 0)
+        task_scheduler_.schedule_at_periods(std::bind(&Broker::report_stats, this),
+                stats_interval_, TimeUnit::second);
+    if(slow_latency_.count() > 0 || slow_queue_messages_ > 0) {
+        slow_lane_work_.reset(new boost::asio::io_service::work(slow_lane_));
+        for(size_t i = 0; i < num_of_slow_lane_threads_; i++)
+            slow_lane_threads_.push_back(thread([this]() { slow_lane_.run(); }));
+        task_scheduler_.schedule_at_periods(std::bind(&Broker::check_slow_consumers, this),
+                DEFAULT_SLOW_CHECK_INTERVAL_MILLISECONDS, TimeUnit::millisecond);
+    }
+    // the io_service threads feed the matching stage, which feeds the
+    // writing stage. Cores are handed out in the same order: the reactors
+    // of io_service_per_core are pinned to the first cores, so the stages
+    // start after them.
+    const size_t first_stage_core =
+        (execution_model_ == ExecutionModel::io_service_per_core ? num_of_threads_ : 0);
+    if(num_of_match_workers_ > 0)
+        match_stage_.reset(new PipelineStage<MatchTask>("match", num_of_match_workers_, num_of_threads_,
+            queue_capacity_, flag_pin_workers_, first_stage_core,
+            std::bind(&Broker::run_match_task, this, std::placeholders::_1, std::placeholders::_2)));
+    if(num_of_write_workers_ > 0)
+        write_stage_.reset(new PipelineStage<WriteTask>("write", num_of_write_workers_,
+            num_of_match_workers_ > 0 ? num_of_match_workers_ : num_of_threads_,
+            queue_capacity_, flag_pin_workers_, first_stage_core + num_of_match_workers_,
+            std::bind(&Broker::run_write_task, this, std::placeholders::_1, std::placeholders::_2)));
+    if(write_stage_)
+        write_stage_->start();
+    if(match_stage_)
+        match_stage_->start();
+    if(execution_model_ == ExecutionModel::io_service_per_core) {
+        FILE_LOG(logINFO) << "Broker: running " << reactors_.size() << " reactors, one io_service per core.";
+        // a reactor may have nothing to do for a while
+        for(auto r : reactors_)
+            reactor_work_.emplace_back(new boost::asio::io_service::work(*r));
+    }
     try {
         // all threads except one get detached
-        for (unsigned int i = 0; i < num_of_threads_ - 1; i++)
-        std::thread([&](){io_service_.run();}).detach();
-        // the last thread does not detach so we block here until the broker
+        for (unsigned int i = 1; i < num_of_threads_; i++)
+        std::thread([this, i](){
+            run_io_thread(i);
+        }).detach();
+        // the first thread does not detach so we block here until the broker
         // is shutdown
-        io_service_.run();
+        run_io_thread(0);
     } catch (const exception& e) {
         FILE_LOG(logERROR) << "An error happened in the broker execution: " << e.what();
     }
 }
 
+void Broker::run_io_thread(size_t i) {
+    set_producer_index(i);
+    if(execution_model_ == ExecutionModel::io_service_per_core) {
+        if(flag_pin_workers_ && !pin_to_core(i)) {
+            FILE_LOG(logWARNING) << "Broker: could not pin reactor " << i << " to a core.";
+        }
+        reactors_[i]->run();
+    } else {
+        io_service_.run();
+    }
+}
+
+boost::asio::io_service& Broker::next_reactor() {
+    return *reactors_[next_reactor_++ % reactors_.size()];
+}
+
 void Broker::shutdown() {
 	FILE_LOG(logINFO) << "Broker is shutting down...";
-	io_service_.stop();
+	reactor_work_.clear();
+	for(auto r : reactors_)
+	    r->stop();
+	if(match_stage_)
+	    match_stage_->stop();
+	if(write_stage_)
+	    write_stage_->stop();
+	slow_lane_work_.reset();
+	slow_lane_.stop();
+	for(auto& t : slow_lane_threads_)
+	    if(t.joinable())
+	        t.join();
 	FILE_LOG(logINFO) << "done.";
 }
 
@@ -96,7 +179,7 @@ boost::asio::io_service& Broker::io_service() {
 void Broker::handle_session_initiation(const ManaMessageProtobuf& buff, const MessageReceiver<Broker>* mr) {
     // if the subscribing node is already in the list of neighbor
     // then send an error message
-    if(is_in_container(neighbors_by_id_, buff.sender())) {
+    if(find_session(buff.sender()) != nullptr) {
         send_error();
         return;
     }
@@ -113,9 +196,34 @@ void Broker::handle_session_initiation(const ManaMessageProtobuf& buff, const Me
         const siena::if_t  if_no = iface_no_generator_.borrow_number();
         FILE_LOG(logDEBUG2) << "Broker::handle_session_initiation(): iface no: " << if_no;
         // make sure we got a properly formed message
-        auto tmp = make_shared<Session<Broker>>(*this, local_url, remote_url, buff.sender(), if_no);
-        neighbors_by_id_[buff.sender()] = tmp;
-        neighbors_by_iface_[if_no] = std::move(tmp);
+        // a session runs on the reactor of the connection it was requested
+        // over. Datagram sockets are shared, so those sessions are spread.
+        auto& srv = mr->transport_type() == connection_type::udp ? next_reactor() : mr->io_service();
+        auto tmp = Session<Broker>::create(*this, srv, local_url, remote_url, buff.sender(), if_no);
+        // the limits come from our own URL, never from the one the client sent
+        OutboundQueueLimits limits = OutboundQueueLimits::from_url(local_url);
+        {
+            lock_guard<mutex> lock(session_queue_limits_mutex_);
+            auto it = session_queue_limits_.find(buff.sender());
+            if(it != session_queue_limits_.end())
+                limits = it->second;
+        }
+        tmp->set_queue_limits(limits);
+        if(!sessions_.insert(buff.sender(), if_no, tmp)) {
+            // another request of the same node got there first
+            iface_no_generator_.return_number(if_no);
+            send_error();
+            return;
+        }
+        {
+            // set_session_queue_limits() may have run after we looked, when
+            // the session could not be found yet
+            lock_guard<mutex> lock(session_queue_limits_mutex_);
+            auto it = session_queue_limits_.find(buff.sender());
+            if(it != session_queue_limits_.end())
+                tmp->set_queue_limits(it->second);
+        }
+        tmp->accept(buff);
     } catch(const exception& e) {
         FILE_LOG(logINFO) << "Broker::handle_session_initiation(): received invalid or malformed session requesr from " << buff.sender();
         send_error();
@@ -124,14 +232,10 @@ void Broker::handle_session_initiation(const ManaMessageProtobuf& buff, const Me
 }
 
 void Broker::handle_sub(const ManaMessageProtobuf& buff) {
-    ManaFilter* fltr = new ManaFilter();
-    to_ManaFilter(buff, *fltr);
-    //TODO: one predicate per filter is not the right way...
-    mana_predicate pred;
-    pred.add(fltr);
     siena::if_t if_no;
-    if(is_in_container(neighbors_by_id_, buff.sender())) {
-        if_no =  neighbors_by_id_[buff.sender()]->iface();
+    auto session = find_session(buff.sender());
+    if(session != nullptr) {
+        if_no =  session->iface();
     } else {
     	FILE_LOG(logDEBUG2) << "Broker::handle_sub: Subscription request received for unknown session. Sender id: " << buff.sender();
         send_error();
@@ -140,28 +244,330 @@ void Broker::handle_sub(const ManaMessageProtobuf& buff) {
         // Here we should send an error back to the client
         //
     }
-    {// lock the forwarding table before inserting filters into it
-        lock_guard<FwdTableWrapper> lock(fwd_table_wrapper_);
-        fwd_table_wrapper_.fwd_table().ifconfig(if_no, pred);
-        fwd_table_wrapper_.fwd_table().consolidate();
+    ManaFilter* fltr = new ManaFilter();
+    to_ManaFilter(buff, *fltr);
+    // the table takes the ownership of the filter. The serialized subscription
+    // identifies the filter in case the client unsubscribes from it later.
+    fwd_table_.add_filter(if_no, buff.subscription().SerializeAsString(), fltr);
+}
+
+void Broker::handle_subs(const ManaMessageProtobuf* subs, size_t n) {
+    vector<pair<string, ManaFilter*>> filters;
+    for(size_t first = 0, last; first < n; first = last) {
+        for(last = first + 1; last < n && subs[last].sender() == subs[first].sender(); last++)
+            ;
+        auto session = find_session(subs[first].sender());
+        if(session == nullptr) {
+        	FILE_LOG(logDEBUG2) << "Broker::handle_subs: Subscription request received for unknown session. Sender id: " << subs[first].sender();
+            send_error();
+            continue;
+        }
+        filters.clear();
+        filters.reserve(last - first);
+        for(size_t i = first; i < last; i++) {
+            ManaFilter* fltr = new ManaFilter();
+            to_ManaFilter(subs[i], *fltr);
+            filters.push_back(make_pair(subs[i].subscription().SerializeAsString(), fltr));
+        }
+        fwd_table_.add_filters(session->iface(), filters);
+        FILE_LOG(logDEBUG2) << "Broker::handle_subs: " << subs[first].sender() << " subscribed to " << filters.size() << " filters.";
+    }
+}
+
+/*
+ * An UNSUB message with a subscription removes that filter from the
+ * predicate of the sender. Without a subscription all the filters of the
+ * sender are removed.
+ */
+void Broker::handle_unsub(const ManaMessageProtobuf& buff) {
+    auto session = find_session(buff.sender());
+    if(session == nullptr) {
+    	FILE_LOG(logDEBUG2) << "Broker::handle_unsub: Unsubscription request received for unknown session. Sender id: " << buff.sender();
+        send_error();
+        return;
+    }
+    siena::if_t if_no = session->iface();
+    if(!buff.has_subscription()) {
+        fwd_table_.remove_filters(if_no);
+        return;
+    }
+    if(!fwd_table_.remove_filter(if_no, buff.subscription().SerializeAsString())) {
+    	FILE_LOG(logDEBUG2) << "Broker::handle_unsub: " << buff.sender() << " unsubscribed from a filter it did not subscribe to.";
+    }
+}
+
+void Broker::handle_not(const ManaMessageProtobuf& buff, const MessageReceiver<Broker>* mr) {
+    if(match_stage_)
+        dispatch_not(buff, mr);
+    else
+        match_not(buff, mr, nullptr, 0);
+}
+
+/*
+ * Hand the notification over to one of the matching workers. The
+ * notification (and its raw data) only lives as long as this call, so the
+ * worker gets its own copy. In passthrough mode the frame to forward is
+ * made right away from the raw data.
+ */
+void Broker::dispatch_not(const ManaMessageProtobuf& buff, const MessageReceiver<Broker>* mr) {
+    size_t worker;
+    if(dispatch_policy_ == DispatchPolicy::publisher_hash)
+        worker = std::hash<string>()(buff.sender()) % match_stage_->size();
+    else
+        worker = next_match_worker_++ % match_stage_->size();
+    MatchTask t;
+    if(flag_passthrough_ && mr != nullptr && mr->current_message_size() > 0)
+        t.frame_ = make_frame(mr->current_message_data(), mr->current_message_size(), id_);
+    t.notification_.reset(new ManaMessageProtobuf(buff));
+    match_stage_->push(worker, std::move(t));
+}
+
+void Broker::run_match_task(size_t worker, MatchTask& t) {
+    if(t.notification_ != nullptr)
+        match_not(*t.notification_, nullptr, t.frame_, worker);
+    else
+        match_batch(t.batch_.data(), nullptr, t.batch_frames_.data(), t.batch_.size(), worker);
+}
+
+void Broker::run_write_task(size_t worker, WriteTask& t) {
+    t.session_->send(t.frame_);
+}
+
+/*
+ * Match the notification against the given replica of the forwarding table
+ * and deliver it. Matching only collects the matched interfaces; nothing is
+ * encoded or sent, and no lock is taken, until the matcher is done.
+ * If 'frame' is null, the frame to forward is made after matching.
+ */
+void Broker::match_not(const ManaMessageProtobuf& buff, const MessageReceiver<Broker>* mr,
+        const FrameBufferPtr& frame, size_t replica) {
+    // per-thread vector, reused from one notification to the next
+    static thread_local vector<siena::if_t> matches;
+    matches.clear();
+    {
+        // match against a view of the protobuf rather than a ManaMessage copy
+        ManaProtobufMessage msg(buff);
+        // no locking here: the snapshot is immutable and stays alive for as
+        // long as we hold it, even if a new table is published meanwhile.
+        auto table = fwd_table_.snapshot(replica);
+        BrokerMatchMessageHandler match_handler(matches);
+        table->match(msg, match_handler);
+    }
+    if(matches.empty())
+        return;
+    // the notification is framed once for each of the frame formats of the
+    // matching sessions, the first time one is needed. A format it could not
+    // be framed in is kept with a null frame, so it is not tried again.
+    static thread_local vector<pair<FrameFormat, FrameBufferPtr>> frames;
+    FrameBufferPtr any = frame;
+    // a terminated session stays in the forwarding table until the next
+    // rebuild, and the snapshot we matched against may be older than that,
+    // hence the check. The interface number is not reused before then.
+    for(auto iface : matches) {
+        auto session = sessions_.find(iface);
+        if(session == nullptr)
+            continue;
+        const FrameFormat format = session->frame_format();
+        auto f = frames.begin();
+        for(; f != frames.end() && !f->first.frames_like(format); ++f)
+            ;
+        if(f == frames.end()) {
+            frames.push_back(make_pair(format,
+                any != nullptr ? reframe(any, format) : encode_notification(buff, mr, format)));
+            f = frames.end() - 1;
+            if(f->second != nullptr)
+                any = f->second;
+        }
+        if(f->second != nullptr)
+            deliver(session, f->second);
     }
+    // the frames go back to the pool once they are written
+    frames.clear();
 }
 
-void Broker::handle_not(const ManaMessageProtobuf& buff) {
-    ManaMessage msg;
-    to_ManaMessage(buff, msg);
-    //FIXME:  this has to turn to read/write locking
-    lock_guard<FwdTableWrapper> lock(fwd_table_wrapper_);
-    fwd_table_wrapper_.const_fwd_table().match(msg, *message_match_handler_);
+/*
+ * The notifications of a batch, whose raw messages are 'raw', are matched
+ * together, by the thread of the previous stage or by one matching worker.
+ */
+void Broker::handle_not_batch(const ManaMessageProtobuf* nots, const FrameSpan* raw, size_t n) {
+    if(match_stage_) {
+        dispatch_not_batch(nots, raw, n);
+        return;
+    }
+    static thread_local vector<FrameBufferPtr> frames;
+    frames.assign(n, nullptr);
+    match_batch(nots, flag_passthrough_ ? raw : nullptr, frames.data(), n, 0);
+    frames.clear();
+}
+
+/*
+ * As dispatch_not(), for a batch. The whole batch goes to one worker.
+ */
+void Broker::dispatch_not_batch(const ManaMessageProtobuf* nots, const FrameSpan* raw, size_t n) {
+    size_t worker;
+    if(dispatch_policy_ == DispatchPolicy::publisher_hash)
+        worker = std::hash<string>()(nots[0].sender()) % match_stage_->size();
+    else
+        worker = next_match_worker_++ % match_stage_->size();
+    MatchTask t;
+    t.batch_.assign(nots, nots + n);
+    t.batch_frames_.resize(n);
+    if(flag_passthrough_)
+        for(size_t i = 0; i < n; i++)
+            t.batch_frames_[i] = make_frame(raw[i].data_, raw[i].size_, id_);
+    match_stage_->push(worker, std::move(t));
+}
+
+/*
+ * Match the 'n' notifications of a batch against one snapshot of the given
+ * replica of the forwarding table, and then deliver them session by session.
+ * The notifications that match a session that takes batches are sent to it
+ * in one batch frame, which is shared by all the sessions with the same
+ * matches and format. 'frames' holds the frame to forward each notification
+ * in, or null if it is to be made from 'raw' (if not null) after matching.
+ */
+void Broker::match_batch(const ManaMessageProtobuf* nots, const FrameSpan* raw, FrameBufferPtr* frames,
+        size_t n, size_t replica) {
+    // (interface, notification) pairs, reused from one batch to the next
+    static thread_local vector<pair<siena::if_t, size_t>> matches;
+    static thread_local vector<siena::if_t> ifaces;
+    matches.clear();
+    {
+        auto table = fwd_table_.snapshot(replica);
+        for(size_t i = 0; i < n; i++) {
+            ifaces.clear();
+            ManaProtobufMessage msg(nots[i]);
+            BrokerMatchMessageHandler match_handler(ifaces);
+            table->match(msg, match_handler);
+            for(auto iface : ifaces)
+                matches.push_back(make_pair(iface, i));
+        }
+    }
+    if(matches.empty())
+        return;
+    // group the matches by interface, each group in the order of the batch
+    sort(matches.begin(), matches.end());
+    // the frame of each notification in each format, made at the first need.
+    // 'single' holds 'n' frames for each format of 'formats', in order.
+    static thread_local vector<FrameFormat> formats;
+    static thread_local vector<FrameBufferPtr> single;
+    auto frame_of = [&](size_t i, const FrameFormat& format) -> const FrameBufferPtr& {
+        size_t k = 0;
+        for(; k < formats.size() && !formats[k].frames_like(format); k++)
+            ;
+        if(k == formats.size()) {
+            formats.push_back(format);
+            single.resize(single.size() + n);
+        }
+        FrameBufferPtr& f = single[k * n + i];
+        if(f == nullptr) {
+            if(frames[i] == nullptr)
+                frames[i] = (raw != nullptr ? make_frame(raw[i].data_, raw[i].size_, id_) :
+                    encode_notification(nots[i], nullptr, FrameFormat()));
+            if(frames[i] != nullptr)
+                f = reframe(frames[i], format);
+        }
+        return f;
+    };
+    // the batch frames made so far, by their format and the notifications
+    // they hold, i.e., the range of 'matches' of the first session they
+    // were made for. Null if the notifications do not fit in one frame.
+    struct BatchKey {
+        FrameFormat format_;
+        size_t begin_;
+        size_t end_;
+    };
+    struct BatchKeyHash {
+        size_t operator()(const BatchKey& k) const {
+            size_t h = std::hash<uint64_t>()(k.format_.pack());
+            for(size_t i = k.begin_; i < k.end_; i++)
+                h = h * 31 + matches[i].second;
+            return h;
+        }
+    };
+    struct BatchKeyEqual {
+        bool operator()(const BatchKey& a, const BatchKey& b) const {
+            if(!(a.format_ == b.format_) || a.end_ - a.begin_ != b.end_ - b.begin_)
+                return false;
+            for(size_t i = a.begin_, j = b.begin_; i < a.end_; i++, j++)
+                if(matches[i].second != matches[j].second)
+                    return false;
+            return true;
+        }
+    };
+    static thread_local unordered_map<BatchKey, FrameBufferPtr, BatchKeyHash, BatchKeyEqual> batches;
+    static thread_local vector<FrameBufferPtr> members;
+    for(size_t b = 0, e; b < matches.size(); b = e) {
+        for(e = b + 1; e < matches.size() && matches[e].first == matches[b].first; e++)
+            ;
+        // see match_not() on why the session may be gone
+        auto session = sessions_.find(matches[b].first);
+        if(session == nullptr)
+            continue;
+        const FrameFormat format = session->frame_format();
+        FrameBufferPtr batch;
+        if(e - b > 1 && format.flag_batch_) {
+            auto found = batches.emplace(BatchKey{format, b, e}, nullptr);
+            if(found.second) {
+                members.clear();
+                for(size_t k = b; k < e; k++)
+                    if(frame_of(matches[k].second, FrameFormat()) != nullptr)
+                        members.push_back(frames[matches[k].second]);
+                // a batch too large for a frame goes one by one
+                found.first->second = make_batch_frame(members, format);
+            }
+            batch = found.first->second;
+        }
+        if(batch != nullptr) {
+            deliver(session, batch);
+            continue;
+        }
+        for(size_t k = b; k < e; k++) {
+            auto& f = frame_of(matches[k].second, format);
+            if(f != nullptr)
+                deliver(session, f);
+        }
+    }
+    // the frames go back to the pool once they are written
+    formats.clear();
+    single.clear();
+    batches.clear();
+    members.clear();
+}
+
+/*
+ * Runs of notifications in the batch are matched together and runs of
+ * subscriptions installed together; anything else in it is handled on its
+ * own, in order.
+ */
+void Broker::handle_batch(const vector<ManaMessageProtobuf>& msgs, MessageReceiver<Broker>* mr) {
+    const vector<FrameSpan>& raw = mr->current_batch();
+    for(size_t first = 0, last; first < msgs.size(); first = last) {
+        const auto type = msgs[first].type();
+        for(last = first + 1; last < msgs.size() && msgs[last].type() == type; last++)
+            ;
+        if(type == ManaMessageProtobuf_message_type_t_NOT)
+            handle_not_batch(&msgs[first], &raw[first], last - first);
+        else if(type == ManaMessageProtobuf_message_type_t_SUB)
+            handle_subs(&msgs[first], last - first);
+        else
+            for(size_t i = first; i < last; i++)
+                handle_message(msgs[i], mr);
+    }
 }
 
 void Broker::handle_session_message(const ManaMessageProtobuf& buff) {
-    if(is_in_container(neighbors_by_id_, buff.sender())) {
+    auto session = find_session(buff.sender());
+    if(session != nullptr) {
     	FILE_LOG(logDEBUG2)  << "Received hearbeat from " << buff.sender();
-    	neighbors_by_id_[buff.sender()]->handle_session_msg(buff);
+    	session->handle_session_msg(buff);
     }
 }
 
+shared_ptr<Session<Broker>> Broker::find_session(const string& id) {
+    return sessions_.find(id);
+}
+
 /**
  * Brief: With TCP/KA transport this callback is called by the main acceptor.
  *
@@ -178,7 +584,10 @@ void Broker::handle_message(const ManaMessageProtobuf& msg, MessageReceiver<Brok
 		handle_sub(msg);
 		break;
 	case ManaMessageProtobuf_message_type_t_NOT:
-		handle_not(msg);
+		handle_not(msg, mr);
+		break;
+	case ManaMessageProtobuf_message_type_t_UNSUB:
+		handle_unsub(msg);
 		break;
 	case ManaMessageProtobuf_message_type_t_START_SESSION:
 		handle_session_initiation(msg, mr);
@@ -196,46 +605,200 @@ void Broker::handle_message(const ManaMessageProtobuf& msg, MessageReceiver<Brok
 	}
 }
 
-bool Broker::handle_match(siena::if_t iface, const siena::message& msg) {
-	FILE_LOG(logDEBUG2) << "Broker::handle_match(): match for client " << neighbors_by_iface_[iface]->remote_id();
-    ManaMessageProtobuf buff;
-    // set the sender id
-    buff.set_sender(id_);
-    // fill in the rest of the message parts
-    try {
-    	to_protobuf(dynamic_cast<const ManaMessage&>(msg), buff);
-    } catch(const exception& e) {
-    	// ignore the message
-    	FILE_LOG(logWARNING) << "Broker::handle_match: static_cast from siena::message& to ManaMessageProtobuf& failed.";
-    	return true;
-    }
-    // FIXME: i've not yet found a way to remove a subscription from
-    // an interface. So it can happen that a session is removed but
-    // the subscription still exists in the forwarding table, hence
-    // we need the check. Assertion is disabled for now ...
-    //assert(is_in_container(neighbors_by_iface_, iface));
-    // FIXME: we need read/write lock here
-    if(is_in_container(neighbors_by_iface_, iface) == false)
-        return true;
-    neighbors_by_iface_[iface]->send(buff);
-    //
-    byte data[MAX_MSG_SIZE];
-    assert(buff.SerializeToArray(data, MAX_MSG_SIZE));
-    return true;
+/*
+ * Frame the notification in format 'f'. The frame is shared by all the
+ * matching interfaces whose sessions use that format. The
+ * notification is forwarded as received, with the broker as the sender.
+ * In passthrough mode the received bytes are copied verbatim and only the
+ * sender is patched, so the notification is never serialized again.
+ */
+FrameBufferPtr Broker::encode_notification(const ManaMessageProtobuf& buff, const MessageReceiver<Broker>* mr,
+        const FrameFormat& f) {
+    if(flag_passthrough_ && mr != nullptr && mr->current_message_size() > 0)
+        return make_frame(mr->current_message_data(), mr->current_message_size(), id_, f);
+    ManaMessageProtobuf fwd(buff);
+    fwd.set_sender(id_);
+    return make_frame(fwd, f);
+}
+
+void Broker::deliver(const shared_ptr<Session<Broker>>& session, const FrameBufferPtr& frame) {
+	FILE_LOG(logDEBUG2) << "Broker::deliver(): match for client " << session->remote_id();
+    if(write_stage_) {
+        // a session is always served by the same writer so its
+        // notifications stay in order
+        WriteTask t;
+        t.session_ = session;
+        t.frame_ = frame;
+        write_stage_->push(session->iface() % write_stage_->size(), std::move(t));
+    } else
+        session->send(frame);
 }
 
 const string& Broker::id() const {
 	return id_;
 }
 
+void Broker::set_rebuild_window(unsigned int window_ms, size_t max_batch) {
+    fwd_table_.set_batch_window(window_ms, max_batch);
+}
+
+void Broker::set_stats_interval(unsigned int seconds) {
+    stats_interval_ = seconds;
+}
+
+void Broker::set_passthrough(bool flag) {
+    flag_passthrough_ = flag;
+}
+
+void Broker::set_dispatch_policy(DispatchPolicy p) {
+    dispatch_policy_ = p;
+}
+
+void Broker::set_write_workers(size_t n) {
+    num_of_write_workers_ = n;
+}
+
+void Broker::set_queue_capacity(size_t n) {
+    queue_capacity_ = (n == 0 ? 1 : n);
+}
+
+void Broker::set_execution_model(ExecutionModel m) {
+    assert(message_receivers.empty());
+    execution_model_ = m;
+    reactors_.resize(1);
+    own_reactors_.clear();
+    if(m == ExecutionModel::io_service_per_core)
+        for(size_t i = 1; i < num_of_threads_; i++) {
+            // only one thread runs the reactor
+            own_reactors_.emplace_back(new boost::asio::io_service(1));
+            reactors_.push_back(own_reactors_.back().get());
+        }
+}
+
+void Broker::set_pin_workers(bool flag) {
+    flag_pin_workers_ = flag;
+}
+
+void Broker::set_session_queue_limits(const string& id, const OutboundQueueLimits& limits) {
+    lock_guard<mutex> lock(session_queue_limits_mutex_);
+    session_queue_limits_[id] = limits;
+    auto session = sessions_.find(id);
+    if(session != nullptr)
+        session->set_queue_limits(limits);
+}
+
+void Broker::set_slow_consumer_thresholds(unsigned int latency_ms, size_t queue_msgs) {
+    slow_latency_ = std::chrono::milliseconds(latency_ms);
+    slow_queue_messages_ = queue_msgs;
+}
+
+void Broker::set_slow_lane_threads(size_t n) {
+    num_of_slow_lane_threads_ = (n == 0 ? 1 : n);
+}
+
+/*
+ * A session on the slow lane goes back only once it is well under the
+ * thresholds (half of them), so that it does not flip between the lanes.
+ */
+bool Broker::is_slow_consumer(const OutboundQueueStats& st, bool flag_recovering) const {
+    const size_t div = (flag_recovering ? 2 : 1);
+    if(slow_latency_.count() > 0) {
+        auto limit = std::chrono::duration_cast<std::chrono::microseconds>(slow_latency_) / div;
+        if(st.avg_write_latency_ > limit || st.oldest_age_ > limit)
+            return true;
+    }
+    return slow_queue_messages_ > 0 && st.messages_ > slow_queue_messages_ / div;
+}
+
+void Broker::check_slow_consumers() {
+    vector<shared_ptr<Session<Broker>>> sessions;
+    sessions_.sessions(sessions);
+    for(auto& s : sessions) {
+        auto st = s->queue_stats();
+        const bool flag_slow = is_slow_consumer(st, s->is_slow());
+        if(flag_slow == s->is_slow())
+            continue;
+        if(flag_slow) {
+            FILE_LOG(logWARNING) << "Broker: " << s->remote_id() << " is a slow consumer (write latency: "
+                << st.avg_write_latency_.count() << " us, oldest queued message: " << st.oldest_age_.count()
+                << " us, queued messages: " << st.messages_ << "). Moving it to the slow lane.";
+            s->set_slow_lane(&slow_lane_);
+        } else {
+            FILE_LOG(logINFO) << "Broker: " << s->remote_id() << " recovered. Moving it off the slow lane.";
+            s->set_slow_lane(nullptr);
+        }
+    }
+}
+
+void Broker::report_stats() {
+    auto st = fwd_table_.stats();
+    FILE_LOG(logINFO) << "Broker stats: forwarding table rebuilds: " << st.rebuilds_
+        << ", subscription changes: " << st.changes_
+        << ", batch size (last/max): " << st.last_batch_size_ << "/" << st.max_batch_size_
+        << ", rebuild time in us (last/max): " << st.last_rebuild_duration_.count()
+        << "/" << st.max_rebuild_duration_.count();
+    if(match_stage_)
+        report_stage_stats(*match_stage_);
+    if(write_stage_)
+        report_stage_stats(*write_stage_);
+    auto pst = BufferPool::instance().stats();
+    FILE_LOG(logINFO) << "Broker stats: buffer pool: hits (thread/global): " << pst.hits_ << "/" << pst.global_hits_
+        << ", misses: " << pst.misses_ << ", unpooled: " << pst.unpooled_
+        << ", allocated bytes (now/max): " << pst.allocated_bytes_ << "/" << pst.max_allocated_bytes_
+        << ", free bytes: " << pst.free_bytes_;
+    for(auto& mr : message_receivers)
+        mr->report_stats();
+    report_queue_stats();
+}
+
+void Broker::report_queue_stats() {
+    vector<shared_ptr<Session<Broker>>> sessions;
+    sessions_.sessions(sessions);
+    size_t messages = 0;
+    size_t bytes = 0;
+    size_t max_messages = 0;
+    unsigned long dropped = 0;
+    unsigned long writes = 0;
+    unsigned long written = 0;
+    string slow; // ids of the sessions on the slow lane
+    for(auto& s : sessions) {
+        auto st = s->queue_stats();
+        messages += st.messages_;
+        bytes += st.bytes_;
+        max_messages = max(max_messages, st.max_messages_);
+        dropped += st.dropped_;
+        writes += st.writes_;
+        written += st.written_messages_;
+        if(s->is_slow())
+            slow += (slow.empty() ? "" : ", ") + s->remote_id();
+        FILE_LOG(logDEBUG1) << "Broker stats: outbound queue of " << s->remote_id() << ": messages: " << st.messages_
+            << ", bytes: " << st.bytes_ << ", max messages: " << st.max_messages_ << ", dropped: " << st.dropped_
+            << ", write latency in us (avg/max): " << st.avg_write_latency_.count() << "/" << st.max_write_latency_.count()
+            << ", writes: " << st.writes_ << ", max messages per write: " << st.max_write_batch_
+            << (s->is_slow() ? ", on the slow lane" : "");
+    }
+    FILE_LOG(logINFO) << "Broker stats: outbound queues: sessions: " << sessions.size() << ", messages: " << messages
+        << ", bytes: " << bytes << ", max messages in a queue: " << max_messages << ", dropped: " << dropped
+        << ", messages per write: " << (writes > 0 ? static_cast<double>(written) / writes : 0.0);
+    if(!slow.empty()) {
+        FILE_LOG(logINFO) << "Broker stats: slow consumers: " << slow;
+    }
+}
+
 void Broker::handle_session_termination(Session<Broker>& s) {
 	FILE_LOG(logDEBUG2) << "Broker::handle_session_termination: Session " << s.remote_id() << " terminated.";
-    // FIXME: Locking needed
-    iface_no_generator_.return_number(s.iface());
-    neighbors_by_iface_.erase(s.iface());
-    neighbors_by_id_.erase(s.remote_id());
-    // and of course we need to find a way to remove the predicate from the
-    // table and then return the interface number back to the pool. (disabled for now)
+    const siena::if_t iface = s.iface();
+    auto session = sessions_.erase(iface, s.remote_id());
+    if(session == nullptr)
+        return;
+    // we are called by the session itself, which holds a reference to
+    // itself until we return, so dropping ours here is safe.
+    // the interface number goes back to the pool only after it is purged
+    // from the forwarding table and no thread is matching against a table
+    // that still contains it.
+    fwd_table_.remove_interface(iface, [this, iface]() {
+        iface_no_generator_.return_number(iface);
+    });
 }
 
 void Broker::send_error() {}
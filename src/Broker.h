@@ -28,6 +28,8 @@
 #include <chrono>
 #include <memory>
 #include <array>
+#include <vector>
+#include <thread>
 #include <boost/asio.hpp>
 #include <siena/fwdtable.h>
 #include "MessageReceiver.h"
@@ -36,6 +38,10 @@
 #include "TCPMessageSender.h"
 #include "TaskScheduler.h"
 #include "Session.h"
+#include "ForwardingTable.h"
+#include "PipelineStage.h"
+#include "OutboundQueue.h"
+#include "SessionRegistry.h"
 
 using namespace std;
 
@@ -79,20 +85,65 @@ class IFaceNoGenerator {
         mutex mutex_;
 };
 
-// forward declaration so that we can have a pointer to
-// the broker in BrokerMatchMessageHandler
-class BrokerMatchMessageHandler;
+/**
+ * @brief How notifications are spread over the matching workers.
+ *
+ * With round_robin, two notifications of the same publisher may be matched
+ * by different workers and so be forwarded out of order. publisher_hash
+ * keeps the notifications of a publisher on one worker and in order.
+ */
+enum DispatchPolicy {
+    round_robin,
+    publisher_hash
+};
 
-class Broker {
-    // we put a shared data with its associated
-    // mutex in one place, for easy management and less bugs.
-    struct FwdTableWrapper {
-        PROTECTED_WITH(std::mutex);
-        PROTECTED_MEMBER(siena::FwdTable, fwd_table);
-    };
+/**
+ * @brief How the io_service threads of the broker run.
+ *
+ * With shared_io_service, all the threads run one io_service and any of
+ * them may run the handlers of any connection. With io_service_per_core,
+ * every thread runs an io_service (a reactor) of its own, pinned to a core,
+ * and every connection and session stays on one reactor for its lifetime.
+ */
+enum ExecutionModel {
+    shared_io_service,
+    io_service_per_core
+};
+
+// forward declaration so that the pipeline tasks can refer to
+// sessions of the broker
+class Broker;
+
+// a notification, or a batch of them, on its way to the matching stage
+struct MatchTask {
+    unique_ptr<ManaMessageProtobuf> notification_; // null for a batch
+    FrameBufferPtr frame_; // null if it is to be made at the first match
+    vector<ManaMessageProtobuf> batch_;
+    vector<FrameBufferPtr> batch_frames_; // one per notification of the batch, as frame_
+};
 
+// a matched notification on its way to the writing stage
+struct WriteTask {
+    shared_ptr<Session<Broker>> session_;
+    FrameBufferPtr frame_;
+};
+
+class Broker {
 public:
-    Broker(const string& id, size_t num_thrd);
+    /**
+     * The broker runs as a pipeline of up to three stages:
+     *  - the io_service threads read and decode messages (and handle
+     *    everything but notifications),
+     *  - the matching workers match notifications,
+     *  - the writing workers send matched notifications to the sessions.
+     * The stages are connected through bounded lock-free queues. Without
+     * matching (writing) workers, notifications are matched (sent) by the
+     * thread of the previous stage.
+     * @param num_thrd number of io_service threads
+     * @param match_workers number of matching workers. Each worker has its own
+     * replica of the forwarding table.
+     */
+    Broker(const string& id, size_t num_thrd, size_t match_workers = 0);
     Broker(const Broker&) = delete; //disable copy constructor
     virtual ~Broker();
     void start();
@@ -102,48 +153,135 @@ public:
     // Use this method to add more transport protocols to the broker
     void add_transport(string);
     void handle_sub(const ManaMessageProtobuf&);
-    void handle_not(const ManaMessageProtobuf&);
+    // The subscriptions of a batch. The filters of a sender are installed with one table update.
+    void handle_subs(const ManaMessageProtobuf* subs, size_t n);
+    void handle_unsub(const ManaMessageProtobuf&);
+    void handle_not(const ManaMessageProtobuf&, const MessageReceiver<Broker>*);
     void handle_session_message(const ManaMessageProtobuf&);
     void handle_message(const ManaMessageProtobuf& msg, MessageReceiver<Broker>* mr);
+    // The messages of a batch frame. Its notifications are matched together
+    // and its subscriptions are installed together.
+    void handle_batch(const vector<ManaMessageProtobuf>& msgs, MessageReceiver<Broker>* mr);
     void handle_session_termination(Session<Broker>& s);
     void handle_connect(shared_ptr<MessageSender<Broker>>& c);
     const string& id() const;
-    // we want BrokerMatchMessageHandler to be able to call
-    // the private method 'handle_match'
-    friend class BrokerMatchMessageHandler;
+    // Subscription changes are batched for at most 'window_ms' milliseconds
+    // or 'max_batch' changes before the forwarding table is rebuilt.
+    void set_rebuild_window(unsigned int window_ms, size_t max_batch);
+    // Log broker statistics every 'seconds' seconds. Zero disables it.
+    void set_stats_interval(unsigned int seconds);
+    // Forward notifications as they were received instead of encoding them
+    // again (on by default).
+    void set_passthrough(bool flag);
+    void set_dispatch_policy(DispatchPolicy p);
+    // Must be called before the transports are added.
+    void set_execution_model(ExecutionModel m);
+    // The following take effect when the broker starts.
+    void set_write_workers(size_t n);
+    void set_queue_capacity(size_t n);
+    // Pin the matching and writing workers, and the reactors with
+    // io_service_per_core, to cores (on by default). The reactors get the
+    // first cores, then the matching workers, then the writing workers.
+    void set_pin_workers(bool flag);
+    // Bound the outbound queue of the session of 'id' by 'limits' instead of
+    // the limits in the URL of the transport it connected through.
+    void set_session_queue_limits(const string& id, const OutboundQueueLimits& limits);
+    // A session whose average write latency (or the wait of its oldest queued
+    // message) goes past 'latency_ms', or that has more than 'queue_msgs'
+    // messages queued, is written to from the slow lane until it recovers.
+    // Zero disables a criterion.
+    void set_slow_consumer_thresholds(unsigned int latency_ms, size_t queue_msgs);
+    // Takes effect when the broker starts.
+    void set_slow_lane_threads(size_t n);
 
 private:
     // private methods.
-    bool handle_match(siena::if_t, const siena::message&);
+    void deliver(const shared_ptr<Session<Broker>>&, const FrameBufferPtr&);
+    shared_ptr<Session<Broker>> find_session(const string& id);
+    FrameBufferPtr encode_notification(const ManaMessageProtobuf&, const MessageReceiver<Broker>*, const FrameFormat&);
+    void dispatch_not(const ManaMessageProtobuf&, const MessageReceiver<Broker>*);
+    void match_not(const ManaMessageProtobuf&, const MessageReceiver<Broker>*, const FrameBufferPtr&, size_t replica);
+    void handle_not_batch(const ManaMessageProtobuf* nots, const FrameSpan* raw, size_t n);
+    void dispatch_not_batch(const ManaMessageProtobuf* nots, const FrameSpan* raw, size_t n);
+    void match_batch(const ManaMessageProtobuf* nots, const FrameSpan* raw, FrameBufferPtr* frames, size_t n,
+        size_t replica);
+    void run_io_thread(size_t i);
+    // the reactor the next transport or session runs on. With
+    // shared_io_service it is always io_service_.
+    boost::asio::io_service& next_reactor();
+    void run_match_task(size_t worker, MatchTask& t);
+    void run_write_task(size_t worker, WriteTask& t);
     void handle_session_initiation(const ManaMessageProtobuf& buff, const MessageReceiver<Broker>*);
     void send_error();
+    void report_stats();
+    void report_queue_stats();
+    void check_slow_consumers();
+    bool is_slow_consumer(const OutboundQueueStats& st, bool flag_recovering) const;
+    template <class T>
+    void report_stage_stats(const PipelineStage<T>& stage) {
+        auto st = stage.stats();
+        FILE_LOG(logINFO) << "Broker stats: " << stage.name() << " stage: queue depth: " << st.depth_
+            << ", max queue depth: " << st.max_depth_ << ", processed: " << st.processed_
+            << ", full queue stalls: " << st.stalls_;
+    }
     // class properties
     boost::asio::io_service io_service_;
+    vector<unique_ptr<boost::asio::io_service>> own_reactors_; // all the reactors but io_service_.
+    // Must outlive the transports and the sessions.
+    vector<boost::asio::io_service*> reactors_; // io_service_ and then own_reactors_
+    vector<unique_ptr<boost::asio::io_service::work>> reactor_work_;
+    boost::asio::io_service slow_lane_; // writes to slow consumers. Must outlive the sessions.
+    unique_ptr<boost::asio::io_service::work> slow_lane_work_;
+    vector<thread> slow_lane_threads_;
     vector<shared_ptr<MessageReceiver<Broker>>> message_receivers;
-    FwdTableWrapper fwd_table_wrapper_; // the main forwarding table
     IFaceNoGenerator iface_no_generator_; /* a number generator for generating unique numbers to represent
      clients/neighbors */
-    map<string, shared_ptr<Session<Broker>>> neighbors_by_id_; /* map interface/client/neighbors
+    ForwardingTable fwd_table_; // the main forwarding table. Must be declared after
+    // iface_no_generator_ because it returns purged interface numbers to it.
+    SessionRegistry<Session<Broker>> sessions_; /* map interface/client/neighbors
     to the connections */
-    map<siena::if_t, shared_ptr<Session<Broker> >> neighbors_by_iface_;
-    BrokerMatchMessageHandler* message_match_handler_;
+    map<string, OutboundQueueLimits> session_queue_limits_; // by session id
+    mutex session_queue_limits_mutex_; // protects the map above
     string id_;
     size_t num_of_threads_;
+    unsigned int stats_interval_;
+    bool flag_passthrough_;
+    DispatchPolicy dispatch_policy_;
+    ExecutionModel execution_model_;
+    atomic<size_t> next_reactor_; // for round-robin assignment
+    size_t num_of_match_workers_;
+    size_t num_of_write_workers_;
+    size_t queue_capacity_;
+    bool flag_pin_workers_;
+    std::chrono::milliseconds slow_latency_;
+    size_t slow_queue_messages_;
+    size_t num_of_slow_lane_threads_;
     TaskScheduler<std::function<void()>> task_scheduler_;
+    atomic<size_t> next_match_worker_; // for round-robin dispatching
+    // the stages are declared last so that their workers are stopped before
+    // anything they use is destroyed. Both are null when not in use.
+    unique_ptr<PipelineStage<MatchTask>> match_stage_;
+    unique_ptr<PipelineStage<WriteTask>> write_stage_;
 };
 
 /**
  * @brief Helper class to pass to the forwarding table.
+ *
+ * It only collects the matched interfaces. The broker delivers the
+ * notification once matching is over.
  **/
 class BrokerMatchMessageHandler : public siena::MatchMessageHandler {
 public:
-	BrokerMatchMessageHandler(Broker* broker) : broker_(broker) {}
+	BrokerMatchMessageHandler(vector<siena::if_t>& matches) : matches_(matches) {}
 	virtual ~BrokerMatchMessageHandler () {}
 	virtual bool output (siena::if_t iface, const siena::message& msg) {
-		return broker_->handle_match(iface, msg);
+		matches_.push_back(iface);
+		// returning true would stop the table from looking for
+		// more matching interfaces
+		return false;
 	}
     private:
-        Broker* broker_;
+        vector<siena::if_t>& matches_;
 };
 
 } /* namespace mana */
@@ -0,0 +1,162 @@
+/**
+ * @file BufferPool.cc
+ * Size-class pool of the buffers messages are framed in
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include <assert.h>
+#include "BufferPool.h"
+
+namespace mana {
+
+// hits of a thread are added to the pool's counter every this many hits
+static const unsigned long THREAD_HITS_FLUSH = 1024;
+
+struct BufferPool::ThreadCache {
+    ThreadCache() : hits_(0) {
+        for(auto& c : buffers_)
+            c.reserve(BUFFER_POOL_THREAD_CACHE_SIZE);
+    }
+
+    // the buffers of a thread that exits go back to the pool
+    ~ThreadCache() {
+        BufferPool& pool = BufferPool::instance();
+        for(size_t c = 0; c < BUFFER_POOL_NUM_CLASSES; c++)
+            pool.give(c, buffers_[c], buffers_[c].size());
+        pool.hits_ += hits_;
+    }
+
+    array<vector<byte*>, BUFFER_POOL_NUM_CLASSES> buffers_;
+    unsigned long hits_;
+};
+
+BufferPool::BufferPool() : hits_(0), global_hits_(0), misses_(0), unpooled_(0),
+    allocated_bytes_(0), max_allocated_bytes_(0), free_bytes_(0) {}
+
+BufferPool& BufferPool::instance() {
+    // never destroyed: threads may release buffers while the program exits
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+BufferPool::ThreadCache& BufferPool::thread_cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+}
+
+size_t BufferPool::size_class(size_t size) {
+    size_t c = 0;
+    size_t s = BUFFER_POOL_MIN_SIZE;
+    while(s < size && c < BUFFER_POOL_NUM_CLASSES) {
+        s <<= 1;
+        c++;
+    }
+    return c;
+}
+
+size_t BufferPool::class_size(size_t c) {
+    return BUFFER_POOL_MIN_SIZE << c;
+}
+
+byte* BufferPool::allocate(size_t size) {
+    const size_t c = size_class(size);
+    if(c >= BUFFER_POOL_NUM_CLASSES) {
+        unpooled_.fetch_add(1, std::memory_order_relaxed);
+        return new byte[size];
+    }
+    ThreadCache& cache = thread_cache();
+    auto& bufs = cache.buffers_[c];
+    if(bufs.empty()) {
+        // refill half of the cache at once so the next allocations are hits
+        take(c, bufs, BUFFER_POOL_THREAD_CACHE_SIZE / 2);
+        if(bufs.empty())
+            return allocate_new(c);
+        global_hits_.fetch_add(1, std::memory_order_relaxed);
+    } else if(++cache.hits_ == THREAD_HITS_FLUSH) {
+        hits_.fetch_add(cache.hits_, std::memory_order_relaxed);
+        cache.hits_ = 0;
+    }
+    byte* b = bufs.back();
+    bufs.pop_back();
+    return b;
+}
+
+void BufferPool::release(byte* buffer, size_t size) {
+    if(buffer == nullptr)
+        return;
+    const size_t c = size_class(size);
+    if(c >= BUFFER_POOL_NUM_CLASSES) {
+        delete[] buffer;
+        return;
+    }
+    auto& bufs = thread_cache().buffers_[c];
+    if(bufs.size() >= BUFFER_POOL_THREAD_CACHE_SIZE)
+        give(c, bufs, BUFFER_POOL_THREAD_CACHE_SIZE / 2);
+    bufs.push_back(buffer);
+}
+
+void BufferPool::take(size_t c, vector<byte*>& out, size_t n) {
+    FreeList& fl = free_lists_[c];
+    lock_guard<mutex> lock(fl.mutex_);
+    n = min(n, fl.buffers_.size());
+    out.insert(out.end(), fl.buffers_.end() - n, fl.buffers_.end());
+    fl.buffers_.resize(fl.buffers_.size() - n);
+    free_bytes_.fetch_sub(n * class_size(c), std::memory_order_relaxed);
+}
+
+void BufferPool::give(size_t c, vector<byte*>& in, size_t n) {
+    assert(n <= in.size());
+    const size_t max_free = BUFFER_POOL_MAX_FREE_BYTES / class_size(c);
+    FreeList& fl = free_lists_[c];
+    size_t kept = 0;
+    {
+        lock_guard<mutex> lock(fl.mutex_);
+        kept = min(n, max_free - min(max_free, fl.buffers_.size()));
+        fl.buffers_.insert(fl.buffers_.end(), in.end() - kept, in.end());
+    }
+    in.resize(in.size() - kept);
+    free_bytes_.fetch_add(kept * class_size(c), std::memory_order_relaxed);
+    // the global list is full
+    for(size_t i = kept; i < n; i++) {
+        delete[] in.back();
+        in.pop_back();
+        allocated_bytes_.fetch_sub(class_size(c), std::memory_order_relaxed);
+    }
+}
+
+byte* BufferPool::allocate_new(size_t c) {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    size_t a = allocated_bytes_.fetch_add(class_size(c), std::memory_order_relaxed) + class_size(c);
+    size_t m = max_allocated_bytes_.load(std::memory_order_relaxed);
+    while(a > m && !max_allocated_bytes_.compare_exchange_weak(m, a, std::memory_order_relaxed))
+        ;
+    return new byte[class_size(c)];
+}
+
+BufferPool::Stats BufferPool::stats() const {
+    Stats st;
+    st.hits_ = hits_;
+    st.global_hits_ = global_hits_;
+    st.misses_ = misses_;
+    st.unpooled_ = unpooled_;
+    st.allocated_bytes_ = allocated_bytes_;
+    st.max_allocated_bytes_ = max_allocated_bytes_;
+    st.free_bytes_ = free_bytes_;
+    return st;
+}
+
+} /* namespace mana */
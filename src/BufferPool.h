@@ -0,0 +1,139 @@
+/**
+ * @file BufferPool.h
+ * Size-class pool of the buffers messages are framed in
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef BUFFERPOOL_H_
+#define BUFFERPOOL_H_
+
+#include <vector>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include "common.h"
+
+using namespace std;
+
+namespace mana {
+
+const size_t BUFFER_POOL_MIN_SIZE = 64; // Bytes, the smallest size class
+const size_t BUFFER_POOL_MAX_SIZE = 64 * 1024; // Bytes, the largest size class.
+// Larger buffers are not pooled.
+const size_t BUFFER_POOL_NUM_CLASSES = 11; // 64, 128, ..., 64K
+const size_t BUFFER_POOL_THREAD_CACHE_SIZE = 64; // buffers per size class a thread keeps
+const size_t BUFFER_POOL_MAX_FREE_BYTES = 64 * 1024 * 1024; // per size class in the global
+// free list. Buffers that do not fit are given back to the system.
+
+/**
+ * @brief A pool of byte buffers in power of two size classes.
+ *
+ * Every thread has a small cache of free buffers for each size class, so
+ * most allocations and releases take no lock. A thread whose cache is
+ * empty takes a batch from the global free list of the class; one whose
+ * cache is full moves half of it there. This is what lets a buffer that is
+ * allocated by a reading thread and released by a writing thread go round
+ * without going back to the system allocator.
+ *
+ * All the methods are thread safe.
+ */
+class BufferPool {
+public:
+    /** @brief Pool statistics. Hits are counted per thread and added up in batches. */
+    struct Stats {
+        Stats() : hits_(0), global_hits_(0), misses_(0), unpooled_(0), allocated_bytes_(0),
+            max_allocated_bytes_(0), free_bytes_(0) {}
+        unsigned long hits_; // served from the cache of the thread
+        unsigned long global_hits_; // served from the global free list
+        unsigned long misses_; // allocated from the system
+        unsigned long unpooled_; // larger than BUFFER_POOL_MAX_SIZE
+        size_t allocated_bytes_; // pooled buffers, in use or free
+        size_t max_allocated_bytes_; // high-water mark of allocated_bytes_
+        size_t free_bytes_; // in the global free lists
+    };
+
+    static BufferPool& instance();
+
+    /** @brief A buffer of at least 'size' bytes. Release it with the same size. */
+    byte* allocate(size_t size);
+    void release(byte* buffer, size_t size);
+
+    Stats stats() const;
+
+private:
+    BufferPool();
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    struct ThreadCache;
+    friend struct ThreadCache;
+
+    // the index of the smallest class that fits 'size', or
+    // BUFFER_POOL_NUM_CLASSES if it is too large
+    static size_t size_class(size_t size);
+    static size_t class_size(size_t c);
+    static ThreadCache& thread_cache();
+
+    // move up to 'n' free buffers of class 'c' to 'out'. Returns how many
+    void take(size_t c, vector<byte*>& out, size_t n);
+    // give the buffers to the global list of class 'c'; whatever does not fit is freed
+    void give(size_t c, vector<byte*>& in, size_t n);
+    byte* allocate_new(size_t c);
+
+    struct FreeList {
+        mutex mutex_;
+        vector<byte*> buffers_;
+    };
+
+    array<FreeList, BUFFER_POOL_NUM_CLASSES> free_lists_;
+    atomic<unsigned long> hits_;
+    atomic<unsigned long> global_hits_;
+    atomic<unsigned long> misses_;
+    atomic<unsigned long> unpooled_;
+    atomic<size_t> allocated_bytes_;
+    atomic<size_t> max_allocated_bytes_;
+    atomic<size_t> free_bytes_;
+};
+
+/**
+ * @brief A buffer borrowed from the pool for as long as the object lives.
+ */
+class PooledBuffer {
+public:
+    explicit PooledBuffer(size_t size) : data_(BufferPool::instance().allocate(size)), size_(size) {}
+    ~PooledBuffer() {
+        BufferPool::instance().release(data_, size_);
+    }
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    byte* data() {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    byte* data_;
+    const size_t size_;
+};
+
+} /* namespace mana */
+
+#endif /* BUFFERPOOL_H_ */
@@ -0,0 +1,272 @@
+/**
+ * @file Compression.cc
+ * Compression of the messages in frames
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "Compression.h"
+
+namespace mana {
+
+// the parameters of the LZ4 block format
+static const size_t LZ4_MIN_MATCH = 4;
+static const size_t LZ4_LAST_LITERALS = 5; // a block ends with this many literals
+static const size_t LZ4_MATCH_LIMIT = 12; // no match starts this close to the end
+static const size_t LZ4_MAX_OFFSET = 65535;
+static const int LZ4_HASH_LOG = 12;
+static const int LZ4_SKIP_TRIGGER = 6; // the search speeds up every 2^6 bytes without a match
+
+static const size_t MAX_VARINT_SIZE = 5; // Bytes
+
+const char* compression_name(CompressionCodec codec) {
+    switch(codec) {
+    case compression_lz4:
+        return "lz4";
+    case compression_none:
+    default:
+        return "none";
+    }
+}
+
+bool compression_from_name(const string& name, CompressionCodec& codec) {
+    if(name == "none")
+        codec = compression_none;
+    else if(name == "lz4")
+        codec = compression_lz4;
+    else
+        return false;
+    return true;
+}
+
+static size_t lz4_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+size_t compressed_message_bound(size_t size) {
+    return 1 + MAX_VARINT_SIZE + lz4_bound(size);
+}
+
+size_t compress_message(CompressionCodec codec, const byte* in, size_t size, byte* out) {
+    if(codec != compression_lz4)
+        return 0;
+    byte* p = out;
+    *p++ = static_cast<byte>(codec);
+    for(size_t v = size; ; v >>= 7) {
+        if(v < 0x80) {
+            *p++ = static_cast<byte>(v);
+            break;
+        }
+        *p++ = static_cast<byte>(v | 0x80);
+    }
+    size_t header_size = p - out;
+    if(header_size >= size)
+        return 0;
+    // it must come out smaller than the message
+    size_t n = lz4_compress(in, size, p, size - header_size);
+    return n == 0 ? 0 : header_size + n;
+}
+
+// the codec and the size of the compressed message at 'in'. Returns the size
+// of its header or 0 if it is not valid.
+static size_t decode_compressed_header(const byte* in, size_t size, CompressionCodec& codec, size_t& message_size) {
+    if(size < 2 || in[0] != compression_lz4)
+        return 0;
+    codec = static_cast<CompressionCodec>(in[0]);
+    message_size = 0;
+    for(size_t i = 1; i < size && i <= MAX_VARINT_SIZE; i++) {
+        message_size |= static_cast<size_t>(in[i] & 0x7F) << (7 * (i - 1));
+        if((in[i] & 0x80) == 0)
+            return message_size <= MAX_MSG_SIZE ? i + 1 : 0;
+    }
+    return 0;
+}
+
+long uncompressed_message_size(const byte* in, size_t size) {
+    CompressionCodec codec;
+    size_t message_size;
+    if(decode_compressed_header(in, size, codec, message_size) == 0)
+        return -1;
+    return static_cast<long>(message_size);
+}
+
+bool decompress_message(const byte* in, size_t size, byte* out) {
+    CompressionCodec codec;
+    size_t message_size;
+    size_t header_size = decode_compressed_header(in, size, codec, message_size);
+    if(header_size == 0)
+        return false;
+    return lz4_decompress(in + header_size, size - header_size, out, message_size) ==
+        static_cast<long>(message_size);
+}
+
+static inline uint32_t read32(const byte* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// write a length that does not fit in the nibble of the token
+static inline byte* write_length(byte* op, size_t length) {
+    for(; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = static_cast<byte>(length);
+    return op;
+}
+
+// write the literals from 'anchor' up to 'ip', followed by a match of
+// 'match_length' bytes at 'offset' unless 'match_length' is 0. Returns
+// nullptr if they do not fit before 'oend'.
+static inline byte* write_sequence(byte* op, byte* oend, const byte* anchor, const byte* ip,
+        size_t offset, size_t match_length) {
+    const size_t literals = ip - anchor;
+    // the token, the literals, their length, the offset and the match length
+    if(static_cast<size_t>(oend - op) < 1 + literals + literals / 255 + 1 + 2 + match_length / 255 + 1)
+        return nullptr;
+    byte* token = op++;
+    if(literals >= 15) {
+        *token = 15 << 4;
+        op = write_length(op, literals - 15);
+    } else
+        *token = static_cast<byte>(literals << 4);
+    memcpy(op, anchor, literals);
+    op += literals;
+    if(match_length == 0)
+        return op;
+    *op++ = static_cast<byte>(offset);
+    *op++ = static_cast<byte>(offset >> 8);
+    const size_t ml = match_length - LZ4_MIN_MATCH;
+    if(ml >= 15) {
+        *token |= 15;
+        op = write_length(op, ml - 15);
+    } else
+        *token |= static_cast<byte>(ml);
+    return op;
+}
+
+/*
+ * A greedy compressor: the positions of the last sequences of four bytes
+ * are kept in a hash table and the first match found is taken, as LZ4 does
+ * in its fast mode.
+ */
+size_t lz4_compress(const byte* in, size_t size, byte* out, size_t capacity) {
+    uint32_t table[1 << LZ4_HASH_LOG];
+    memset(table, 0, sizeof(table));
+    const byte* ip = in;
+    const byte* anchor = in;
+    const byte* const iend = in + size;
+    byte* op = out;
+    byte* const oend = out + capacity;
+    if(size > LZ4_MATCH_LIMIT) {
+        const byte* const mflimit = iend - LZ4_MATCH_LIMIT;
+        const byte* const matchlimit = iend - LZ4_LAST_LITERALS;
+        ip++;
+        size_t searched = 1 << LZ4_SKIP_TRIGGER;
+        while(ip < mflimit) {
+            const uint32_t sequence = read32(ip);
+            const uint32_t h = lz4_hash(sequence);
+            const byte* ref = in + table[h];
+            table[h] = static_cast<uint32_t>(ip - in);
+            if(ref >= ip || static_cast<size_t>(ip - ref) > LZ4_MAX_OFFSET || read32(ref) != sequence) {
+                ip += searched++ >> LZ4_SKIP_TRIGGER;
+                continue;
+            }
+            searched = 1 << LZ4_SKIP_TRIGGER;
+            // extend the match backwards and forwards
+            while(ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const byte* p = ip + LZ4_MIN_MATCH;
+            const byte* r = ref + LZ4_MIN_MATCH;
+            while(p < matchlimit && *p == *r) {
+                p++;
+                r++;
+            }
+            op = write_sequence(op, oend, anchor, ip, ip - ref, p - ip);
+            if(op == nullptr)
+                return 0;
+            ip = p;
+            anchor = ip;
+            if(ip < mflimit)
+                table[lz4_hash(read32(ip - 2))] = static_cast<uint32_t>(ip - 2 - in);
+        }
+    }
+    op = write_sequence(op, oend, anchor, iend, 0, 0);
+    return op == nullptr ? 0 : op - out;
+}
+
+// read a length that did not fit in the nibble of the token
+static inline bool read_length(const byte*& ip, const byte* iend, size_t& length) {
+    byte b;
+    do {
+        if(ip == iend)
+            return false;
+        b = *ip++;
+        length += b;
+    } while(b == 255);
+    return true;
+}
+
+long lz4_decompress(const byte* in, size_t size, byte* out, size_t capacity) {
+    const byte* ip = in;
+    const byte* const iend = in + size;
+    byte* op = out;
+    byte* const oend = out + capacity;
+    while(ip < iend) {
+        const byte token = *ip++;
+        size_t literals = token >> 4;
+        if(literals == 15 && !read_length(ip, iend, literals))
+            return -1;
+        if(literals > static_cast<size_t>(iend - ip) || literals > static_cast<size_t>(oend - op))
+            return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if(ip == iend)
+            break; // the last sequence has no match
+        if(iend - ip < 2)
+            return -1;
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > static_cast<size_t>(op - out))
+            return -1;
+        size_t match_length = token & 15;
+        if(match_length == 15 && !read_length(ip, iend, match_length))
+            return -1;
+        match_length += LZ4_MIN_MATCH;
+        if(match_length > static_cast<size_t>(oend - op))
+            return -1;
+        const byte* match = op - offset;
+        if(offset >= match_length)
+            memcpy(op, match, match_length);
+        else {
+            // the match overlaps what it writes, e.g., a run of one byte
+            for(size_t i = 0; i < match_length; i++)
+                op[i] = match[i];
+        }
+        op += match_length;
+    }
+    return op - out;
+}
+
+} /* namespace mana */
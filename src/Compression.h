@@ -0,0 +1,81 @@
+/**
+ * @file Compression.h
+ * Compression of the messages in frames
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <stddef.h>
+#include <string>
+#include "common.h"
+
+using namespace std;
+
+namespace mana {
+
+/*
+ * The message of a v2 frame with FRAME_FLAG_COMPRESSED is
+ *   codec (1 byte) | size of the message (varint) | the compressed message
+ * so a receiver can take frames of any codec it knows, whatever was agreed
+ * on for the session.
+ */
+enum CompressionCodec {
+    compression_none = 0,
+    compression_lz4 = 1 // the block format of LZ4, with an in-tree codec
+};
+
+/** @brief The name of 'codec' as in URLs and session messages, e.g., "lz4" */
+const char* compression_name(CompressionCodec codec);
+
+/** @brief The codec called 'name'. Returns false if there is none. */
+bool compression_from_name(const string& name, CompressionCodec& codec);
+
+/** @brief The most bytes the compressed message of 'size' bytes may take */
+size_t compressed_message_bound(size_t size);
+
+/**
+ * @brief Compress the 'size' bytes at 'in' with 'codec' into a compressed
+ * message at 'out', which has room for compressed_message_bound(size)
+ * bytes. Returns its size, or 0 if it is not smaller than the message.
+ */
+size_t compress_message(CompressionCodec codec, const byte* in, size_t size, byte* out);
+
+/**
+ * @brief The size of the message the compressed message at 'in' holds, or
+ * -1 if it is not a valid compressed message.
+ */
+long uncompressed_message_size(const byte* in, size_t size);
+
+/**
+ * @brief Decompress the compressed message at 'in' to 'out', which has room
+ * for uncompressed_message_size() bytes. Returns false if it is corrupted.
+ */
+bool decompress_message(const byte* in, size_t size, byte* out);
+
+/*
+ * The LZ4 block format: 'out' has room for 'capacity' bytes. Compression
+ * returns 0 if the block does not fit; decompression returns the size of
+ * the data or -1 if the block is corrupted or the data does not fit.
+ */
+size_t lz4_compress(const byte* in, size_t size, byte* out, size_t capacity);
+long lz4_decompress(const byte* in, size_t size, byte* out, size_t capacity);
+
+} /* namespace mana */
+
+#endif /* COMPRESSION_H_ */
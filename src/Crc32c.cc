@@ -0,0 +1,109 @@
+/**
+ * @file Crc32c.cc
+ * CRC-32C (Castagnoli) checksums
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include <string.h>
+#include "Crc32c.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace mana {
+
+static const uint32_t CRC32C_POLY = 0x82F63B78; // reflected
+
+/*
+ * Tables for slicing-by-8: table[k][b] is the CRC of byte b followed by k
+ * zero bytes.
+ */
+struct Crc32cTables {
+    Crc32cTables() {
+        for(uint32_t b = 0; b < 256; b++) {
+            uint32_t c = b;
+            for(int i = 0; i < 8; i++)
+                c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            table_[0][b] = c;
+        }
+        for(uint32_t b = 0; b < 256; b++)
+            for(int k = 1; k < 8; k++)
+                table_[k][b] = (table_[k - 1][b] >> 8) ^ table_[0][table_[k - 1][b] & 0xFF];
+    }
+    uint32_t table_[8][256];
+};
+
+static uint32_t crc32c_software(const byte* data, size_t size, uint32_t crc) {
+    static const Crc32cTables tables;
+    const auto& t = tables.table_;
+    for(; size >= 8; data += 8, size -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc; // little endian
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for(; size > 0; data++, size--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(const byte* data, size_t size, uint32_t crc) {
+    uint64_t c = crc;
+    for(; size >= 8; data += 8, size -= 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    for(; size > 0; data++, size--)
+        c32 = _mm_crc32_u8(c32, *data);
+    return c32;
+}
+
+static bool has_sse42() {
+    // this may run before the constructors of libgcc
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static const bool flag_hardware_crc32c = has_sse42();
+#else
+static const bool flag_hardware_crc32c = false;
+#endif
+
+uint32_t crc32c(const byte* data, size_t size, uint32_t crc) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if(flag_hardware_crc32c)
+        return ~crc32c_hardware(data, size, crc);
+#endif
+    return ~crc32c_software(data, size, crc);
+}
+
+bool crc32c_is_hardware() {
+    return flag_hardware_crc32c;
+}
+
+uint32_t crc32c_table(const byte* data, size_t size, uint32_t crc) {
+    return ~crc32c_software(data, size, ~crc);
+}
+
+} /* namespace mana */
@@ -0,0 +1,50 @@
+/**
+ * @file Crc32c.h
+ * CRC-32C (Castagnoli) checksums
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common.h"
+
+namespace mana {
+
+/**
+ * @brief The CRC-32C of 'size' bytes at 'data', continuing from 'crc'.
+ *
+ * On x86-64 processors with SSE4.2 the crc32 instruction is used; the
+ * check is made once, at run time. Elsewhere a table driven implementation
+ * is used.
+ */
+uint32_t crc32c(const byte* data, size_t size, uint32_t crc = 0);
+
+/** @brief True if crc32c() runs on the crc32 instruction */
+bool crc32c_is_hardware();
+
+/**
+ * @brief crc32c() with the table driven implementation whatever the
+ * processor, so that tests can check it against the crc32 instruction.
+ */
+uint32_t crc32c_table(const byte* data, size_t size, uint32_t crc = 0);
+
+} /* namespace mana */
+
+#endif /* CRC32C_H_ */
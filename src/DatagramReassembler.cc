@@ -0,0 +1,162 @@
+/**
+ * @file DatagramReassembler.cc
+ * Fragmentation of messages over datagrams and their reassembly
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include "DatagramReassembler.h"
+#include "Log.h"
+
+namespace mana {
+
+// expired messages are looked for at most this often
+static const std::chrono::milliseconds EXPIRY_CHECK_INTERVAL(100);
+// what a message and each of its fragments take besides the payload, roughly
+// the map nodes
+static const size_t MESSAGE_OVERHEAD = 128; // Bytes
+static const size_t FRAGMENT_OVERHEAD = 64; // Bytes
+// no frame is larger, with its header and trailer
+static const size_t MAX_REASSEMBLED_SIZE = MAX_MSG_SIZE + MAX_PCKT_SIZE; // Bytes
+
+void encode_fragment_header(const DatagramFragmentHeader& h, byte* out) {
+    out[0] = DATAGRAM_FRAGMENT_MAGIC;
+    out[1] = static_cast<byte>(h.message_id_ >> 24);
+    out[2] = static_cast<byte>(h.message_id_ >> 16);
+    out[3] = static_cast<byte>(h.message_id_ >> 8);
+    out[4] = static_cast<byte>(h.message_id_);
+    out[5] = static_cast<byte>(h.count_ >> 8);
+    out[6] = static_cast<byte>(h.count_);
+    out[7] = static_cast<byte>(h.index_ >> 8);
+    out[8] = static_cast<byte>(h.index_);
+}
+
+bool decode_fragment_header(const byte* data, size_t size, DatagramFragmentHeader& h) {
+    if(size < DATAGRAM_FRAGMENT_HEADER_SIZE || data[0] != DATAGRAM_FRAGMENT_MAGIC)
+        return false;
+    h.message_id_ = (static_cast<uint32_t>(data[1]) << 24) | (static_cast<uint32_t>(data[2]) << 16) |
+        (static_cast<uint32_t>(data[3]) << 8) | data[4];
+    h.count_ = static_cast<uint16_t>((data[5] << 8) | data[6]);
+    h.index_ = static_cast<uint16_t>((data[7] << 8) | data[8]);
+    return true;
+}
+
+DatagramReassembler::DatagramReassembler(unsigned int timeout_ms, size_t max_bytes, size_t max_messages) :
+    timeout_(timeout_ms), max_bytes_(max_bytes), max_messages_(max_messages),
+    last_expiry_(std::chrono::steady_clock::now()) {}
+
+bool DatagramReassembler::add(const boost::asio::ip::udp::endpoint& from, const byte* data, size_t size,
+        vector<byte>& message) {
+    const TimePoint now = std::chrono::steady_clock::now();
+    if(now - last_expiry_ >= EXPIRY_CHECK_INTERVAL)
+        expire(now);
+    DatagramFragmentHeader h;
+    if(!decode_fragment_header(data, size, h) || size == DATAGRAM_FRAGMENT_HEADER_SIZE ||
+        h.count_ == 0 || h.index_ >= h.count_) {
+        stats_.malformed_++;
+        FILE_LOG(logDEBUG1) << "DatagramReassembler::add(): malformed fragment from " << from;
+        return false;
+    }
+    data += DATAGRAM_FRAGMENT_HEADER_SIZE;
+    size -= DATAGRAM_FRAGMENT_HEADER_SIZE;
+    const Key key(from, h.message_id_);
+    auto it = messages_.find(key);
+    if(it == messages_.end()) {
+        while(!messages_.empty() && messages_.size() >= max_messages_)
+            evict_oldest();
+        Message m;
+        m.started_ = now;
+        m.count_ = h.count_;
+        m.payload_bytes_ = 0;
+        m.bytes_ = MESSAGE_OVERHEAD;
+        it = messages_.insert(make_pair(key, std::move(m))).first;
+        stats_.pending_messages_++;
+        stats_.pending_bytes_ += MESSAGE_OVERHEAD;
+    } else if(it->second.count_ != h.count_) {
+        stats_.malformed_++;
+        return false;
+    }
+    Message& m = it->second;
+    if(is_in_container(m.fragments_, h.index_)) {
+        stats_.duplicates_++;
+        return false;
+    }
+    if(m.payload_bytes_ + size > MAX_REASSEMBLED_SIZE) {
+        stats_.malformed_++;
+        FILE_LOG(logDEBUG1) << "DatagramReassembler::add(): message " << h.message_id_ << " from " << from
+            << " is larger than any frame.";
+        erase(it);
+        return false;
+    }
+    const size_t cost = size + FRAGMENT_OVERHEAD;
+    // make room, but not by dropping the message this fragment is part of
+    // unless it is the only one
+    while(stats_.pending_bytes_ + cost > max_bytes_) {
+        if(messages_.size() == 1) {
+            stats_.evicted_++;
+            erase(it);
+            return false;
+        }
+        evict_oldest(&key);
+    }
+    m.fragments_[h.index_].assign(reinterpret_cast<const char*>(data), size);
+    m.payload_bytes_ += size;
+    m.bytes_ += cost;
+    stats_.pending_bytes_ += cost;
+    if(m.fragments_.size() < m.count_)
+        return false;
+    message.clear();
+    message.reserve(m.payload_bytes_);
+    for(auto& f : m.fragments_)
+        message.insert(message.end(), f.second.begin(), f.second.end());
+    erase(it);
+    stats_.completed_++;
+    return true;
+}
+
+void DatagramReassembler::erase(map<Key, Message>::iterator it) {
+    stats_.pending_bytes_ -= it->second.bytes_;
+    stats_.pending_messages_--;
+    messages_.erase(it);
+}
+
+void DatagramReassembler::expire(const TimePoint& now) {
+    last_expiry_ = now;
+    for(auto it = messages_.begin(); it != messages_.end(); ) {
+        if(now - it->second.started_ > timeout_) {
+            FILE_LOG(logDEBUG1) << "DatagramReassembler::expire(): message " << it->first.second << " from "
+                << it->first.first << " timed out with " << it->second.fragments_.size() << " of "
+                << it->second.count_ << " fragments.";
+            stats_.expired_++;
+            erase(it++);
+        } else
+            ++it;
+    }
+}
+
+void DatagramReassembler::evict_oldest(const Key* keep) {
+    auto oldest = messages_.end();
+    for(auto it = messages_.begin(); it != messages_.end(); ++it)
+        if((keep == nullptr || it->first != *keep) &&
+            (oldest == messages_.end() || it->second.started_ < oldest->second.started_))
+            oldest = it;
+    if(oldest == messages_.end())
+        return;
+    stats_.evicted_++;
+    erase(oldest);
+}
+
+} /* namespace mana */
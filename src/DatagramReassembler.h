@@ -0,0 +1,135 @@
+/**
+ * @file DatagramReassembler.h
+ * Fragmentation of messages over datagrams and their reassembly
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef DATAGRAMREASSEMBLER_H_
+#define DATAGRAMREASSEMBLER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <chrono>
+#include <boost/asio.hpp>
+#include "common.h"
+
+using namespace std;
+
+namespace mana {
+
+/*
+ * A message that fits in one datagram is sent as is. A larger one is sent
+ * as fragments, each a datagram that starts with this header:
+ *   magic (1 byte) | message id (4) | fragment count (2) | fragment index (2)
+ * all in network byte order. The magic byte tells fragments apart from
+ * whole frames, which start with BUFF_SEPERATOR (v1) or FRAME_V2_MAGIC (v2).
+ */
+const byte DATAGRAM_FRAGMENT_MAGIC = 0xF0;
+const size_t DATAGRAM_FRAGMENT_HEADER_SIZE = 9; // Bytes
+
+const unsigned int DEFAULT_REASSEMBLY_TIMEOUT_MILLISECONDS = 2000; // a message whose
+// fragments did not all arrive in this time is dropped
+const size_t DEFAULT_REASSEMBLY_MAX_BYTES = 32 * 1024 * 1024; // at most this many bytes,
+// bookkeeping included, ...
+const size_t DEFAULT_REASSEMBLY_MAX_MESSAGES = 4096; // ... of this many incomplete messages
+// are kept. The oldest ones are dropped to make room.
+
+struct DatagramFragmentHeader {
+    uint32_t message_id_;
+    uint16_t count_;
+    uint16_t index_;
+};
+
+/** @brief Write 'h' to 'out', which has room for DATAGRAM_FRAGMENT_HEADER_SIZE bytes */
+void encode_fragment_header(const DatagramFragmentHeader& h, byte* out);
+
+/**
+ * @brief If 'data' is a fragment, read its header into 'h' and return true.
+ */
+bool decode_fragment_header(const byte* data, size_t size, DatagramFragmentHeader& h);
+
+/**
+ * @brief Puts the fragments of messages received over a datagram transport
+ * back together.
+ *
+ * Fragments may arrive in any order and be duplicated or lost. Messages are
+ * told apart by their sender endpoint and message id. A message that is not
+ * complete within the timeout is dropped, as are the oldest incomplete
+ * messages when the memory cap is reached.
+ *
+ * This class is not thread safe; a receiver uses it from its read strand.
+ */
+class DatagramReassembler {
+public:
+    struct Stats {
+        Stats() : completed_(0), expired_(0), evicted_(0), duplicates_(0), malformed_(0),
+            pending_messages_(0), pending_bytes_(0) {}
+        unsigned long completed_;
+        unsigned long expired_; // dropped on timeout
+        unsigned long evicted_; // dropped to stay under the memory cap
+        unsigned long duplicates_;
+        unsigned long malformed_;
+        size_t pending_messages_;
+        size_t pending_bytes_; // fragments and their bookkeeping
+    };
+
+    DatagramReassembler(unsigned int timeout_ms = DEFAULT_REASSEMBLY_TIMEOUT_MILLISECONDS,
+        size_t max_bytes = DEFAULT_REASSEMBLY_MAX_BYTES, size_t max_messages = DEFAULT_REASSEMBLY_MAX_MESSAGES);
+
+    /**
+     * @brief Add the fragment 'data' received from 'from'. If it completes
+     * a message, the message is put in 'message' and true is returned.
+     */
+    bool add(const boost::asio::ip::udp::endpoint& from, const byte* data, size_t size,
+        vector<byte>& message);
+
+    const Stats& stats() const {
+        return stats_;
+    }
+
+private:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+    typedef pair<boost::asio::ip::udp::endpoint, uint32_t> Key;
+
+    // only the fragments that arrived are kept, so a fragment that claims
+    // a large count costs no more than any other
+    struct Message {
+        TimePoint started_;
+        uint16_t count_;
+        map<uint16_t, string> fragments_; // by index
+        size_t payload_bytes_;
+        size_t bytes_; // what is counted against the cap
+    };
+
+    void erase(map<Key, Message>::iterator it);
+    void expire(const TimePoint& now);
+    // drop the oldest incomplete message other than 'keep'
+    void evict_oldest(const Key* keep = nullptr);
+
+    const std::chrono::milliseconds timeout_;
+    const size_t max_bytes_;
+    const size_t max_messages_;
+    map<Key, Message> messages_;
+    TimePoint last_expiry_;
+    Stats stats_;
+};
+
+} /* namespace mana */
+
+#endif /* DATAGRAMREASSEMBLER_H_ */
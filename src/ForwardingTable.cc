@@ -0,0 +1,339 @@
+/**
+ * @file ForwardingTable.cc
+ * Forwarding table with lock-free readers
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include <assert.h>
+#include <algorithm>
+#include "ForwardingTable.h"
+#include "common.h"
+#include "Log.h"
+
+namespace mana {
+
+/*
+ * A siena::predicate over a list of shared filters. Unlike mana_predicate it
+ * does not own the filters, so we can hand the stored filters to
+ * siena::FwdTable::ifconfig without copying them.
+ */
+class shared_filter_predicate_i: public siena::predicate::iterator {
+public:
+    typedef map<string, shared_ptr<const ManaFilter>>::const_iterator filter_iterator;
+
+    shared_filter_predicate_i(filter_iterator b, filter_iterator e) : i(b), end(e) {}
+
+    virtual filter::iterator* first() const {
+        return (*i).second->first();
+    }
+
+    virtual bool next() {
+        if (i != end) ++i;
+        return i != end;
+    }
+
+private:
+    filter_iterator i;
+    filter_iterator end;
+};
+
+class shared_filter_predicate: public siena::predicate {
+public:
+    shared_filter_predicate(const map<string, shared_ptr<const ManaFilter>>& f) : filters(f) {}
+
+    virtual iterator* first() const {
+        if (filters.begin() == filters.end())
+            return 0;
+        return new shared_filter_predicate_i(filters.begin(), filters.end());
+    }
+
+private:
+    const map<string, shared_ptr<const ManaFilter>>& filters;
+};
+
+static atomic<uint64_t> next_table_id(1);
+
+ForwardingTable::ForwardingTable(size_t replicas) : pending_changes_(0),
+    window_(DEFAULT_REBUILD_WINDOW_MILLISECONDS), max_batch_(DEFAULT_REBUILD_MAX_BATCH),
+    flag_stop_(false), replicas_(replicas == 0 ? 1 : replicas), current_(nullptr), id_(next_table_id++),
+    flag_alive_(make_shared<atomic<bool>>(true)) {
+    // start with empty tables so readers never see a null snapshot
+    unique_ptr<Published> p(new Published());
+    for(size_t i = 0; i < replicas_; i++) {
+        p->tables_.emplace_back(new siena::FwdTable());
+        p->tables_.back()->consolidate();
+    }
+    current_.store(p.release());
+    rebuild_thread_ = thread(&ForwardingTable::rebuild_loop, this);
+}
+
+ForwardingTable::~ForwardingTable() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        flag_stop_ = true;
+    }
+    cond_.notify_one();
+    if(rebuild_thread_.joinable())
+        rebuild_thread_.join();
+    // no snapshot is held any more, and the callbacks of the retired tables
+    // are not called
+    delete current_.load();
+    *flag_alive_ = false;
+}
+
+ForwardingTable::Snapshot::~Snapshot() {
+    if(slot_ != nullptr && --slot_->depth_ == 0)
+        slot_->hazard_.store(nullptr, std::memory_order_release);
+}
+
+void ForwardingTable::add_filter(siena::if_t iface, const string& key, ManaFilter* f) {
+    shared_ptr<const ManaFilter> fltr(f);
+    lock_guard<mutex> lock(mutex_);
+    auto next = make_shared<FilterList>();
+    auto it = predicates_.find(iface);
+    if(it != predicates_.end())
+        *next = *it->second;
+    (*next)[key] = std::move(fltr);
+    predicates_[iface] = std::move(next);
+    mark_dirty();
+}
+
+void ForwardingTable::add_filters(siena::if_t iface, const vector<pair<string, ManaFilter*>>& filters) {
+    vector<shared_ptr<const ManaFilter>> fltrs;
+    fltrs.reserve(filters.size());
+    for(auto& f : filters)
+        fltrs.push_back(shared_ptr<const ManaFilter>(f.second));
+    lock_guard<mutex> lock(mutex_);
+    auto next = make_shared<FilterList>();
+    auto it = predicates_.find(iface);
+    if(it != predicates_.end())
+        *next = *it->second;
+    for(size_t i = 0; i < filters.size(); i++)
+        (*next)[filters[i].first] = std::move(fltrs[i]);
+    predicates_[iface] = std::move(next);
+    mark_dirty();
+}
+
+bool ForwardingTable::remove_filter(siena::if_t iface, const string& key) {
+    lock_guard<mutex> lock(mutex_);
+    auto it = predicates_.find(iface);
+    if(it == predicates_.end() || !is_in_container((*it->second), key))
+        return false;
+    auto next = make_shared<FilterList>(*it->second);
+    next->erase(key);
+    it->second = std::move(next);
+    mark_dirty();
+    return true;
+}
+
+void ForwardingTable::remove_filters(siena::if_t iface) {
+    lock_guard<mutex> lock(mutex_);
+    if(predicates_.erase(iface) > 0)
+        mark_dirty();
+}
+
+void ForwardingTable::remove_interface(siena::if_t iface, std::function<void()> on_purged) {
+    lock_guard<mutex> lock(mutex_);
+    predicates_.erase(iface);
+    pending_purges_.push_back(std::move(on_purged));
+    // even if the interface had no filters, an older snapshot may still have
+    // some, so we always go through a rebuild.
+    mark_dirty();
+}
+
+ForwardingTable::Snapshot ForwardingTable::snapshot(size_t replica) const {
+    assert(replica < replicas_);
+    // the reader slots of this thread, one per table it reads
+    struct ThreadSlots {
+        struct Entry {
+            uint64_t table_;
+            shared_ptr<atomic<bool>> table_alive_;
+            shared_ptr<ReaderSlot> slot_;
+        };
+        ~ThreadSlots() {
+            for(auto& e : entries_) {
+                e.slot_->hazard_.store(nullptr);
+                e.slot_->depth_ = 0;
+                e.slot_->flag_owned_.store(false, std::memory_order_release);
+            }
+        }
+        vector<Entry> entries_;
+    };
+    static thread_local ThreadSlots slots;
+    ReaderSlot* slot = nullptr;
+    for(size_t i = 0; i < slots.entries_.size(); ) {
+        auto& e = slots.entries_[i];
+        if(e.table_ == id_) {
+            slot = e.slot_.get();
+            i++;
+        } else if(!*e.table_alive_) {
+            // the table is gone, and so is any use of its slot
+            e = std::move(slots.entries_.back());
+            slots.entries_.pop_back();
+        } else {
+            i++;
+        }
+    }
+    if(slot == nullptr) {
+        slots.entries_.push_back(ThreadSlots::Entry{id_, flag_alive_, register_reader()});
+        slot = slots.entries_.back().slot_.get();
+    }
+    if(slot->depth_++ > 0)
+        return Snapshot(slot, slot->hazard_.load(std::memory_order_relaxed)->tables_[replica].get());
+    // announce the table, then check it is still the current one. Once it
+    // is, the rebuild thread sees the announcement before it frees the table.
+    Published* p = current_.load(std::memory_order_acquire);
+    for(;;) {
+        slot->hazard_.store(p);
+        Published* q = current_.load();
+        if(q == p)
+            break;
+        p = q;
+    }
+    return Snapshot(slot, p->tables_[replica].get());
+}
+
+shared_ptr<ForwardingTable::ReaderSlot> ForwardingTable::register_reader() const {
+    lock_guard<mutex> lock(readers_mutex_);
+    for(auto& r : readers_) {
+        bool owned = false;
+        if(r->flag_owned_.compare_exchange_strong(owned, true))
+            return r;
+    }
+    readers_.push_back(make_shared<ReaderSlot>());
+    return readers_.back();
+}
+
+void ForwardingTable::set_batch_window(unsigned int window_ms, size_t max_batch) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        window_ = std::chrono::milliseconds(window_ms);
+        max_batch_ = (max_batch == 0 ? 1 : max_batch);
+    }
+    cond_.notify_one();
+}
+
+ForwardingTable::Stats ForwardingTable::stats() {
+    lock_guard<mutex> lock(mutex_);
+    return stats_;
+}
+
+void ForwardingTable::mark_dirty() {
+    if(pending_changes_++ == 0)
+        batch_start_ = std::chrono::steady_clock::now();
+    // wake up the rebuild thread so it can (re)arm its timer or, if the
+    // batch is already full, start rebuilding right away.
+    if(pending_changes_ == 1 || pending_changes_ >= max_batch_)
+        cond_.notify_one();
+}
+
+void ForwardingTable::rebuild_loop() {
+    unique_lock<mutex> lock(mutex_);
+    while(!flag_stop_) {
+        if(pending_changes_ == 0) {
+            if(retired_.empty()) {
+                cond_.wait(lock);
+                continue;
+            }
+            // readers are done with a table within a lookup, but do not
+            // tell us, so we check again shortly
+            cond_.wait_for(lock, std::chrono::milliseconds(RETIRED_TABLES_SWEEP_MILLISECONDS));
+            lock.unlock();
+            reclaim();
+            lock.lock();
+            continue;
+        }
+        auto deadline = batch_start_ + window_;
+        if(pending_changes_ < max_batch_ && std::chrono::steady_clock::now() < deadline) {
+            cond_.wait_until(lock, deadline);
+            continue;
+        }
+        // take a copy of the store (only the pointers are copied) and build
+        // the new table without holding the lock, so subscriptions can still
+        // be ingested while we are busy.
+        PredicateStore preds = predicates_;
+        vector<std::function<void()>> purged;
+        purged.swap(pending_purges_);
+        const size_t batch_size = pending_changes_;
+        pending_changes_ = 0;
+        lock.unlock();
+        rebuild(preds, batch_size, std::move(purged));
+        reclaim();
+        lock.lock();
+    }
+}
+
+void ForwardingTable::rebuild(const PredicateStore& preds, size_t batch_size, vector<std::function<void()>>&& purged) {
+    auto start = std::chrono::steady_clock::now();
+    unique_ptr<Published> next(new Published());
+    for(size_t i = 0; i < replicas_; i++)
+        next->tables_.emplace_back(build_table(preds));
+    // publish the new tables. Threads that are still matching against the
+    // previous ones keep them from being freed until they are done. The
+    // interfaces purged in this batch may still be in the previous and older
+    // tables, so they are retired with the previous ones.
+    unique_ptr<Published> previous(current_.exchange(next.release()));
+    previous->on_retire_ = std::move(purged);
+    retired_.push_back(std::move(previous));
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    {
+        lock_guard<mutex> lock(mutex_);
+        stats_.rebuilds_++;
+        stats_.changes_ += batch_size;
+        stats_.last_batch_size_ = batch_size;
+        stats_.max_batch_size_ = max(stats_.max_batch_size_, batch_size);
+        stats_.last_rebuild_duration_ = duration;
+        stats_.max_rebuild_duration_ = max(stats_.max_rebuild_duration_, duration);
+    }
+    FILE_LOG(logDEBUG1) << "ForwardingTable::rebuild(): published a new table with " << preds.size() << " interfaces. Batch size: "
+        << batch_size << ", replicas: " << replicas_ << ", rebuild time: " << duration.count() << " us";
+}
+
+void ForwardingTable::reclaim() {
+    // the retired tables are no longer published, so a reader that announces
+    // one of them from now on sees that it is not current and moves on.
+    vector<const Published*> in_use;
+    {
+        lock_guard<mutex> lock(readers_mutex_);
+        for(auto& r : readers_) {
+            const Published* p = r->hazard_.load();
+            if(p != nullptr)
+                in_use.push_back(p);
+        }
+    }
+    for(auto& p : retired_)
+        if(!p->tables_.empty() && find(in_use.begin(), in_use.end(), p.get()) == in_use.end())
+            p->tables_.clear();
+    while(!retired_.empty() && retired_.front()->tables_.empty()) {
+        for(auto& f : retired_.front()->on_retire_)
+            f();
+        retired_.pop_front();
+    }
+}
+
+siena::FwdTable* ForwardingTable::build_table(const PredicateStore& preds) {
+    unique_ptr<siena::FwdTable> table(new siena::FwdTable());
+    for(auto& p : preds) {
+        if(p.second->empty())
+            continue;
+        table->ifconfig(p.first, shared_filter_predicate(*p.second));
+    }
+    table->consolidate();
+    return table.release();
+}
+
+} /* namespace mana */
@@ -0,0 +1,249 @@
+/**
+ * @file ForwardingTable.h
+ * Forwarding table with lock-free readers
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef FORWARDINGTABLE_H_
+#define FORWARDINGTABLE_H_
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <utility>
+#include <functional>
+#include <condition_variable>
+#include <siena/fwdtable.h>
+#include "ManaFwdTypes.h"
+#include "SPSCQueue.h"
+
+using namespace std;
+
+namespace mana {
+
+const unsigned int DEFAULT_REBUILD_WINDOW_MILLISECONDS = 50; // pending changes are
+// collected for at most this long before the table is rebuilt
+const size_t DEFAULT_REBUILD_MAX_BATCH = 5000; // ... or until this many changes are pending
+const unsigned int RETIRED_TABLES_SWEEP_MILLISECONDS = 10; // how often the tables replaced
+// by a rebuild are checked for readers until they are all freed
+
+/**
+ * @brief Keeps the predicates of all interfaces and publishes them as
+ * immutable siena::FwdTable snapshots.
+ *
+ * A siena::FwdTable can not be modified once it is consolidated, so
+ * subscription changes only update a per-interface predicate store. A
+ * background thread collects the pending changes for a configurable window
+ * (in time or in number of changes), builds a new table off to the side once
+ * per batch and swaps it in atomically. A matching thread announces the
+ * table it is matching against in a hazard pointer of its own for as long as
+ * it holds the snapshot, so a lookup takes no lock and shares no reference
+ * count with other threads (not even the lock libstdc++ takes for
+ * std::atomic_load of a shared_ptr). The rebuild thread frees a replaced
+ * table once no hazard pointer names it, so an idle thread holds no table.
+ *
+ * The table can keep several identical replicas of every snapshot, so that
+ * matching threads that each use their own replica do not share any of the
+ * table's memory (e.g., one replica per matching worker).
+ */
+class ForwardingTable {
+    struct Published;
+    struct ReaderSlot;
+
+public:
+    /**
+     * @brief A consolidated table that stays valid as long as the snapshot
+     * is held. A snapshot must be released by the thread that took it, and
+     * before the table is destroyed.
+     */
+    class Snapshot {
+    public:
+        Snapshot(Snapshot&& s) : slot_(s.slot_), table_(s.table_) {
+            s.slot_ = nullptr;
+        }
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        ~Snapshot();
+
+        const siena::FwdTable* operator->() const {
+            return table_;
+        }
+
+        const siena::FwdTable& operator*() const {
+            return *table_;
+        }
+
+    private:
+        friend class ForwardingTable;
+        Snapshot(ReaderSlot* slot, const siena::FwdTable* table) : slot_(slot), table_(table) {}
+
+        ReaderSlot* slot_;
+        const siena::FwdTable* table_;
+    };
+
+    /** @brief Counters of the background rebuilds */
+    struct Stats {
+        Stats() : rebuilds_(0), changes_(0), last_batch_size_(0), max_batch_size_(0),
+            last_rebuild_duration_(0), max_rebuild_duration_(0) {}
+        unsigned long rebuilds_; // number of published tables
+        unsigned long changes_; // number of changes folded into those tables
+        size_t last_batch_size_;
+        size_t max_batch_size_;
+        std::chrono::microseconds last_rebuild_duration_;
+        std::chrono::microseconds max_rebuild_duration_;
+    };
+
+    /**
+     * @brief Construct a table that publishes 'replicas' copies of every
+     * snapshot (at least one).
+     */
+    explicit ForwardingTable(size_t replicas = 1);
+    ForwardingTable(const ForwardingTable&) = delete;
+    ForwardingTable& operator=(const ForwardingTable&) = delete;
+    virtual ~ForwardingTable();
+
+    /**
+     * @brief Add a filter to the predicate of interface 'iface'. The table
+     * takes the ownership of 'f'.
+     *
+     * 'key' identifies the filter within the predicate (e.g., its serialized
+     * form) so it can be removed later. Adding a filter with a key that
+     * already exists replaces the old filter.
+     * The change becomes visible to matching threads with the next rebuild.
+     * This method is thread safe and does not wait for the rebuild.
+     */
+    void add_filter(siena::if_t iface, const string& key, ManaFilter* f);
+
+    /**
+     * @brief Add the filters of 'filters', with their keys, to the predicate
+     * of interface 'iface' as one change, e.g., all the filters a client
+     * subscribed to at once. The table takes the ownership of the filters.
+     * The predicate is copied once however many filters there are.
+     */
+    void add_filters(siena::if_t iface, const vector<pair<string, ManaFilter*>>& filters);
+
+    /**
+     * @brief Remove the filter with the given key from the predicate of
+     * interface 'iface'. Returns false if there is no such filter.
+     */
+    bool remove_filter(siena::if_t iface, const string& key);
+
+    /**
+     * @brief Remove all the filters of interface 'iface'.
+     */
+    void remove_filters(siena::if_t iface);
+
+    /**
+     * @brief Purge interface 'iface' from the table.
+     *
+     * 'on_purged' is called, by the rebuild thread, once no published
+     * snapshot that still contains the interface is in use by any thread,
+     * i.e., once it is safe to reuse the interface number. That is the end
+     * of the lookups that were running when the interface was removed from
+     * the table. It is not called if the table is destroyed first.
+     */
+    void remove_interface(siena::if_t iface, std::function<void()> on_purged);
+
+    /**
+     * @brief Get the current snapshot of the table. This method is thread safe
+     * and takes no lock, except on the first call of every thread. If the
+     * calling thread already holds a snapshot of this table, the returned
+     * one is of the same generation.
+     * @param replica which replica of the snapshot to return
+     */
+    Snapshot snapshot(size_t replica = 0) const;
+
+    size_t replicas() const {
+        return replicas_;
+    }
+
+    /**
+     * @brief Set how pending changes are batched. A rebuild starts when the
+     * oldest pending change is 'window_ms' milliseconds old or when
+     * 'max_batch' changes are pending, whichever happens first.
+     */
+    void set_batch_window(unsigned int window_ms, size_t max_batch);
+
+    Stats stats();
+
+private:
+    typedef map<string, shared_ptr<const ManaFilter>> FilterList;
+    // the per-interface predicates are copy-on-write so the rebuild thread
+    // can take a consistent copy of the store and build without the lock.
+    typedef map<siena::if_t, shared_ptr<const FilterList>> PredicateStore;
+
+    /*
+     * The replicas of one rebuild. Once replaced, it is retired; its tables
+     * are freed when no reader announces it any more, and its 'on_retire_'
+     * callbacks run once it and all the older ones are freed.
+     */
+    struct Published {
+        vector<unique_ptr<siena::FwdTable>> tables_; // emptied when freed
+        vector<std::function<void()>> on_retire_;
+    };
+
+    /*
+     * The hazard pointer of one reader thread. Only that thread writes to it
+     * and it is padded to a cache line of its own. A slot is reused by a
+     * new thread once the thread that had it exits.
+     */
+    struct ReaderSlot {
+        ReaderSlot() : hazard_(nullptr), depth_(0), flag_owned_(true) {}
+        atomic<const Published*> hazard_; // what the thread is matching against
+        unsigned int depth_; // number of snapshots the thread holds
+        atomic<bool> flag_owned_;
+        char pad_[CACHE_LINE_SIZE];
+    };
+
+    // 'mutex_' must be locked by the caller.
+    void mark_dirty();
+    void rebuild_loop();
+    void rebuild(const PredicateStore& preds, size_t batch_size, vector<std::function<void()>>&& purged);
+    // frees the retired tables that no reader uses. Only called by the rebuild thread.
+    void reclaim();
+    shared_ptr<ReaderSlot> register_reader() const;
+    static siena::FwdTable* build_table(const PredicateStore& preds);
+
+    mutex mutex_; // protects the members below up to 'pending_purges_'
+    condition_variable cond_;
+    PredicateStore predicates_;
+    size_t pending_changes_;
+    std::chrono::steady_clock::time_point batch_start_; // time of the oldest pending change
+    std::chrono::milliseconds window_;
+    size_t max_batch_;
+    bool flag_stop_;
+    Stats stats_;
+    vector<std::function<void()>> pending_purges_; // callbacks of removed interfaces
+    const size_t replicas_;
+    atomic<Published*> current_; // only replaced by the rebuild thread
+    deque<unique_ptr<Published>> retired_; // oldest first, only accessed by the rebuild thread
+    mutable mutex readers_mutex_; // protects 'readers_'
+    mutable vector<shared_ptr<ReaderSlot>> readers_;
+    const uint64_t id_; // tells the tables apart in the per-thread slot lists of snapshot()
+    shared_ptr<atomic<bool>> flag_alive_; // false once the table is destroyed
+    thread rebuild_thread_;
+};
+
+} /* namespace mana */
+
+#endif /* FORWARDINGTABLE_H_ */
@@ -0,0 +1,183 @@
+/**
+ * @file FrameBuffer.cc
+ * @brief A framed message, ready to be written to the network.
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include "FrameBuffer.h"
+#include "Compression.h"
+#include "ManaMessageProtobuf.pb.h"
+#include "Log.h"
+
+namespace mana {
+
+// frame a copy of the 'size' bytes of 'data' as they are
+static FrameBufferPtr copy_to_frame(const byte* data, size_t size, const FrameFormat& f, byte flags) {
+    size_t total_size = frame_size(f, size);
+    auto frame = make_shared<FrameBuffer>(total_size);
+    byte* arr_buf = frame->data();
+    size_t header_size = encode_frame_header(f, size, arr_buf, flags);
+    memcpy(arr_buf + header_size, data, size);
+    encode_frame_trailer(f, arr_buf + header_size, size, arr_buf + header_size + size);
+    frame->set_message(header_size, size, f);
+    return frame;
+}
+
+// frame the serialized message 'data', compressed if 'f' calls for it and
+// it comes out smaller
+static FrameBufferPtr frame_message(const byte* data, size_t size, const FrameFormat& f, byte flags = 0) {
+    if(frame_size(f, size) > MAX_MSG_SIZE) {
+    	FILE_LOG(logWARNING) << "make_frame(): Message size is more than the allowed limit (" << MAX_MSG_SIZE << " Bytes). Message was discarded.";
+        return nullptr;
+    }
+    if(f.compresses(size)) {
+        PooledBuffer compressed(compressed_message_bound(size));
+        size_t n = compress_message(f.codec_, data, size, compressed.data());
+        if(n > 0)
+            return copy_to_frame(compressed.data(), n, f, flags | FRAME_FLAG_COMPRESSED);
+    }
+    return copy_to_frame(data, size, f, flags);
+}
+
+FrameBufferPtr make_frame(const ManaMessageProtobuf& msg, const FrameFormat& f) {
+    size_t data_size = msg.ByteSize();
+    if(f.compresses(data_size)) {
+        // serialize the message and compress it from there
+        PooledBuffer plain(data_size);
+        if(msg.SerializeWithCachedSizesToArray(plain.data()) == nullptr) {
+        	FILE_LOG(logERROR) << "make_frame(): Could not serialize message to buffer.";
+            return nullptr;
+        }
+        return frame_message(plain.data(), data_size, f);
+    }
+    // add the frame header and then serialize the message into a protobuf
+    size_t total_size = frame_size(f, data_size);
+    if(total_size > MAX_MSG_SIZE) {
+    	FILE_LOG(logWARNING) << "make_frame(): Message size is more than the allowed limit (" << MAX_MSG_SIZE << " Bytes). Message was discarded.";
+        return nullptr;
+    }
+    auto frame = make_shared<FrameBuffer>(total_size);
+    byte* arr_buf = frame->data();
+    size_t header_size = encode_frame_header(f, data_size, arr_buf);
+    if(msg.SerializeWithCachedSizesToArray(arr_buf + header_size) == nullptr) {
+    	FILE_LOG(logERROR) << "make_frame(): Could not serialize message to buffer.";
+        return nullptr;
+    }
+    encode_frame_trailer(f, arr_buf + header_size, data_size, arr_buf + header_size + data_size);
+    frame->set_message(header_size, data_size, f);
+    return frame;
+}
+
+FrameBufferPtr make_frame(const byte* data, size_t size, const string& sender, const FrameFormat& f) {
+    using google::protobuf::io::CodedOutputStream;
+    using google::protobuf::internal::WireFormatLite;
+    const uint32_t tag = WireFormatLite::MakeTag(ManaMessageProtobuf::kSenderFieldNumber,
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    size_t field_size = CodedOutputStream::VarintSize32(tag) +
+        CodedOutputStream::VarintSize32(sender.size()) + sender.size();
+    size_t data_size = size + field_size;
+    if(f.compresses(data_size)) {
+        PooledBuffer plain(data_size);
+        memcpy(plain.data(), data, size);
+        WireFormatLite::WriteStringToArray(ManaMessageProtobuf::kSenderFieldNumber, sender, plain.data() + size);
+        return frame_message(plain.data(), data_size, f);
+    }
+    size_t total_size = frame_size(f, data_size);
+    if(total_size > MAX_MSG_SIZE) {
+    	FILE_LOG(logWARNING) << "make_frame(): Message size is more than the allowed limit (" << MAX_MSG_SIZE << " Bytes). Message was discarded.";
+        return nullptr;
+    }
+    auto frame = make_shared<FrameBuffer>(total_size);
+    byte* arr_buf = frame->data();
+    size_t header_size = encode_frame_header(f, data_size, arr_buf);
+    memcpy(arr_buf + header_size, data, size);
+    byte* end = WireFormatLite::WriteStringToArray(ManaMessageProtobuf::kSenderFieldNumber,
+        sender, arr_buf + header_size + size);
+    end += encode_frame_trailer(f, arr_buf + header_size, data_size, end);
+    assert(end == arr_buf + total_size);
+    frame->set_message(header_size, data_size, f);
+    return frame;
+}
+
+FrameBufferPtr make_batch_frame(const ManaMessageProtobuf* msgs, size_t n, const FrameFormat& f) {
+    assert(f.flag_batch_);
+    size_t size = 0;
+    for(size_t i = 0; i < n; i++) {
+        size_t msg_size = msgs[i].ByteSize();
+        size += varint_size(msg_size) + msg_size;
+    }
+    if(frame_size(f, size) > MAX_MSG_SIZE) {
+    	FILE_LOG(logWARNING) << "make_batch_frame(): Batch size is more than the allowed limit (" << MAX_MSG_SIZE << " Bytes). Batch was discarded.";
+        return nullptr;
+    }
+    // the messages are serialized once, into the batch, and the batch is
+    // framed from there
+    PooledBuffer batch(size);
+    byte* p = batch.data();
+    for(size_t i = 0; i < n; i++) {
+        p = encode_varint(msgs[i].GetCachedSize(), p);
+        p = msgs[i].SerializeWithCachedSizesToArray(p);
+        if(p == nullptr) {
+        	FILE_LOG(logERROR) << "make_batch_frame(): Could not serialize message to buffer.";
+            return nullptr;
+        }
+    }
+    assert(p == batch.data() + size);
+    return frame_message(batch.data(), size, f, FRAME_FLAG_BATCH);
+}
+
+FrameBufferPtr make_batch_frame(const vector<FrameBufferPtr>& frames, const FrameFormat& f) {
+    assert(f.flag_batch_);
+    size_t size = 0;
+    for(auto& frame : frames) {
+        assert(!frame->is_compressed() && !frame->is_batch());
+        size += varint_size(frame->message_size()) + frame->message_size();
+    }
+    if(frame_size(f, size) > MAX_MSG_SIZE)
+        return nullptr;
+    PooledBuffer batch(size);
+    byte* p = batch.data();
+    for(auto& frame : frames) {
+        p = encode_varint(frame->message_size(), p);
+        memcpy(p, frame->message(), frame->message_size());
+        p += frame->message_size();
+    }
+    return frame_message(batch.data(), size, f, FRAME_FLAG_BATCH);
+}
+
+FrameBufferPtr reframe(const FrameBufferPtr& frame, const FrameFormat& f) {
+    if(frame->format() == f)
+        return frame;
+    const byte flags = frame->is_batch() ? FRAME_FLAG_BATCH : 0;
+    assert(flags == 0 || f.flag_batch_);
+    if(!frame->is_compressed())
+        return frame_message(frame->message(), frame->message_size(), f, flags);
+    long size = uncompressed_message_size(frame->message(), frame->message_size());
+    assert(size >= 0);
+    PooledBuffer plain(size);
+    if(!decompress_message(frame->message(), frame->message_size(), plain.data())) {
+    	FILE_LOG(logERROR) << "reframe(): Could not decompress the message.";
+        return nullptr;
+    }
+    return frame_message(plain.data(), size, f, flags);
+}
+
+} /* namespace mana */
@@ -0,0 +1,150 @@
+/**
+ * @file FrameBuffer.h
+ * @brief A framed message, ready to be written to the network.
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef FRAMEBUFFER_H_
+#define FRAMEBUFFER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "BufferPool.h"
+#include "FrameFormat.h"
+
+using namespace std;
+
+namespace mana {
+
+class ManaMessageProtobuf;
+
+/**
+ * @brief A buffer holding one message with its frame header.
+ *
+ * Once filled in, a frame is never modified, so it can be shared through a
+ * FrameBufferPtr by any number of senders. This is how a notification that
+ * matches many interfaces is encoded once and written to all of them. The
+ * memory comes from the BufferPool and goes back to it after the last sender
+ * is done with it.
+ */
+class FrameBuffer {
+public:
+    explicit FrameBuffer(size_t size) : data_(BufferPool::instance().allocate(size)), size_(size),
+        message_offset_(0), message_size_(0) {}
+    ~FrameBuffer() {
+        BufferPool::instance().release(data_, size_);
+    }
+    FrameBuffer(const FrameBuffer&) = delete;
+    FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+    byte* data() {
+        return data_;
+    }
+
+    const byte* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    /** @brief The serialized message in the frame, as it is sent */
+    const byte* message() const {
+        return data_ + message_offset_;
+    }
+
+    size_t message_size() const {
+        return message_size_;
+    }
+
+    /** @brief True if the message in the frame is compressed */
+    bool is_compressed() const {
+        return size_ > 1 && data_[0] == FRAME_V2_MAGIC && (data_[1] & FRAME_FLAG_COMPRESSED);
+    }
+
+    /** @brief True if the message in the frame is a batch of messages */
+    bool is_batch() const {
+        return size_ > 1 && data_[0] == FRAME_V2_MAGIC && (data_[1] & FRAME_FLAG_BATCH);
+    }
+
+    /** @brief The format of the frame */
+    const FrameFormat& format() const {
+        return format_;
+    }
+
+    void set_message(size_t offset, size_t size, const FrameFormat& f) {
+        message_offset_ = offset;
+        message_size_ = size;
+        format_ = f;
+    }
+
+private:
+    byte* data_;
+    const size_t size_;
+    size_t message_offset_;
+    size_t message_size_;
+    FrameFormat format_;
+};
+
+typedef shared_ptr<const FrameBuffer> FrameBufferPtr;
+
+/**
+ * @brief Serialize 'msg' into a new frame of format 'f' (header followed by
+ * the protobuf, compressed if 'f' calls for it). Returns nullptr if the
+ * message can not be framed, e.g., because it is larger than MAX_MSG_SIZE.
+ */
+FrameBufferPtr make_frame(const ManaMessageProtobuf& msg, const FrameFormat& f = FrameFormat());
+
+/**
+ * @brief Frame an already serialized ManaMessageProtobuf as is, but with
+ * 'sender' as its sender.
+ *
+ * The message is not parsed; the sender field is appended to 'data' and,
+ * since the last occurrence of a field wins when a protobuf is parsed, it
+ * overrides the original sender. Returns nullptr if the frame would be
+ * larger than MAX_MSG_SIZE.
+ */
+FrameBufferPtr make_frame(const byte* data, size_t size, const string& sender,
+    const FrameFormat& f = FrameFormat());
+
+/**
+ * @brief Serialize the 'n' messages at 'msgs' into a new batch frame of
+ * format 'f', which must take batches. Returns nullptr if the frame would be
+ * larger than MAX_MSG_SIZE.
+ */
+FrameBufferPtr make_batch_frame(const ManaMessageProtobuf* msgs, size_t n, const FrameFormat& f);
+
+/**
+ * @brief Put the messages of 'frames', which are not compressed nor batches
+ * themselves, in a new batch frame of format 'f'. The messages are copied as
+ * they are. Returns nullptr if the frame would be larger than MAX_MSG_SIZE.
+ */
+FrameBufferPtr make_batch_frame(const vector<FrameBufferPtr>& frames, const FrameFormat& f);
+
+/**
+ * @brief The message of 'frame' in a frame of format 'f'. If 'frame' is
+ * already of that format it is returned as is. A batch stays a batch, so
+ * 'f' must take batches then.
+ */
+FrameBufferPtr reframe(const FrameBufferPtr& frame, const FrameFormat& f);
+
+} /* namespace mana */
+
+#endif /* FRAMEBUFFER_H_ */
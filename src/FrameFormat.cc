@@ -0,0 +1,163 @@
+/**
+ * @file FrameFormat.cc
+ * The formats of the frames messages are sent in
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include <string.h>
+#include <algorithm>
+#include "FrameFormat.h"
+#include "Crc32c.h"
+#include "ManaException.h"
+#include "ManaMessageProtobuf.pb.h"
+
+namespace mana {
+
+// the keys of START_SESSION and START_SESSION_ACK the format is listed with
+static const char* FRAME_VERSION_KEY = "frame_version";
+static const char* FRAME_CHECKSUM_KEY = "frame_checksum";
+static const char* FRAME_COMPRESSION_KEY = "frame_compression";
+static const char* FRAME_BATCH_KEY = "frame_batch";
+static const char* CRC32C_NAME = "crc32c";
+
+FrameFormat FrameFormat::from_url(const URL& url) {
+    size_t version = url.size_option("frame", FRAME_VERSION_2);
+    if(version != FRAME_VERSION_1 && version != FRAME_VERSION_2)
+        throw ManaException("Invalid frame version in " + url.url());
+    size_t crc = url.size_option("crc", 0);
+    if(crc > 1)
+        throw ManaException("Invalid crc option in " + url.url());
+    CompressionCodec codec;
+    if(!compression_from_name(url.option("compression", compression_name(compression_none)), codec))
+        throw ManaException("Invalid compression in " + url.url());
+    size_t compress_min = url.size_option("compress_min", DEFAULT_COMPRESSION_MIN_SIZE);
+    size_t batch = url.size_option("batches", 1);
+    if(batch > 1)
+        throw ManaException("Invalid batches option in " + url.url());
+    bool v2 = (version == FRAME_VERSION_2);
+    return FrameFormat(static_cast<byte>(version), v2 && crc == 1, v2 ? codec : compression_none, compress_min,
+        v2 && batch == 1);
+}
+
+FrameFormat FrameFormat::agree(const FrameFormat& a, const FrameFormat& b) {
+    byte version = std::min(a.version_, b.version_);
+    bool v2 = (version == FRAME_VERSION_2);
+    // either side may ask for checksums or compression. Every node that
+    // takes v2 frames takes compressed ones.
+    CompressionCodec codec = (a.codec_ != compression_none ? a.codec_ : b.codec_);
+    // batches only if both take them, as older nodes drop them
+    return FrameFormat(version, v2 && (a.flag_crc_ || b.flag_crc_), v2 ? codec : compression_none, a.compress_min_,
+        v2 && a.flag_batch_ && b.flag_batch_);
+}
+
+FrameFormat FrameFormat::answered(const FrameFormat& local, const FrameFormat& answer) {
+    byte version = std::min(local.version_, answer.version_);
+    bool v2 = (version == FRAME_VERSION_2);
+    return FrameFormat(version, v2 && answer.flag_crc_, v2 ? answer.codec_ : compression_none, local.compress_min_,
+        v2 && local.flag_batch_ && answer.flag_batch_);
+}
+
+FrameFormat FrameFormat::from_message(const ManaMessageProtobuf& msg) {
+    // a node that does not list a format only knows v1
+    FrameFormat f;
+    for(auto& kv : msg.key_value_map()) {
+        if(kv.key() == FRAME_VERSION_KEY)
+            f.version_ = kv.value() == "2" ? FRAME_VERSION_2 : FRAME_VERSION_1;
+        else if(kv.key() == FRAME_CHECKSUM_KEY)
+            f.flag_crc_ = kv.value() == CRC32C_NAME;
+        else if(kv.key() == FRAME_COMPRESSION_KEY && !compression_from_name(kv.value(), f.codec_))
+            f.codec_ = compression_none; // one we do not know
+        else if(kv.key() == FRAME_BATCH_KEY)
+            f.flag_batch_ = kv.value() == "1";
+    }
+    if(f.version_ != FRAME_VERSION_2) {
+        f.flag_crc_ = false;
+        f.codec_ = compression_none;
+        f.flag_batch_ = false;
+    }
+    return f;
+}
+
+void FrameFormat::add_to_message(ManaMessageProtobuf& msg) const {
+    auto p = msg.mutable_key_value_map()->Add();
+    p->set_key(FRAME_VERSION_KEY);
+    p->set_value(to_string(version_));
+    if(flag_crc_) {
+        p = msg.mutable_key_value_map()->Add();
+        p->set_key(FRAME_CHECKSUM_KEY);
+        p->set_value(CRC32C_NAME);
+    }
+    if(codec_ != compression_none) {
+        p = msg.mutable_key_value_map()->Add();
+        p->set_key(FRAME_COMPRESSION_KEY);
+        p->set_value(compression_name(codec_));
+    }
+    if(flag_batch_) {
+        p = msg.mutable_key_value_map()->Add();
+        p->set_key(FRAME_BATCH_KEY);
+        p->set_value("1");
+    }
+}
+
+string frame_format_name(const FrameFormat& f) {
+    string name = "v" + to_string(f.version_);
+    if(f.flag_crc_)
+        name += " with checksums";
+    if(f.codec_ != compression_none)
+        name += string(", ") + compression_name(f.codec_) + " from " +
+            to_string(f.compress_min_) + " bytes";
+    if(f.flag_batch_)
+        name += ", batches";
+    return name;
+}
+
+size_t frame_size(const FrameFormat& f, size_t size) {
+    if(f.version_ == FRAME_VERSION_1)
+        return MSG_HEADER_SIZE + size;
+    return 2 + varint_size(size) + size + (f.flag_crc_ ? FRAME_CRC_SIZE : 0);
+}
+
+size_t encode_frame_header(const FrameFormat& f, size_t size, byte* out, byte flags) {
+    if(f.version_ == FRAME_VERSION_1) {
+        int length = static_cast<int>(size);
+        out[0] = BUFF_SEPERATOR;
+        memcpy(out + BUFF_SEPERATOR_LEN_BYTE, &length, sizeof(length));
+        return MSG_HEADER_SIZE;
+    }
+    out[0] = FRAME_V2_MAGIC;
+    out[1] = flags | (f.flag_crc_ ? FRAME_FLAG_CRC32C : 0);
+    return encode_varint(size, out + 2) - out;
+}
+
+size_t encode_frame_trailer(const FrameFormat& f, const byte* message, size_t size, byte* out) {
+    if(f.version_ == FRAME_VERSION_1 || !f.flag_crc_)
+        return 0;
+    uint32_t crc = crc32c(message, size);
+    for(int i = 0; i < FRAME_CRC_SIZE; i++)
+        out[i] = static_cast<byte>(crc >> (8 * i));
+    return FRAME_CRC_SIZE;
+}
+
+bool check_frame_trailer(const FrameHeader& h, const byte* message) {
+    if(h.trailer_size_ == 0)
+        return true;
+    const byte* p = message + h.message_size_;
+    uint32_t crc = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    return crc == crc32c(message, h.message_size_);
+}
+
+} /* namespace mana */
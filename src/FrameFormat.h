@@ -0,0 +1,274 @@
+/**
+ * @file FrameFormat.h
+ * The formats of the frames messages are sent in
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef FRAMEFORMAT_H_
+#define FRAMEFORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "URL.h"
+#include "Compression.h"
+
+namespace mana {
+
+class ManaMessageProtobuf;
+
+/*
+ * A message is sent in a frame of one of two versions:
+ *
+ *  v1: BUFF_SEPERATOR (1 byte) | length (int, host byte order) | message
+ *
+ *  v2: FRAME_V2_MAGIC (1 byte) | flags (1) | length (varint) | message
+ *      | CRC-32C of the message (4, little endian), if FRAME_FLAG_CRC32C
+ *
+ * The message of a v2 frame with FRAME_FLAG_COMPRESSED is compressed, see
+ * Compression.h; the length and the checksum are those of what is sent.
+ * The message of a v2 frame with FRAME_FLAG_BATCH is a batch of messages,
+ * each preceded by its length (varint); a batch is compressed as a whole.
+ * The varint is the base 128 encoding of protobuf, at most 5 bytes. The
+ * high nibble of the first byte of a v2 frame is FRAME_MAGIC, the low one
+ * the version. Receivers take frames of both versions; a sender only uses
+ * v2 once the peer has agreed to it when the session was started.
+ */
+const byte FRAME_VERSION_1 = 1;
+const byte FRAME_VERSION_2 = 2;
+const byte FRAME_MAGIC = 0xB0;
+const byte FRAME_V2_MAGIC = FRAME_MAGIC | FRAME_VERSION_2;
+const byte FRAME_FLAG_CRC32C = 0x01; // the message is followed by its checksum
+const byte FRAME_FLAG_COMPRESSED = 0x02;
+const byte FRAME_FLAG_BATCH = 0x04; // the message is a batch of messages
+const byte FRAME_KNOWN_FLAGS = FRAME_FLAG_CRC32C | FRAME_FLAG_COMPRESSED | FRAME_FLAG_BATCH; // frames
+// with other flags are dropped
+const int FRAME_V2_MAX_HEADER_SIZE = 2 + 5; // Bytes
+const int FRAME_MAX_HEADER_SIZE = FRAME_V2_MAX_HEADER_SIZE;
+const int FRAME_CRC_SIZE = 4; // Bytes
+const size_t DEFAULT_COMPRESSION_MIN_SIZE = 512; // Bytes, smaller messages are not compressed
+
+/**
+ * @brief The frames a sender writes: their version, whether they carry a
+ * checksum and how their messages are compressed.
+ *
+ * The formats a node supports are set with the options of its URL:
+ * frame=1 keeps it to v1 frames, crc=1 asks for checksums and
+ * compression=lz4 asks for the messages of at least compress_min bytes
+ * (default DEFAULT_COMPRESSION_MIN_SIZE) to be compressed, e.g.,
+ * tcp:127.0.0.1:2350?crc=1&compression=lz4. Nodes that take v2 frames take
+ * batches too, unless batches=0 is set. The session initiator lists
+ * what it supports in START_SESSION; the broker answers with the format
+ * both sides are to use in START_SESSION_ACK.
+ */
+struct FrameFormat {
+    FrameFormat(byte version = FRAME_VERSION_1, bool crc = false, CompressionCodec codec = compression_none,
+        size_t compress_min = DEFAULT_COMPRESSION_MIN_SIZE, bool batch = false) :
+        version_(version), flag_crc_(crc), codec_(codec), compress_min_(compress_min), flag_batch_(batch) {}
+
+    /** @brief What the URL of a node allows. Throws {@link ManaException} on invalid options. */
+    static FrameFormat from_url(const URL& url);
+
+    /**
+     * @brief The format two nodes that support 'a' and 'b' use. Messages
+     * are compressed from the size 'a' compresses them from.
+     */
+    static FrameFormat agree(const FrameFormat& a, const FrameFormat& b);
+
+    /**
+     * @brief The format a node that supports 'local' uses once the remote
+     * node answered with 'answer', i.e., what the remote node takes.
+     */
+    static FrameFormat answered(const FrameFormat& local, const FrameFormat& answer);
+
+    /** @brief Read the format listed in a START_SESSION or START_SESSION_ACK */
+    static FrameFormat from_message(const ManaMessageProtobuf& msg);
+
+    /** @brief List this format in a START_SESSION or START_SESSION_ACK */
+    void add_to_message(ManaMessageProtobuf& msg) const;
+
+    /** @brief True if a message of 'size' bytes is to be compressed */
+    bool compresses(size_t size) const {
+        return codec_ != compression_none && size >= compress_min_;
+    }
+
+    /**
+     * @brief True if a message is framed the same in this format and in 'f',
+     * e.g., to share a frame between the senders of both. Whether batches
+     * are taken is left out.
+     */
+    bool frames_like(const FrameFormat& f) const {
+        if(version_ != f.version_)
+            return false;
+        return version_ == FRAME_VERSION_1 || (flag_crc_ == f.flag_crc_ && codec_ == f.codec_ &&
+            (codec_ == compression_none || compress_min_ == f.compress_min_));
+    }
+
+    /**
+     * @brief This format in one word, so that it can be kept in an atomic.
+     * compress_min_ is capped at 2^40 - 1 bytes.
+     */
+    uint64_t pack() const {
+        const uint64_t min = compress_min_ < (uint64_t(1) << 40) ? compress_min_ : (uint64_t(1) << 40) - 1;
+        return uint64_t(version_) | (flag_crc_ ? uint64_t(1) << 8 : 0) | (flag_batch_ ? uint64_t(1) << 9 : 0) |
+            (uint64_t(codec_) & 0xFF) << 16 | min << 24;
+    }
+
+    /** @brief The format 'packed' was made from by pack() */
+    static FrameFormat unpack(uint64_t packed) {
+        return FrameFormat(static_cast<byte>(packed & 0xFF), (packed >> 8) & 1,
+            static_cast<CompressionCodec>((packed >> 16) & 0xFF), static_cast<size_t>(packed >> 24),
+            (packed >> 9) & 1);
+    }
+
+    bool operator==(const FrameFormat& f) const {
+        return version_ == f.version_ && flag_crc_ == f.flag_crc_ && codec_ == f.codec_ &&
+            compress_min_ == f.compress_min_ && flag_batch_ == f.flag_batch_;
+    }
+
+    byte version_;
+    bool flag_crc_; // v2 only
+    CompressionCodec codec_; // v2 only
+    size_t compress_min_;
+    bool flag_batch_; // v2 only, the frames may be batches
+};
+
+/** @brief 'f' for the log, e.g., "v2 with checksums, lz4 from 512 bytes" */
+string frame_format_name(const FrameFormat& f);
+
+/** @brief The size of the varint of 'v' */
+inline size_t varint_size(size_t v) {
+    size_t n = 1;
+    for(; v >= 0x80; v >>= 7)
+        n++;
+    return n;
+}
+
+/** @brief Write the varint of 'v' to 'out'. Returns the byte after it. */
+inline byte* encode_varint(size_t v, byte* out) {
+    for(; v >= 0x80; v >>= 7)
+        *out++ = static_cast<byte>(v | 0x80);
+    *out++ = static_cast<byte>(v);
+    return out;
+}
+
+/**
+ * @brief Read the varint at the start of 'size' bytes of 'data' into 'v'.
+ * Returns its size, or 0 if it is cut short or longer than 5 bytes.
+ */
+inline int decode_varint(const byte* data, int size, uint32_t& v) {
+    v = 0;
+    for(int i = 0; i < size && i < 5; i++) {
+        v |= static_cast<uint32_t>(data[i] & 0x7F) << (7 * i);
+        if((data[i] & 0x80) == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+/** @brief The header of a frame that was received */
+struct FrameHeader {
+    byte version_;
+    byte flags_;
+    int header_size_;
+    int message_size_;
+    int trailer_size_; // the checksum
+
+    int frame_size() const {
+        return header_size_ + message_size_ + trailer_size_;
+    }
+};
+
+/**
+ * @brief Read the frame header at the start of 'size' bytes of 'data'.
+ * Returns 1 if it was read into 'h', 0 if more data is needed to tell and
+ * -1 if it is not a valid header.
+ */
+inline int decode_frame_header(const byte* data, int size, FrameHeader& h) {
+    if(size < 1)
+        return 0;
+    if(data[0] == BUFF_SEPERATOR) {
+        if(size < MSG_HEADER_SIZE)
+            return 0;
+        int length;
+        memcpy(&length, data + BUFF_SEPERATOR_LEN_BYTE, sizeof(length));
+        if(length < 0 || length > MAX_MSG_SIZE - MSG_HEADER_SIZE)
+            return -1;
+        h.version_ = FRAME_VERSION_1;
+        h.flags_ = 0;
+        h.header_size_ = MSG_HEADER_SIZE;
+        h.message_size_ = length;
+        h.trailer_size_ = 0;
+        return 1;
+    }
+    if(data[0] != FRAME_V2_MAGIC)
+        return -1;
+    if(size < 2)
+        return 0;
+    // the length of most messages takes one or two bytes
+    uint32_t length;
+    int i; // the last byte of the length
+    if(size > 2 && data[2] < 0x80) {
+        length = data[2];
+        i = 2;
+    } else if(size > 3 && data[3] < 0x80) {
+        length = (data[2] & 0x7F) | (static_cast<uint32_t>(data[3]) << 7);
+        i = 3;
+    } else {
+        length = 0;
+        for(i = 2; ; i++) {
+            if(i == FRAME_V2_MAX_HEADER_SIZE)
+                return -1;
+            if(i == size)
+                return 0;
+            length |= static_cast<uint32_t>(data[i] & 0x7F) << (7 * (i - 2));
+            if((data[i] & 0x80) == 0)
+                break;
+        }
+    }
+    h.version_ = FRAME_VERSION_2;
+    h.flags_ = data[1];
+    h.header_size_ = i + 1;
+    h.trailer_size_ = (h.flags_ & FRAME_FLAG_CRC32C) ? FRAME_CRC_SIZE : 0;
+    if(length > static_cast<uint32_t>(MAX_MSG_SIZE - h.header_size_ - h.trailer_size_))
+        return -1;
+    h.message_size_ = static_cast<int>(length);
+    return 1;
+}
+
+/** @brief The size of a frame of 'f' around a message of 'size' bytes */
+size_t frame_size(const FrameFormat& f, size_t size);
+
+/**
+ * @brief Write the header of a frame of 'f' for a message of 'size' bytes to
+ * 'out', and return its size. 'flags' are added to those of the format.
+ */
+size_t encode_frame_header(const FrameFormat& f, size_t size, byte* out, byte flags = 0);
+
+/**
+ * @brief Write what follows the message of a frame of 'f', i.e., the
+ * checksum of the 'size' bytes at 'message', to 'out'. Returns its size.
+ */
+size_t encode_frame_trailer(const FrameFormat& f, const byte* message, size_t size, byte* out);
+
+/** @brief True if the trailer of the frame of 'h' matches its 'message' */
+bool check_frame_trailer(const FrameHeader& h, const byte* message);
+
+} /* namespace mana */
+
+#endif /* FRAMEFORMAT_H_ */
@@ -40,9 +40,10 @@ namespace mana {
 ManaContext::ManaContext(const string& id, const string& loc_url, const string& rem_url,
 		std::function<void(const ManaMessage&)> h) :
     local_id_(id), local_url_(loc_url), remote_url_(rem_url), app_notification_handler_(h),
-    flag_has_subscription(false), task_scheduler_(io_service_) {
+    flag_has_subscription(false), task_scheduler_(io_service_), batch_linger_(0), batch_max_(0),
+    batch_generation_(0), batch_timer_(io_service_), flag_format_agreed_(false) {
 
-	session_ = make_shared<Session<ManaContext>>(*this, local_url_, remote_url_, remote_url_.url(), 0);
+	session_ = Session<ManaContext>::create(*this, local_url_, remote_url_, remote_url_.url(), 0);
 	message_receiver_ = MessageReceiver<ManaContext>::create(io_service_, *this, local_url_);
 	assert(message_receiver_ != nullptr);
 }
@@ -58,6 +59,22 @@ void ManaContext::publish(const string& str) {
 }
 
 void ManaContext::publish(const ManaMessage& msg) {
+    if(batch_max_ > 1) {
+        lock_guard<mutex> lock(batch_mutex_);
+        batch_.emplace_back();
+        ManaMessageProtobuf& buff = batch_.back();
+        buff.set_sender(local_id_);
+        to_protobuf(msg, buff);
+        assert(buff.IsInitialized());
+        if(batch_.size() >= batch_max_)
+            flush_batch();
+        else if(batch_.size() == 1) {
+            batch_timer_.expires_from_now(batch_linger_);
+            batch_timer_.async_wait(std::bind(&ManaContext::handle_linger, this, std::placeholders::_1,
+                batch_generation_));
+        }
+        return;
+    }
     ManaMessageProtobuf buff;
     // set the sender id
     buff.set_sender(local_id_);
@@ -68,6 +85,82 @@ void ManaContext::publish(const ManaMessage& msg) {
     send_message(buff);
 }
 
+void ManaContext::publish_batch(const vector<ManaMessage>& msgs) {
+    if(msgs.empty())
+        return;
+    vector<ManaMessageProtobuf> batch(msgs.size());
+    for(size_t i = 0; i < msgs.size(); i++) {
+        batch[i].set_sender(local_id_);
+        to_protobuf(msgs[i], batch[i]);
+        assert(batch[i].IsInitialized());
+    }
+    // what was published before goes first
+    lock_guard<mutex> lock(batch_mutex_);
+    if(!batch_.empty())
+        flush_batch();
+    send_batch(batch.data(), batch.size());
+}
+
+void ManaContext::set_batching(unsigned int linger_us, size_t max_batch) {
+    lock_guard<mutex> lock(batch_mutex_);
+    if(!batch_.empty())
+        flush_batch();
+    batch_linger_ = std::chrono::microseconds(linger_us);
+    batch_max_ = max_batch;
+}
+
+void ManaContext::flush() {
+    lock_guard<mutex> lock(batch_mutex_);
+    if(!batch_.empty())
+        flush_batch();
+}
+
+void ManaContext::flush_batch() {
+    send_batch(batch_.data(), batch_.size());
+    batch_.clear();
+    batch_generation_++;
+    batch_timer_.cancel();
+}
+
+void ManaContext::handle_linger(const boost::system::error_code& e, unsigned long generation) {
+    if(e == boost::asio::error::operation_aborted)
+        return;
+    lock_guard<mutex> lock(batch_mutex_);
+    if(generation == batch_generation_ && !batch_.empty())
+        flush_batch();
+}
+
+/*
+ * Send the 'n' messages at 'msgs' in batch frames, each as large as fits in
+ * a frame, unless the broker agreed to no batches when the session started.
+ */
+void ManaContext::send_batch(const ManaMessageProtobuf* msgs, size_t n) {
+    const FrameFormat f = session_->frame_format();
+    if(!f.flag_batch_ || n == 1) {
+        for(size_t i = 0; i < n; i++)
+            session_->send(msgs[i]);
+        return;
+    }
+    size_t first = 0;
+    size_t size = 0;
+    for(size_t i = 0; i <= n; i++) {
+        size_t entry_size = 0;
+        if(i < n) {
+            size_t msg_size = msgs[i].ByteSize();
+            entry_size = varint_size(msg_size) + msg_size;
+            if(i == first || frame_size(f, size + entry_size) <= MAX_MSG_SIZE) {
+                size += entry_size;
+                continue;
+            }
+        }
+        auto frame = make_batch_frame(msgs + first, i - first, f);
+        if(frame != nullptr)
+            session_->send(frame);
+        first = i;
+        size = entry_size;
+    }
+}
+
 void ManaContext::send_message(ManaMessageProtobuf& msg) {
     session_->send(msg);
 }
@@ -100,12 +193,69 @@ void ManaContext::subscribe(const ManaFilter& filtr) {
     assert(buff.has_subscription());
 
     send_message(buff);
+    flag_has_subscription = true;
 }
 
+void ManaContext::subscribe(const vector<ManaFilter>& filters) {
+    if(filters.empty())
+        return;
+    if(filters.size() == 1) {
+        subscribe(filters[0]);
+        return;
+    }
+    // one SUB per filter would make the broker copy the predicate of this
+    // client once for every filter
+    if(!wait_for_frame_format())
+        throw ManaException("ManaContext::subscribe(): the broker did not answer the session request.");
+    if(!session_->frame_format().flag_batch_)
+        throw ManaException("ManaContext::subscribe(): the broker does not take batches of subscriptions.");
+    vector<ManaMessageProtobuf> subs(filters.size());
+    for(size_t i = 0; i < filters.size(); i++) {
+        subs[i].set_sender(local_id_);
+        to_protobuf(filters[i], subs[i]);
+        assert(subs[i].IsInitialized());
+        assert(subs[i].has_subscription());
+    }
+    // the filters go in batch frames, as notifications do
+    send_batch(subs.data(), subs.size());
+    flag_has_subscription = true;
+}
+
+void ManaContext::unsubscribe(const string& str) {
+    ManaFilter f;
+    string_to_ManaFilter(str, f);
+    unsubscribe(f);
+}
+
+/*
+ * Remove a filter that was previously subscribed. The broker identifies the
+ * filter by its content, so 'filtr' must be identical to the one passed to
+ * subscribe().
+ */
+void ManaContext::unsubscribe(const ManaFilter& filtr) {
+    ManaMessageProtobuf buff;
+    // set sender id
+    buff.set_sender(local_id_);
+    // fill in the constraints exactly as subscribe() does and
+    // then turn the message into an unsubscription
+    to_protobuf(filtr, buff);
+    buff.set_type(ManaMessageProtobuf_message_type_t_UNSUB);
+    assert(buff.IsInitialized());
+    send_message(buff);
+}
+
+/*
+ * Remove all the filters of this client.
+ */
 void ManaContext::unsubscribe() {
     if(!flag_has_subscription) {
     	return;
     }
+    ManaMessageProtobuf buff;
+    buff.set_sender(local_id_);
+    buff.set_type(ManaMessageProtobuf_message_type_t_UNSUB);
+    send_message(buff);
+    flag_has_subscription = false;
 }
 
 void ManaContext::start() {
@@ -124,6 +274,7 @@ void ManaContext::handle_session_termination(Session<ManaContext>& s) {
 
 void ManaContext::stop() {
 	//work_->reset();
+    flush();
     session_->terminate();
     // FIXME: this will probably cause a bug, because stopping io_service
     // might happen before termination message is sent.
@@ -132,6 +283,18 @@ void ManaContext::stop() {
         thread_->join();
 }
 
+/*
+ * Wait until the broker answered the session request, unless this is the
+ * thread that would handle the answer.
+ */
+bool ManaContext::wait_for_frame_format() {
+    unique_lock<mutex> lock(format_mutex_);
+    if(flag_format_agreed_ || (thread_ != nullptr && std::this_thread::get_id() == thread_->get_id()))
+        return flag_format_agreed_;
+    return format_cond_.wait_for(lock, std::chrono::milliseconds(DEFAULT_SESSION_SETUP_TIMEOUT_MILLISECONDS),
+        [this]() { return flag_format_agreed_; });
+}
+
 bool ManaContext::session_established() const {
     return session_->is_active();
 }
@@ -146,9 +309,17 @@ void ManaContext::handle_message(const ManaMessageProtobuf& buff, MessageReceive
         app_notification_handler_(msg);
         break;
     }
+    case ManaMessageProtobuf_message_type_t_START_SESSION_ACK : {
+        session_->handle_session_msg(buff);
+        {
+            lock_guard<mutex> lock(format_mutex_);
+            flag_format_agreed_ = true;
+        }
+        format_cond_.notify_all();
+        break;
+    }
     case ManaMessageProtobuf_message_type_t_HEARTBEAT:
     case ManaMessageProtobuf_message_type_t_START_SESSION:
-    case ManaMessageProtobuf_message_type_t_START_SESSION_ACK :
     case ManaMessageProtobuf_message_type_t_START_SESSION_ACK_ACK:
     case ManaMessageProtobuf_message_type_t_TERMINATE_SESSION :
     case ManaMessageProtobuf_message_type_t_TERMINATE_SESSION_ACK :
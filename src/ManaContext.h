@@ -23,7 +23,12 @@
 #include <functional>
 #include <memory>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <chrono>
 #include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
 #include "common.h"
 #include "Log.h"
 #include "TaskScheduler.h"
@@ -37,6 +42,9 @@ class ManaMessageProtobuf; // to avoid including ManaMessageProtobuf.h
 template <class T> class Session;
 template <class T> class MessageReceiver;
 
+const unsigned int DEFAULT_SESSION_SETUP_TIMEOUT_MILLISECONDS = 5000; // how long subscribing to
+// several filters waits for the broker to answer the session request
+
 /**
 * @brief The client's interface to the publish/subscribe network.
 *
@@ -57,8 +65,33 @@ public:
     virtual ~ManaContext();
     void publish(const string&);
     void publish(const ManaMessage&);
+    /**
+     * Publish the notifications in 'msgs' in as few frames as they fit in,
+     * or one by one if the broker does not take batches.
+     */
+    void publish_batch(const vector<ManaMessage>& msgs);
+    /**
+     * Batch the notifications given to publish(): they are sent together
+     * once 'max_batch' of them wait or the first of them waited 'linger_us'
+     * microseconds. A 'max_batch' below 2 turns batching off, which is the
+     * default.
+     */
+    void set_batching(unsigned int linger_us, size_t max_batch);
+    /** Send the notifications that wait to be batched right away */
+    void flush();
     void subscribe(const ManaFilter&);
+    /**
+     * Subscribe to all the filters in 'filters' with one message, which the
+     * broker installs with one update of its table. Waits for the broker to
+     * answer the session request, for at most
+     * DEFAULT_SESSION_SETUP_TIMEOUT_MILLISECONDS. Throws {@link ManaException}
+     * if it does not answer in time or does not take batches (a v1 broker or
+     * one started with batches=0), rather than send the filters one by one.
+     */
+    void subscribe(const vector<ManaFilter>& filters);
     void subscribe(const string& sub);
+    void unsubscribe(const ManaFilter&);
+    void unsubscribe(const string& sub);
     void unsubscribe();
     void start();
     void stop();
@@ -81,10 +114,26 @@ private:
     shared_ptr<boost::asio::io_service::work> work_;
     shared_ptr<thread> thread_;
     void send_message(ManaMessageProtobuf&);
+    void send_batch(const ManaMessageProtobuf* msgs, size_t n);
+    void flush_batch(); // batch_mutex_ must be locked
+    void handle_linger(const boost::system::error_code& e, unsigned long generation);
     bool is_connected();
     bool flag_has_subscription;
     TaskScheduler<std::function<void()>> task_scheduler_;
     shared_ptr<Session<ManaContext>> session_;
+    // the notifications that wait to be sent in a batch
+    std::chrono::microseconds batch_linger_;
+    size_t batch_max_;
+    mutex batch_mutex_; // protects the batch and its timer
+    vector<ManaMessageProtobuf> batch_;
+    unsigned long batch_generation_; // the number of batches sent, so that a
+    // timer that expires late does not cut the next batch short
+    boost::asio::high_resolution_timer batch_timer_;
+    // set once the broker answered the session request with the frame format
+    mutex format_mutex_;
+    condition_variable format_cond_;
+    bool flag_format_agreed_;
+    bool wait_for_frame_format();
 };
 
 } /* namespace mana */
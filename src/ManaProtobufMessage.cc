@@ -0,0 +1,170 @@
+/**
+ * @file ManaProtobufMessage.cc
+ * A siena::message view of a ManaMessageProtobuf
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include <new>
+#include <string.h>
+#include <assert.h>
+#include "ManaProtobufMessage.h"
+
+using namespace std;
+
+namespace mana {
+
+namespace {
+
+const size_t MAX_FREE_ATTRIBUTES = 64; // per thread
+
+/*
+ * A per-thread list of released protobuf_attribute blocks. The blocks are
+ * given back to the heap when the thread exits.
+ */
+struct AttributeFreeList {
+    struct Block {
+        Block* next_;
+    };
+
+    AttributeFreeList() : head_(nullptr), size_(0) {}
+
+    ~AttributeFreeList() {
+        while(head_ != nullptr) {
+            Block* b = head_;
+            head_ = b->next_;
+            ::operator delete(b);
+        }
+    }
+
+    Block* head_;
+    size_t size_;
+};
+
+thread_local AttributeFreeList free_attributes;
+
+inline bool is_valid_type(ManaMessageProtobuf_tag_type_t t) {
+    return t == ManaMessageProtobuf_tag_type_t_STRING || t == ManaMessageProtobuf_tag_type_t_INT ||
+        t == ManaMessageProtobuf_tag_type_t_DOUBLE || t == ManaMessageProtobuf_tag_type_t_BOOL;
+}
+
+inline siena::string_t to_string_t(const string& s) {
+    return siena::string_t(s.data(), s.data() + s.size());
+}
+
+} /* namespace */
+
+void* protobuf_attribute::operator new(size_t size) {
+    static_assert(sizeof(protobuf_attribute) >= sizeof(AttributeFreeList::Block), "block does not fit");
+    AttributeFreeList& fl = free_attributes;
+    if(size != sizeof(protobuf_attribute) || fl.head_ == nullptr)
+        return ::operator new(size);
+    AttributeFreeList::Block* b = fl.head_;
+    fl.head_ = b->next_;
+    fl.size_--;
+    return b;
+}
+
+void protobuf_attribute::operator delete(void* p) {
+    if(p == nullptr)
+        return;
+    AttributeFreeList& fl = free_attributes;
+    if(fl.size_ >= MAX_FREE_ATTRIBUTES) {
+        ::operator delete(p);
+        return;
+    }
+    AttributeFreeList::Block* b = static_cast<AttributeFreeList::Block*>(p);
+    b->next_ = fl.head_;
+    fl.head_ = b;
+    fl.size_++;
+}
+
+protobuf_attribute::protobuf_attribute(const ManaMessageProtobuf_notification_t& n, int index) :
+    notification_(&n), i_(index) {
+    assert(i_ < notification_->attribute_size());
+}
+
+int protobuf_attribute::skip_invalid(const ManaMessageProtobuf_notification_t& n, int index) {
+    while(index < n.attribute_size() && !is_valid_type(n.attribute(index).value().type()))
+        index++;
+    return index;
+}
+
+siena::string_t protobuf_attribute::name() const {
+    return to_string_t(attribute().name());
+}
+
+siena::type_id protobuf_attribute::type() const {
+    // tag_type_t has the same values as siena::type_id
+    return siena::type_id(attribute().value().type());
+}
+
+siena::int_t protobuf_attribute::int_value() const {
+    return attribute().value().int_value();
+}
+
+siena::string_t protobuf_attribute::string_value() const {
+    return to_string_t(attribute().value().string_value());
+}
+
+siena::bool_t protobuf_attribute::bool_value() const {
+    return attribute().value().bool_value();
+}
+
+siena::double_t protobuf_attribute::double_value() const {
+    return attribute().value().double_value();
+}
+
+bool protobuf_attribute::next() {
+    const int end = notification_->attribute_size();
+    if(i_ != end)
+        i_ = skip_invalid(*notification_, i_ + 1);
+    return i_ != end;
+}
+
+ManaProtobufMessage::ManaProtobufMessage(const ManaMessageProtobuf& buff) :
+    notification_(buff.notification()) {}
+
+siena::message::iterator* ManaProtobufMessage::first() const {
+    int i = protobuf_attribute::skip_invalid(notification_, 0);
+    if(i == notification_.attribute_size())
+        return 0;
+    return new protobuf_attribute(notification_, i);
+}
+
+siena::message::iterator* ManaProtobufMessage::find(const siena::string_t& name) const {
+    int i = index_of(name);
+    if(i < 0)
+        return 0;
+    return new protobuf_attribute(notification_, i);
+}
+
+bool ManaProtobufMessage::contains(const siena::string_t& name) const {
+    return index_of(name) >= 0;
+}
+
+int ManaProtobufMessage::index_of(const siena::string_t& name) const {
+    const size_t len = name.length();
+    for(int i = 0; i < notification_.attribute_size(); i++) {
+        const auto& attr = notification_.attribute(i);
+        if(attr.name().size() == len && memcmp(attr.name().data(), name.begin, len) == 0 &&
+            is_valid_type(attr.value().type()))
+            return i;
+    }
+    return -1;
+}
+
+} /* namespace mana */
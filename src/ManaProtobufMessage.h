@@ -0,0 +1,95 @@
+/**
+ * @file ManaProtobufMessage.h
+ * A siena::message view of a ManaMessageProtobuf
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef MANAPROTOBUFMESSAGE_H_
+#define MANAPROTOBUFMESSAGE_H_
+
+#include <stddef.h>
+#include <siena/types.h>
+#include "ManaMessageProtobuf.pb.h"
+
+namespace mana {
+
+/**
+ * @brief Iterator over the attributes of a ManaProtobufMessage.
+ *
+ * Names and values are read from the protobuf in place. Attributes of a
+ * type that siena does not know about are skipped, like to_ManaMessage
+ * does. The forwarding table allocates and deletes one of these for every
+ * attribute it looks up, so instances are recycled through a per-thread
+ * free list instead of going through the heap every time.
+ */
+class protobuf_attribute : public siena::message::iterator {
+public:
+    protobuf_attribute(const ManaMessageProtobuf_notification_t& n, int index);
+
+    virtual siena::string_t	name() const;
+    virtual siena::type_id	type() const;
+    virtual siena::int_t	int_value() const;
+    virtual siena::string_t	string_value() const;
+    virtual siena::bool_t	bool_value() const;
+    virtual siena::double_t	double_value() const;
+    virtual bool		next();
+
+    // index of the first attribute at or after 'index' with a valid type,
+    // or the number of attributes if there is none.
+    static int skip_invalid(const ManaMessageProtobuf_notification_t& n, int index);
+
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
+private:
+    const ManaMessageProtobuf_notification_t_attribute_t& attribute() const {
+        return notification_->attribute(i_);
+    }
+
+    const ManaMessageProtobuf_notification_t* notification_;
+    int i_;
+};
+
+/**
+ * @brief A siena::message that reads its attributes straight from a parsed
+ * ManaMessageProtobuf.
+ *
+ * Unlike converting the protobuf into a ManaMessage with to_ManaMessage,
+ * nothing is copied: the view only holds a reference to the protobuf, which
+ * must outlive it. Use this when a notification is only matched, e.g., in
+ * the broker.
+ * Note: if an attribute name occurs more than once, find() returns the
+ * first occurrence.
+ */
+class ManaProtobufMessage : public siena::message {
+public:
+    explicit ManaProtobufMessage(const ManaMessageProtobuf& buff);
+    virtual ~ManaProtobufMessage() {}
+
+    virtual iterator*	first() const;
+    virtual iterator*	find(const siena::string_t& name) const;
+    virtual bool	contains(const siena::string_t& name) const;
+
+private:
+    int index_of(const siena::string_t& name) const;
+
+    const ManaMessageProtobuf_notification_t& notification_;
+};
+
+} /* namespace mana */
+
+#endif /* MANAPROTOBUFMESSAGE_H_ */
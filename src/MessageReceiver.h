@@ -21,10 +21,13 @@
 #define MESSAGERECEIVER_H_
 
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include "MessageStream.h"
+#include "ManaMessageProtobuf.pb.h"
 #include "common.h"
 #include "URL.h"
+#include "Log.h"
 
 namespace mana {
 
@@ -36,6 +39,8 @@ class TCPMessageReceiver;
 template <class T>
 class UDPMessageReceiver;
 
+/* SO_REUSEPORT, for which boost::asio has no option of its own */
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
 
 template <class T>
 class MessageReceiver {
@@ -44,21 +49,31 @@ public:
 
 /** @brief Constructor
  * @param srv An instance of boost::asio::io_service;
- * @param client An object the implements a handle_message method to receive messages
+ * @param client An object the implements a handle_message method to receive messages,
+ * and optionally a handle_batch method to receive the messages of a batch at once
  * @param port Server's port (TCP or UDP)
  * @param addr The local address of the server
  */
 MessageReceiver(boost::asio::io_service& srv, T& c, const URL& url) :
     io_service_(srv), client_(c), url_(url), read_hndlr_strand_(srv),
-    flag_runing_(false) {}
+    current_frame_{nullptr, 0, 0}, flag_runing_(false), next_connection_io_service_(0) {}
 
 virtual ~MessageReceiver() {
 }
 
-boost::asio::io_service& io_service() {
+boost::asio::io_service& io_service() const {
 	return io_service_;
 }
 
+/**
+ * @brief Run the connections this receiver accepts on 'srvs', in turn,
+ * instead of on the io_service of the receiver. Only stream transports
+ * accept connections.
+ */
+void set_connection_io_services(const vector<boost::asio::io_service*>& srvs) {
+	connection_io_services_ = srvs;
+}
+
 bool is_runing() const {
 	return flag_runing_;
 }
@@ -77,24 +92,134 @@ static shared_ptr<MessageReceiver<T>> create(boost::asio::io_service& srv, T& c,
 	return make_shared<UDPMessageReceiver<T>>(srv, c, url);
 }
 
+/**
+ * @brief The serialized form of the message that is being handled.
+ *
+ * This is only valid inside the client's handle_message() and lets the
+ * client forward the message as received, without encoding it again.
+ * Inside handle_batch() there is no such message; see current_batch().
+ */
+const byte* current_message_data() const {
+	return current_frame_.data_;
+}
+
+int current_message_size() const {
+	return current_frame_.size_;
+}
+
+/**
+ * @brief The serialized forms of the messages of the batch that is being
+ * handled, in the order they were given to the client's handle_batch().
+ * This is only valid inside handle_batch().
+ */
+const vector<FrameSpan>& current_batch() const {
+	return batch_frames_;
+}
+
 virtual void start() = 0;
 virtual void stop() = 0;
 virtual connection_type transport_type() const = 0;
+/** @brief Log the statistics of the transport, if it keeps any */
+virtual void report_stats() {}
 
 protected:
 
 //methods
+/*
+ * True if the URL has the reuseport option. The socket is then bound with
+ * SO_REUSEPORT so that other sockets can listen on the same port.
+ */
+bool is_reuse_port() const {
+	return url_.options().count("reuseport") > 0;
+}
+
+/*
+ * Hand the messages in the next 'size' bytes read from the connection to
+ * the client. The frames are decoded in place; only one that is not all
+ * there yet is kept for the next read. Must be run by one thread at a
+ * time, which the read strand guarantees.
+ */
+void handle_data(const byte* data, size_t size) {
+	message_stream_.consume(data, static_cast<int>(size));
+	message_stream_.frames(frames_);
+	ManaMessageProtobuf msg;
+	for(auto& f : frames_) {
+		if(f.flags_ & FRAME_FLAG_BATCH) {
+			handle_batch(f);
+			continue;
+		}
+		if(!msg.ParseFromArray(f.data_, f.size_)) {
+			FILE_LOG(logWARNING) << "MessageReceiver::handle_data(): a message of " << f.size_
+				<< " bytes could not be parsed and was discarded.";
+			continue;
+		}
+		current_frame_ = f;
+		this->client_.handle_message(msg, this);
+		msg.Clear();
+	}
+	current_frame_ = FrameSpan{nullptr, 0, 0};
+	message_stream_.release_frames();
+}
+
+/*
+ * Hand the messages of the batch 'f' to the client, all at once if it
+ * implements handle_batch(), one by one otherwise.
+ */
+void handle_batch(const FrameSpan& f) {
+	if(!MessageStream::split_batch(f, batch_frames_))
+		return;
+	batch_.resize(batch_frames_.size());
+	size_t n = 0;
+	for(auto& m : batch_frames_) {
+		if(!batch_[n].ParseFromArray(m.data_, m.size_)) {
+			FILE_LOG(logWARNING) << "MessageReceiver::handle_batch(): a message of " << m.size_
+				<< " bytes could not be parsed and was discarded.";
+			continue;
+		}
+		batch_frames_[n++] = m;
+	}
+	batch_.resize(n);
+	batch_frames_.resize(n);
+	dispatch_batch(this->client_, batch_, 0);
+	current_frame_ = FrameSpan{nullptr, 0, 0};
+	batch_frames_.clear();
+}
+
+template <class C>
+auto dispatch_batch(C& c, vector<ManaMessageProtobuf>& batch, int) -> decltype(c.handle_batch(batch, this), void()) {
+	c.handle_batch(batch, this);
+}
+
+template <class C>
+void dispatch_batch(C& c, vector<ManaMessageProtobuf>& batch, long) {
+	for(size_t i = 0; i < batch.size(); i++) {
+		current_frame_ = batch_frames_[i];
+		c.handle_message(batch[i], this);
+	}
+}
+
+// the io_service the next accepted connection runs on
+boost::asio::io_service& next_connection_io_service() {
+	if(connection_io_services_.empty())
+		return io_service_;
+	return *connection_io_services_[next_connection_io_service_++ % connection_io_services_.size()];
+}
 
 // properties
 boost::asio::io_service& io_service_;
 T& client_;
 const URL url_;
 boost::asio::strand read_hndlr_strand_;
-array<byte, MAX_MSG_SIZE> read_buffer_;
 MessageStream message_stream_;
+vector<FrameSpan> frames_; // of the last read
+FrameSpan current_frame_; // the frame of the message the client is handling
+vector<ManaMessageProtobuf> batch_; // the messages of the batch the client is handling
+vector<FrameSpan> batch_frames_; // and their serialized forms
 mutex read_buff_mutex_;
 connection_type connection_type_;
 bool flag_runing_;
+vector<boost::asio::io_service*> connection_io_services_; // see set_connection_io_services()
+size_t next_connection_io_service_;
 
 };
 
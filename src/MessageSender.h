@@ -22,11 +22,19 @@
 #define NETWORKCONNECTOR_H_
 
 #include <functional>
-#include <queue>
+#include <deque>
+#include <stdint.h>
+#include <memory>
 #include <array>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <boost/asio.hpp>
 #include "common.h"
 #include "MessageStream.h"
+#include "FrameBuffer.h"
+#include "OutboundQueue.h"
 #include "URL.h"
 #include "Log.h"
 
@@ -37,19 +45,22 @@ namespace mana {
 class ManaMessageProtobuf;
 
 struct WriteBufferItem {
-        const byte* data_;
+        FrameBufferPtr buffer_; // the frame this item is a part of. The frame is
+        // released once the items of all the senders that share it are written.
         size_t offset_;
         size_t size_;
-        bool flag_delete_; // if the flag is
-        // set after sending this item, the buffer has to be
-        // released.
+        std::chrono::steady_clock::time_point queued_at_; // when the frame was queued
+        // for datagram transports: which fragment of which message this is
+        uint32_t message_id_;
+        uint16_t fragment_count_;
+        uint16_t fragment_index_;
     };
 
 // we put a shared data with its associated
 // mutex in one place, for easy management.
 struct WriteBufferItemQueueWrapper {
 	PROTECTED_WITH(std::mutex);
-	PROTECTED_MEMBER(queue<WriteBufferItem>, qu);
+	PROTECTED_MEMBER(deque<WriteBufferItem>, qu);
 };
 
 /**
@@ -62,14 +73,71 @@ class MessageSender {
 public:
 MessageSender(boost::asio::io_service& srv, T& c, const URL& url) :
 		io_service_(srv), client_(c), url_(url), read_hndlr_strand_(srv), write_hndlr_strand_(srv),
-		flag_is_connected(false), flag_write_op_in_prog_(false) {}
+		flag_is_connected(false), flag_write_op_in_prog_(false), queued_messages_(0), queued_bytes_(0),
+		max_queued_messages_(0), dropped_(0), avg_write_latency_(0), max_write_latency_(0),
+		write_strand_(&write_hndlr_strand_), other_write_executor_(nullptr), items_in_flight_(0), writes_(0),
+		written_messages_(0), max_write_batch_(0), write_chunk_size_(0), next_message_id_(0), flag_overflow_disconnected_(false), flag_released_(false),
+		frame_format_(FrameFormat().pack()) {}
 
 virtual ~MessageSender() {}
 
+/**
+ * @brief Disconnect and delete this sender, which must have been created
+ * with new. If a write is in progress the sender is deleted by its write
+ * handler once the write completes, since the handler refers to it. Nothing
+ * queued is written after this call.
+ */
+void release() {
+    {
+        lock_guard<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
+        flag_released_ = true;
+        // the write in progress fails once we disconnect
+        disconnect();
+        if(!this->write_buff_item_qu_.qu().empty())
+            return;
+    }
+    delete this;
+}
+
 MessageSender(const MessageSender&) = delete; // delete copy ctor
 MessageSender& operator=(const MessageSender&) = delete; // delete assig. operator
 
 virtual void send_buffer(const byte* data, size_t length) = 0;
+/*
+ * Write all of 'buffers' with a single (gathered) write. Only called if
+ * can_gather() returns true.
+ */
+virtual void send_buffers(const vector<boost::asio::const_buffer>& buffers) {}
+/*
+ * Write the first 'n' items of the queue at once. Only called if
+ * can_gather() returns true. By default their buffers are handed to
+ * send_buffers(); transports that must keep the items apart, such as
+ * datagrams, override this instead.
+ */
+virtual void send_items(size_t n) {
+    auto& qu = this->write_buff_item_qu_.qu();
+    gather_buffers_.clear();
+    for(size_t i = 0; i < n; i++)
+        gather_buffers_.push_back(boost::asio::const_buffer(qu[i].buffer_->data() + qu[i].offset_, qu[i].size_));
+    send_buffers(gather_buffers_);
+}
+/* true if the transport can write several queued buffers at once */
+virtual bool can_gather() const {return false;}
+/*
+ * The most bytes of a frame that are written at once; larger frames are
+ * split. Datagram transports keep this under the size of a packet. Stream
+ * transports write whole frames and let the kernel do the segmentation.
+ */
+virtual size_t max_write_size() const {return MAX_PCKT_SIZE;}
+/*
+ * Bytes a transport adds to each piece of a split frame, see send_item().
+ * The pieces are made this much smaller.
+ */
+virtual size_t fragment_header_size() const {return 0;}
+/* write one item of the queue */
+virtual void send_item(const WriteBufferItem& item) {
+    send_buffer(item.buffer_->data() + item.offset_, item.size_);
+}
 
 virtual void async_connect(const string&, int) {}
 virtual void async_connect(const string&) {}
@@ -87,26 +155,99 @@ virtual bool is_connected() {return true;}
  * Send is asynchronous and the message is converted to a buffer and the memory
  * is taken care of by the network connector. This means that after this method
  * returns the caller can safely reuse msg.
+ * Returns false if the message was dropped.
  */
-void send(const ManaMessageProtobuf& msg) {
-    // add buffer separators and header and then serialize
-    // the message into a protobuf
-    int data_size = msg.ByteSize();
-    int total_size = MSG_HEADER_SIZE + data_size;
-    if(total_size > MAX_MSG_SIZE) {
-    	FILE_LOG(logWARNING) << "MessageSender::Send(): Message size is more than the allowed limit (" << MAX_MSG_SIZE << " Bytes). Message was discarded.";
-        return;
+bool send(const ManaMessageProtobuf& msg) {
+    auto frame = make_frame(msg, frame_format());
+    if(frame == nullptr) {
+    	FILE_LOG(logWARNING) << "MessageSender::Send(): Message could not be framed and was discarded.";
+        return false;
     }
-    byte* arr_buf = new byte[total_size];
-    arr_buf[0] = BUFF_SEPERATOR;
-    *((int*)(arr_buf + BUFF_SEPERATOR_LEN_BYTE)) = data_size;
-    assert(*((int*)(arr_buf + BUFF_SEPERATOR_LEN_BYTE)) == data_size);
-    assert(msg.SerializeWithCachedSizesToArray(arr_buf + MSG_HEADER_SIZE));
-    if(!msg.SerializeWithCachedSizesToArray(arr_buf + MSG_HEADER_SIZE)) {
-    	FILE_LOG(logERROR) << "MessageSender::Send(): Could not serialize message to buffer.";
+    return prepare_buffer(frame);
+}
+
+/**
+ * @brief Send an already framed message out to the network.
+ *
+ * The frame is not copied; the sender keeps a reference to it until it is
+ * written. This way the same frame can be sent by any number of senders.
+ * This method is thread-safe. Returns false if the message was dropped.
+ */
+bool send(const FrameBufferPtr& frame) {
+    return prepare_buffer(frame);
+}
+
+/**
+ * @brief Bound the outbound queue. By default it is not bounded.
+ */
+void set_queue_limits(const OutboundQueueLimits& limits) {
+    lock_guard<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
+    queue_limits_ = limits;
+    queue_space_cond_.notify_all();
+}
+
+OutboundQueueStats queue_stats() {
+    lock_guard<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
+    OutboundQueueStats st;
+    st.messages_ = queued_messages_;
+    st.bytes_ = queued_bytes_;
+    st.max_messages_ = max_queued_messages_;
+    st.dropped_ = dropped_;
+    st.flag_disconnected_ = flag_overflow_disconnected_;
+    st.avg_write_latency_ = std::chrono::microseconds(avg_write_latency_);
+    st.max_write_latency_ = std::chrono::microseconds(max_write_latency_);
+    st.writes_ = writes_;
+    st.written_messages_ = written_messages_;
+    st.max_write_batch_ = max_write_batch_;
+    if(!this->write_buff_item_qu_.qu().empty())
+        st.oldest_age_ = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - this->write_buff_item_qu_.qu().front().queued_at_);
+    return st;
+}
+
+/**
+ * @brief Run the write handlers of this sender on 'srv' instead of the
+ * io_service it was made with. With nullptr they go back to that io_service.
+ * A write that is in progress completes where it started.
+ */
+void set_write_executor(boost::asio::io_service* srv) {
+    lock_guard<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
+    if(srv == nullptr) {
+        write_strand_ = &write_hndlr_strand_;
         return;
     }
-    prepare_buffer(arr_buf, total_size);
+    if(!other_write_strand_ || other_write_executor_ != srv) {
+        other_write_strand_.reset(new boost::asio::strand(*srv));
+        other_write_executor_ = srv;
+    }
+    write_strand_ = other_write_strand_.get();
+}
+
+/**
+ * @brief Split frames in writes of at most 'size' bytes instead of
+ * max_write_size() of the transport. Zero goes back to max_write_size().
+ */
+void set_write_chunk_size(size_t size) {
+    lock_guard<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
+    write_chunk_size_ = size;
+}
+
+/**
+ * @brief Frame the messages given to send() in format 'f' from now on. Frames
+ * that are already queued are written as they are.
+ */
+void set_frame_format(const FrameFormat& f) {
+    frame_format_.store(f.pack(), std::memory_order_release);
+}
+
+/** @brief Takes no lock; it is read for every message sent. */
+FrameFormat frame_format() const {
+    return FrameFormat::unpack(frame_format_.load(std::memory_order_acquire));
+}
+
+/** @brief True if the connection was closed because the outbound queue was full */
+bool is_overflow_disconnected() const {
+    return flag_overflow_disconnected_;
 }
 
 const URL& url() const {
@@ -122,27 +263,80 @@ protected:
  *  object.
  */
 void write_handler(const boost::system::error_code& error, std::size_t bytes_transferred) {
-    lock_guard<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
+    unique_lock<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
     if(error) {
     	FILE_LOG(logERROR) << "MessageSender::write_handler(): Error sending data: " << error.message();
     } else {
     	FILE_LOG(logDEBUG3) << "MessageSender::write_handler(): wrote " << bytes_transferred << " bytes.";
-    	FILE_LOG(logDEBUG4) << "MessageSender::write_handler(): wrote " << this->write_buff_item_qu_.qu().front().data_;
     }
-    assert(this->write_buff_item_qu_.qu().empty() == false); // at least the last
-    // buffer that was written must be in the queue
+    assert(this->write_buff_item_qu_.qu().size() >= items_in_flight_); // at least the
+    // buffers that were written must be in the queue
     assert(this->write_buff_item_qu_.qu().front().size_ != 0);
-    // delete the memory and remove the item from the queue, if this was
-    // the last item in a trail of buffers.
-    if(this->write_buff_item_qu_.qu().front().flag_delete_)
-    	delete[] this->write_buff_item_qu_.qu().front().data_;
-    this->write_buff_item_qu_.qu().pop();
+    // remove the items from the queue. If this was the last reference to
+    // a frame, the frame is released.
+    for(; items_in_flight_ > 0; items_in_flight_--) {
+        const auto& done = this->write_buff_item_qu_.qu().front();
+        if(done.offset_ + done.size_ == done.buffer_->size()) {
+            // that was the last part of the message
+            update_write_latency(done.queued_at_);
+            queued_messages_--;
+            queued_bytes_ -= done.buffer_->size();
+        }
+        this->write_buff_item_qu_.qu().pop_front();
+    }
+    queue_space_cond_.notify_all();
+    if(flag_overflow_disconnected_ || flag_released_) {
+        // the connection was closed on purpose; do not reconnect to
+        // write what is left
+        this->write_buff_item_qu_.qu().clear();
+        items_in_flight_ = 0;
+        queued_messages_ = 0;
+        queued_bytes_ = 0;
+        if(flag_released_) {
+            // see release()
+            lock.unlock();
+            delete this;
+        }
+        return;
+    }
     // if there's more items in the queue waiting to be written
     // to the socket continue sending ...
-    if(this->write_buff_item_qu_.qu().empty() == false) {
-    	const auto& tmp = this->write_buff_item_qu_.qu().front();
-        send_buffer(tmp.data_ + tmp.offset_, tmp.size_);
+    if(this->write_buff_item_qu_.qu().empty() == false)
+        start_write();
+}
+
+/*
+ * Write the items at the front of the queue. If the transport can gather,
+ * as many items as the batch limits allow go out with one write; otherwise
+ * just the first one. The queue must be locked.
+ */
+void start_write() {
+    auto& qu = this->write_buff_item_qu_.qu();
+    assert(!qu.empty());
+    assert(items_in_flight_ == 0);
+    writes_++;
+    if(!can_gather() || queue_limits_.max_batch_messages_ <= 1) {
+        items_in_flight_ = 1;
+        written_messages_++;
+        max_write_batch_ = max<size_t>(max_write_batch_, 1);
+        send_item(qu.front());
+        return;
     }
+    size_t n = 0;
+    size_t bytes = 0;
+    for(auto& item : qu) {
+        // the first item goes out whatever its size
+        if(n > 0 && (n >= queue_limits_.max_batch_messages_ || bytes + item.size_ > queue_limits_.max_batch_bytes_))
+            break;
+        n++;
+        bytes += item.size_;
+    }
+    items_in_flight_ = n;
+    written_messages_ += n;
+    max_write_batch_ = max(max_write_batch_, n);
+    FILE_LOG(logDEBUG3) << "MessageSender::start_write(): writing " << n << " buffers, "
+        << bytes << " bytes.";
+    send_items(n);
 }
 
 // private methods
@@ -154,52 +348,178 @@ boost::asio::strand read_hndlr_strand_;
 boost::asio::strand write_hndlr_strand_;
 bool flag_is_connected;
 bool flag_write_op_in_prog_;
-MessageStream message_stream_;
-array<byte, MAX_MSG_SIZE> read_buffer_;
 WriteBufferItemQueueWrapper write_buff_item_qu_;
 mutex read_buff_mutex_;
+// the following are protected by 'write_buff_item_qu_'
+OutboundQueueLimits queue_limits_;
+size_t queued_messages_;
+size_t queued_bytes_;
+size_t max_queued_messages_;
+unsigned long dropped_;
+long avg_write_latency_; // microseconds, moving average over the written frames
+long max_write_latency_; // microseconds
+boost::asio::strand* write_strand_; // the strand that runs the write handlers
+unique_ptr<boost::asio::strand> other_write_strand_; // see set_write_executor()
+boost::asio::io_service* other_write_executor_; // the io_service of 'other_write_strand_'
+size_t items_in_flight_; // the items at the front of the queue that are being written
+vector<boost::asio::const_buffer> gather_buffers_; // of the last gathered write
+unsigned long writes_; // write operations so far
+unsigned long written_messages_; // items written so far
+size_t max_write_batch_; // the most items written at once
+size_t write_chunk_size_; // see set_write_chunk_size()
+uint32_t next_message_id_; // the id of the next frame that is queued
+condition_variable_any queue_space_cond_; // signaled when messages leave the queue
+atomic<bool> flag_overflow_disconnected_;
+bool flag_released_; // see release(). Guarded by the lock of the queue
+atomic<uint64_t> frame_format_; // of the messages given to send(), see FrameFormat::pack()
 
 private:
-/*WriteBufferItem item;
- * Prepares a buffer for transmission over the network.
- * If there is a transmission going on already, the buffer will be queued for
- * later transmission. Otherwise the buffer is sent out without being queued.
+/*
+ * Prepares a frame for transmission over the network.
+ * If there is a transmission going on already, the frame will be queued for
+ * later transmission. Otherwise the frame is sent out without being queued.
+ *
+ * If the queue is bounded and full, the overflow policy decides what
+ * happens to the frame. Returns false if the frame was dropped.
  *
  * Note that this method mutates the 'write_buff_item_qu_.qu()' and so must be
- * called by one thread only. This is guaranteed by using strand
- * @param data data A pointer to the buffer
- * @param length length of the buffer
+ * called by one thread only. This is guaranteed by locking the queue.
+ * @param frame The frame to send
  */
-void prepare_buffer(const byte* data, size_t length) {
+bool prepare_buffer(const FrameBufferPtr& frame) {
+    size_t length = frame->size();
 	FILE_LOG(logDEBUG3) << "MessageSender::prepare_buffer(): preparing " << length << " bytes.";
-    lock_guard<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
+    unique_lock<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
     assert(length > 0);
-    bool flg_send_not_in_progress = this->write_buff_item_qu_.qu().empty();
     // if the message size is more that the limit we have to break it into
-    // multiple sends. Hence the loop.
+    // multiple sends. Hence the loop below.
+    size_t chunk_size = (write_chunk_size_ > 0 ? write_chunk_size_ : max_write_size());
+    if(length > chunk_size)
+        chunk_size -= min(chunk_size - 1, fragment_header_size());
+    const size_t fragments = (length + chunk_size - 1) / chunk_size;
+    // the fragment header of a datagram transport has room for 2^16 - 1 fragments
+    if(fragment_header_size() > 0 && fragments > UINT16_MAX) {
+        dropped_++;
+        FILE_LOG(logERROR) << "MessageSender::prepare_buffer(): a frame of " << length << " bytes to "
+            << this->url_.url() << " needs " << fragments << " fragments of " << chunk_size
+            << " bytes. Message was dropped.";
+        return false;
+    }
+    if(flag_overflow_disconnected_ || flag_released_ || !make_room(lock, length)) {
+        dropped_++;
+        FILE_LOG(logDEBUG1) << "MessageSender::prepare_buffer(): outbound queue to " << this->url_.url()
+            << " is full. Message was dropped.";
+        return false;
+    }
+    queued_messages_++;
+    queued_bytes_ += length;
+    max_queued_messages_ = max(max_queued_messages_, queued_messages_);
+    bool flg_send_not_in_progress = this->write_buff_item_qu_.qu().empty();
+    const auto now = std::chrono::steady_clock::now();
+    const uint32_t message_id = next_message_id_++;
     size_t offset = 0;
     do {
     	WriteBufferItem item;
-    	if(length > MAX_PCKT_SIZE)
-    		item.size_ = MAX_PCKT_SIZE;
+    	if(length > chunk_size)
+    		item.size_ = chunk_size;
     	else
     		item.size_ = length;
-    	item.data_ = data;
+    	item.buffer_ = frame;
     	item.offset_ = offset;
-    	item.flag_delete_ = false;
+    	item.queued_at_ = now;
+    	item.message_id_ = message_id;
+    	item.fragment_count_ = static_cast<uint16_t>(fragments);
+    	item.fragment_index_ = static_cast<uint16_t>(offset / chunk_size);
     	length -= item.size_;
     	offset += item.size_;
-    	this->write_buff_item_qu_.qu().push(item);
+    	this->write_buff_item_qu_.qu().push_back(std::move(item));
     } while(length > 0);
-    // the last item in this series of items must have its delete flag set to one
-    // so after sending it, we know we must freed the buffer.
-    this->write_buff_item_qu_.qu().back().flag_delete_ = true;
-    if(flg_send_not_in_progress) {
-    	const auto& tmp = this->write_buff_item_qu_.qu().front();
-    	send_buffer(tmp.data_ + tmp.offset_, tmp.size_);
-    }
+    if(flg_send_not_in_progress)
+    	start_write();
     assert(!this->write_buff_item_qu_.qu().empty());
     assert(this->write_buff_item_qu_.qu().front().size_ != 0);
+    return true;
+}
+
+// the write latency of a frame is the time from queuing it to having
+// written its last byte
+void update_write_latency(const std::chrono::steady_clock::time_point& queued_at) {
+    long l = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - queued_at).count();
+    avg_write_latency_ += (l - avg_write_latency_) / WRITE_LATENCY_AVG_WEIGHT;
+    max_write_latency_ = max(max_write_latency_, l);
+}
+
+static const long WRITE_LATENCY_AVG_WEIGHT = 8; // a frame counts for 1/8 of the average
+
+// true if a message of 'length' bytes does not fit in the queue. An
+// empty queue always takes a message.
+bool is_queue_full(size_t length) const {
+    if(queued_messages_ == 0)
+        return false;
+    return (queue_limits_.max_messages_ > 0 && queued_messages_ >= queue_limits_.max_messages_) ||
+        (queue_limits_.max_bytes_ > 0 && queued_bytes_ + length > queue_limits_.max_bytes_);
+}
+
+/*
+ * Apply the overflow policy until a message of 'length' bytes fits in the
+ * queue. Returns false if the message must be dropped. The queue must be
+ * locked by 'lock'.
+ */
+bool make_room(unique_lock<WriteBufferItemQueueWrapper>& lock, size_t length) {
+    if(!is_queue_full(length))
+        return true;
+    switch(queue_limits_.policy_) {
+    case overflow_block:
+        // room is made by the write handlers. A thread that may have to run
+        // them, possibly the only one, would wait in vain, so it drops.
+        if(write_executor().get_executor().running_in_this_thread())
+            return false;
+        queue_space_cond_.wait_for(lock, std::chrono::milliseconds(DEFAULT_OVERFLOW_BLOCK_MILLISECONDS),
+            [this, length]() { return !is_queue_full(length) || flag_overflow_disconnected_; });
+        return !is_queue_full(length) && !flag_overflow_disconnected_;
+    case overflow_drop_oldest:
+        while(is_queue_full(length) && drop_oldest())
+            ;
+        return !is_queue_full(length);
+    case overflow_disconnect:
+        FILE_LOG(logWARNING) << "MessageSender::make_room(): outbound queue to " << this->url_.url()
+            << " is full. Disconnecting.";
+        flag_overflow_disconnected_ = true;
+        disconnect();
+        return false;
+    case overflow_drop_newest:
+    default:
+        return false;
+    }
+}
+
+// the io_service that runs the write handlers
+boost::asio::io_service& write_executor() const {
+    return write_strand_ == &write_hndlr_strand_ ? io_service_ : *other_write_executor_;
+}
+
+/*
+ * Drop the oldest message that is queued but not being written. The items
+ * at the front of the queue are being written, so is the rest of their
+ * message. Returns false if there is no such message.
+ */
+bool drop_oldest() {
+    auto& qu = this->write_buff_item_qu_.qu();
+    // skip the items being written
+    auto first = qu.begin() + min(items_in_flight_, qu.size());
+    while(first != qu.end() && first->offset_ != 0)
+        ++first;
+    if(first == qu.end())
+        return false;
+    auto last = first + 1;
+    while(last != qu.end() && last->offset_ != 0)
+        ++last;
+    queued_messages_--;
+    queued_bytes_ -= first->buffer_->size();
+    dropped_++;
+    qu.erase(first, last);
+    return true;
 }
 
 };
@@ -1,179 +1,237 @@
+#include <string.h>
+#include <assert.h>
 #include "MessageStream.h"
+#include "BufferPool.h"
+#include "Compression.h"
 #include "Log.h"
 
 namespace mana {
 
 MessageStream::MessageStream() :
-	unconsumed_data_size_(0), new_data_(nullptr),
-    new_data_size_(0) {}
+    partial_data_(nullptr), partial_capacity_(0), partial_size_(0),
+    completed_data_(nullptr), completed_capacity_(0), new_data_(nullptr), new_data_size_(0) {}
 
-MessageStream::~MessageStream() {}
+MessageStream::~MessageStream() {
+    release(partial_data_, partial_capacity_);
+    release_frames();
+}
 
 void MessageStream::consume(const byte* buff, int size) {
     assert(new_data_size_ == 0); // there must not be any
     // data remained from before. If this assertion fails,
-    // either the MessageStream::consume() is not called enough
-    // times to consume all the available data in the previous new_data_
-    // buffer. This can happen, for instance, when two separate threads,
-    // access the same instance of MessageStream.
+    // either MessageStream::frames() was not called for the previous
+    // buffer or two separate threads access the same instance of
+    // MessageStream.
+    release_frames();
     new_data_ = buff;
     new_data_size_ = size;
     FILE_LOG(logDEBUG2)  << "MessageStream:consume(): received new buffer. Buffer size: " << size;
 }
 
-/*
- * Take a buffer 'data' with a maximum size of 'size' and de-serialize into msg
- * and put the number of consumed bytes in 'consumed_size', return true on
- * success. If false is returned, we should always check (in the caller of this
- * function) the value of 'consumed_size'. This value being zero indicates that
- * the buffer was potentially incomplete (i.e, the end of a received buffer
- * from the socket), so nothing was consumed and data was left for later
- * consumption, when the rest of the buffer arrives from the socket. If the
- * value is non-zero it means there was an error in the buffer and some bytes
- * were skipped (consumed).
- */
-bool MessageStream::do_produce(const byte* data, int size, ManaMessageProtobuf& msg, int& consumed_size) const {
-    assert(size > 0);
-    assert(data[0] == BUFF_SEPERATOR);// this should not fail unless
-    // received data is corrupted somehow. In debug build we must fail
-    // and try to debug. For fault tolerance purposes or when we are
-    // using UDP and no checksumming is done we need to be prepared for
-    // anything, hence the following check...
-    if(data[0] != BUFF_SEPERATOR) {
-        // seems like we got rubbish in the buffer, lets skip 
-        // to either the end of the buffer of to the beginning of 
-        // a new message.
-        int i = 0;
-        while(i < size && data[i] != BUFF_SEPERATOR)
-            i++;
-        consumed_size = i;
-        FILE_LOG(logWARNING)  << "MessageStream::do_produce():" << __LINE__ <<  " : corrupted data was received. Discarded bytes: " << i	;
-        return false;
-    }
-    //if 'size' is less than the length of a header we return
-    if(size < MSG_HEADER_SIZE) {
-        consumed_size = 0;
-        return false;
-    }
-    int data_size = *((int*)(data+ BUFF_SEPERATOR_LEN_BYTE)); // + 1 is to pass BUFF_SEPERATOR
-    assert(data_size > 0 && data_size <= MAX_MSG_SIZE); // this should not happen unless
-    // received data is corrupted somehow. In debug build we must fail
-    // and try to debug. For fault tolerance purposes or when we are
-    // using UDP and no checksumming is done we need to be prepared for
-    // anything, hence the following check...
-    if(data_size < 0 || data_size > MAX_MSG_SIZE) {
-        // seems like we got rubbish in the buffer, lets skip 
-        // to either the end of the buffer of to the beginning of 
-        // a new message.
-        int i = 1; // the first byte is already 
-        // the separator, so we start looking from the second byte: i = 1
-        while(i < size && data[i] != BUFF_SEPERATOR)
-            i++;
-        consumed_size = i;
-        FILE_LOG(logWARNING)  << "MessageStream::do_produce():" << __LINE__ <<  " Warning: corrupted data was received. Discarded bytes: " << i
-        		<< " data size: " << data_size;
-        return false;
-    }
-    FILE_LOG(logDEBUG2) << "MessageStream::do_produce() message size (w/o header): " << data_size << " Header size: " << MSG_HEADER_SIZE;
-    // not enough data was received to reconcile the message. Just return.
-    if(MSG_HEADER_SIZE + data_size > size) {
-    	FILE_LOG(logDEBUG2)  << "MessageStream::do_produce():" << __LINE__ <<  " : buffer is incomplete." <<
-    			" Data required to reconcile message: " << MSG_HEADER_SIZE + data_size << ", data available: " << size;
-        consumed_size = 0;
+int MessageStream::skip_corrupted(const byte* data, int size) {
+    int skipped = 1;
+    while(skipped < size && data[skipped] != BUFF_SEPERATOR && data[skipped] != FRAME_V2_MAGIC)
+        skipped++;
+    FILE_LOG(logWARNING) << "MessageStream: corrupted data was received. Discarded bytes: " << skipped;
+    return skipped;
+}
+
+bool MessageStream::is_valid(const FrameHeader& h, const byte* data) {
+    if(h.flags_ & ~FRAME_KNOWN_FLAGS) {
+        FILE_LOG(logWARNING) << "MessageStream: a frame with unknown flags (" << static_cast<int>(h.flags_)
+            << ") was discarded.";
         return false;
     }
-    data += MSG_HEADER_SIZE;
-    if(!msg.ParseFromArray(data, data_size)) {
-        // seems like we got rubbish in the buffer, lets skip 
-        // to either the end of the buffer of to the beginning of 
-        // a new message.
-        int i = 0;
-        while(i < size && data[i] != BUFF_SEPERATOR)
-            i++;
-        consumed_size = i + MSG_HEADER_SIZE;
-        FILE_LOG(logWARNING) << "MessageStream::do_produce():" << __LINE__ <<  " Warning: corrupted data was received. Discarded bytes: " << i;
+    if(!check_frame_trailer(h, data + h.header_size_)) {
+        FILE_LOG(logWARNING) << "MessageStream: a frame of " << h.message_size_
+            << " bytes failed its checksum and was discarded.";
         return false;
     }
-    consumed_size = data_size + MSG_HEADER_SIZE;
     return true;
 }
 
-bool MessageStream::produce(ManaMessageProtobuf& msg) {
-    // if we already have something in the unconsumed buffer we need to consume
-    // that first along with the rest of the incomplete message which is in the
-    // new buffer. So we copy one message worth of data into the unconsumed
-    // buffer and send that to do_consume.
-    if(unconsumed_data_size_ != 0) {
-    	FILE_LOG(logDEBUG2)  << "MessageStream:produce(): There's " << unconsumed_data_size_ << " Bytes of unconsumed data";
-        int i = 0;
-        while(i < new_data_size_ && unconsumed_data_size_ < MAX_MSG_SIZE && new_data_[i] != BUFF_SEPERATOR) {
-            unconsumed_data_[unconsumed_data_size_++] = new_data_[i++];
+void MessageStream::frames(vector<FrameSpan>& frames) {
+    frames.clear();
+    const byte* data = new_data_;
+    int size = new_data_size_;
+    new_data_size_ = 0;
+    // first finish the frame that straddles the reads
+    if(partial_size_ > 0) {
+        complete_partial(data, size, frames);
+        if(partial_size_ > 0) {
+            assert(size == 0);
+            return;
         }
-        // If the unconsumed_data_ buffer is full and there's still unconsumed data but the end of a message is
-        // not reached then the received buffer was corrupted. We need to throw away all the unconsumed data.
-        if(i < new_data_size_ && MAX_MSG_SIZE <= unconsumed_data_size_  && new_data_[i] != BUFF_SEPERATOR) {
-        	assert(false);
+    }
+    // then the frames that are all in this read, in place
+    FrameHeader h;
+    while(size > 0) {
+        int r = decode_frame_header(data, size, h);
+        if(r < 0) {
+            int n = skip_corrupted(data, size);
+            data += n;
+            size -= n;
+            continue;
         }
-        assert(new_data_size_ - i >= 0);
-        new_data_ += i;
-        new_data_size_ -= i;
-        // if that managed to extract a good message then return true
-        // otherwise proceed to the rest of the buffer
-        int consumed = 0;
-        if(do_produce(unconsumed_data_, unconsumed_data_size_, msg, consumed)) {
-            // assert: all the buffer must be consumed
-            assert(consumed == unconsumed_data_size_);
-            unconsumed_data_size_ = 0; // we consumed all of it.
-            return true;
+        if(r == 0 || h.frame_size() > size)
+            break;
+        // a frame without flags needs no more checks
+        if(h.flags_ == 0)
+            frames.push_back(FrameSpan{data + h.header_size_, h.message_size_, 0});
+        else if(is_valid(h, data))
+            add_frame(h, data, frames);
+        else if(h.trailer_size_ > 0) {
+            // the length may be what was corrupted
+            int n = skip_corrupted(data, size);
+            data += n;
+            size -= n;
+            continue;
         }
-        unconsumed_data_size_ -= consumed;
+        data += h.frame_size();
+        size -= h.frame_size();
+    }
+    if(size == 0)
+        return;
+    // what is left is the beginning of a frame. Once the header is there,
+    // make room for all of the frame at once.
+    reserve_partial(decode_frame_header(data, size, h) > 0 ? h.frame_size() : FRAME_MAX_HEADER_SIZE);
+    append_partial(data, size);
+    FILE_LOG(logDEBUG2)  << "MessageStream::frames(): " << partial_size_ << " Bytes of a frame wait for the rest of it.";
+}
+
+void MessageStream::complete_partial(const byte*& data, int& size, vector<FrameSpan>& frames) {
+    // the header may not be all there yet. Take as much as the longest
+    // header, and give back what turns out to be the next frame.
+    int n = 0;
+    if(partial_size_ < FRAME_MAX_HEADER_SIZE) {
+        n = min(size, FRAME_MAX_HEADER_SIZE - partial_size_);
+        append_partial(data, n);
+        data += n;
+        size -= n;
+    }
+    FrameHeader h;
+    int r = decode_frame_header(partial_data_, partial_size_, h);
+    if(r == 0)
+        return;
+    if(r < 0) {
+        // the rest of the data resynchronizes on the next frame
+        FILE_LOG(logWARNING) << "MessageStream::frames(): corrupted frame header. Discarded bytes: "
+            << partial_size_;
+        discard_pending();
+        return;
     }
-    // new_data_size_ must never be a negative number
-    assert(new_data_size_ >=0);
+    if(partial_size_ > h.frame_size()) {
+        int surplus = partial_size_ - h.frame_size();
+        assert(surplus <= n);
+        partial_size_ -= surplus;
+        data -= surplus;
+        size += surplus;
+    }
+    reserve_partial(h.frame_size());
+    n = min(size, h.frame_size() - partial_size_);
+    append_partial(data, n);
+    data += n;
+    size -= n;
+    if(partial_size_ < h.frame_size())
+        return;
+    if(!is_valid(h, partial_data_)) {
+        discard_pending();
+        return;
+    }
+    add_frame(h, partial_data_, frames);
+    // keep the frame until it is released and start afresh for the next
+    // partial frame
+    release(completed_data_, completed_capacity_);
+    completed_data_ = partial_data_;
+    completed_capacity_ = partial_capacity_;
+    partial_data_ = nullptr;
+    partial_capacity_ = 0;
+    partial_size_ = 0;
+}
+
+void MessageStream::add_frame(const FrameHeader& h, const byte* data, vector<FrameSpan>& frames) {
+    FrameSpan f{data + h.header_size_, h.message_size_, h.flags_};
+    if((h.flags_ & FRAME_FLAG_COMPRESSED) && !inflate(f))
+        return;
+    frames.push_back(f);
+}
 
-    // now all the unconsumed data from before is consumed. If no new data is
-    // left, return false
-    if(new_data_size_ <= 0)
+bool MessageStream::inflate(FrameSpan& f) {
+    long size = uncompressed_message_size(f.data_, f.size_);
+    if(size < 0) {
+        FILE_LOG(logWARNING) << "MessageStream: a compressed frame of " << f.size_
+            << " bytes has an invalid header and was discarded.";
+        return false;
+    }
+    size_t capacity = max<size_t>(size, 1);
+    byte* buffer = BufferPool::instance().allocate(capacity);
+    if(!decompress_message(f.data_, f.size_, buffer)) {
+        BufferPool::instance().release(buffer, capacity);
+        FILE_LOG(logWARNING) << "MessageStream: a compressed frame of " << f.size_
+            << " bytes could not be decompressed and was discarded.";
         return false;
+    }
+    inflated_.push_back(make_pair(buffer, capacity));
+    f.data_ = buffer;
+    f.size_ = static_cast<int>(size);
+    f.flags_ &= ~FRAME_FLAG_COMPRESSED;
+    return true;
+}
+
+void MessageStream::release_frames() {
+    release(completed_data_, completed_capacity_);
+    for(auto& b : inflated_)
+        BufferPool::instance().release(b.first, b.second);
+    inflated_.clear();
+}
 
-    // otherwise try reading and consuming the new data until either there's a success and
-    // we consumed the whole buffer or ALMOST all of it. (i.e., until there's not enough data
-    // to reconstruct a whole new message
-    int consumed = 0;
-    do {
-        if(do_produce(new_data_, new_data_size_, msg, consumed)) {
-            new_data_ += consumed;
-            new_data_size_ -= consumed;
-            assert(new_data_size_ >= 0);
-            return true;
+bool MessageStream::split_batch(const FrameSpan& batch, vector<FrameSpan>& messages) {
+    messages.clear();
+    const byte* data = batch.data_;
+    int size = batch.size_;
+    while(size > 0) {
+        uint32_t length;
+        int n = decode_varint(data, size, length);
+        if(n == 0 || length > static_cast<uint32_t>(size - n)) {
+            FILE_LOG(logWARNING) << "MessageStream: a malformed batch of " << batch.size_
+                << " bytes was discarded.";
+            messages.clear();
+            return false;
         }
-        new_data_ += consumed;
-        new_data_size_ -= consumed;
-        assert(new_data_size_ >= 0);
-    } while(consumed != 0 && new_data_size_ > 0);
- 
-    // if no data is left, return false
-    if(new_data_size_ <= 0)
-        return false;
-    // if we get to here it means reading/parsing failed.
-    // this means that we reached ALMOST the end of this buffer,
-    // i.e., there's the beginning of a new message in new_buffer_
-    // but not all of it (consumed == 0). In this case we copy the data
-    // into unconsumed buffer for later use, i.e., when the rest of the message
-    // arrives
-    assert(consumed == 0);
-    assert(new_data_[0] == BUFF_SEPERATOR);
-    // there must not by any unconsumed data in unconsumed_data_.
-    //assert(unconsumed_data_size_ == 0);
-    int i = 0;
-    while(new_data_size_ > 0) {
-        unconsumed_data_[unconsumed_data_size_++] = new_data_[i++];
-        new_data_size_--;
+        messages.push_back(FrameSpan{data + n, static_cast<int>(length), 0});
+        data += n + length;
+        size -= n + length;
     }
-    assert(new_data_size_ == 0); // now everything must be consumed or copied 
-    // over to the other buffer.
-    FILE_LOG(logDEBUG2)  << "MessageStream:produce(): " << unconsumed_data_size_ << " Bytes of data remained unconsumed." ;
-    return false;
+    return true;
+}
+
+void MessageStream::discard_pending() {
+    partial_size_ = 0;
+    release(partial_data_, partial_capacity_);
+}
+
+void MessageStream::append_partial(const byte* data, int size) {
+    reserve_partial(partial_size_ + size);
+    memcpy(partial_data_ + partial_size_, data, size);
+    partial_size_ += size;
+}
+
+void MessageStream::reserve_partial(int size) {
+    if(size <= partial_capacity_)
+        return;
+    int capacity = max(size, MESSAGE_STREAM_MIN_BUFFER_SIZE);
+    byte* buffer = BufferPool::instance().allocate(capacity);
+    if(partial_size_ > 0)
+        memcpy(buffer, partial_data_, partial_size_);
+    release(partial_data_, partial_capacity_);
+    partial_data_ = buffer;
+    partial_capacity_ = capacity;
+}
+
+void MessageStream::release(byte*& buffer, int& capacity) {
+    BufferPool::instance().release(buffer, capacity);
+    buffer = nullptr;
+    capacity = 0;
 }
 
 }
@@ -1,29 +1,99 @@
 #ifndef MESSAGESTREAM_H_
 #define MESSAGESTREAM_H_
 
+#include <vector>
+#include <utility>
 #include "common.h"
-#include "ManaMessageProtobuf.pb.h"
+#include "FrameFormat.h"
 
 namespace mana {
 
 using namespace std;
 
+const int MESSAGE_STREAM_MIN_BUFFER_SIZE = 4096; // Bytes, the smallest buffer a
+// partial frame is kept in
+
+/** @brief A complete frame found in a stream: the serialized message, without its header */
+struct FrameSpan {
+    const byte* data_;
+    int size_;
+    byte flags_; // of a v2 frame
+};
+
+/**
+ * @brief Splits the data read from a connection into frames.
+ *
+ * Frames are found in place in the data given to consume(); nothing is
+ * copied but the trailing part of a frame that is not all there yet. That
+ * part is kept in a buffer borrowed from the buffer pool, which is as
+ * large as the frame once its header has been read, and is completed by
+ * the data of the next reads. Frames of both versions are taken, see
+ * FrameFormat.h. The checksum of a v2 frame that has one is checked and
+ * left out of the span. Corrupted data is skipped up to the next byte that
+ * may start a frame. The message of a compressed frame is decompressed to a
+ * pooled buffer, which is released with the frames. A batch is handed out
+ * as one frame with FRAME_FLAG_BATCH; split_batch() splits it.
+ *
+ * This class is not thread safe; a receiver uses it from its read strand.
+ */
 class MessageStream {
 
     public:
         MessageStream();
         virtual ~MessageStream();
         MessageStream(const MessageStream&) = delete; // delete copy constructor
+        MessageStream& operator=(const MessageStream&) = delete;
+        /*
+         * Take the next 'size' bytes of the stream. The data must stay
+         * valid until the frames in it have been handled.
+         */
         void consume(const byte* buff, int size);
-        bool produce(ManaMessageProtobuf& msg);
+        /*
+         * Put the frames the data of the last consume() completes in
+         * 'frames', in order. They are valid until the next call to
+         * consume() or release_frames().
+         */
+        void frames(vector<FrameSpan>& frames);
+        /* Done with the frames; give back the buffer of a frame that straddled reads */
+        void release_frames();
+        /* Bytes of a partial frame that wait for the rest of it */
+        int pending_size() const {return partial_size_;}
+        /* Drop the partial frame, e.g., at the end of a datagram */
+        void discard_pending();
+        /*
+         * Put the messages of the batch 'batch' in 'messages', in order.
+         * Returns false if the batch is malformed.
+         */
+        static bool split_batch(const FrameSpan& batch, vector<FrameSpan>& messages);
 private:
 
-    bool do_produce(const byte*, int size, ManaMessageProtobuf& msg, int& consumed) const;
-    bool check_has_message_header();
-    byte unconsumed_data_[MAX_MSG_SIZE];
-    int unconsumed_data_size_;
+    // skip to the next byte after the first one that may start a frame;
+    // returns how many bytes were skipped
+    static int skip_corrupted(const byte* data, int size);
+    // true if the frame of 'h' at 'data' is to be handed out
+    static bool is_valid(const FrameHeader& h, const byte* data);
+    // add the message of the frame of 'h' at 'data' to 'frames', decompressed
+    // if it is compressed
+    void add_frame(const FrameHeader& h, const byte* data, vector<FrameSpan>& frames);
+    bool inflate(FrameSpan& f);
+    // complete the partial frame with the data at the beginning of the read
+    void complete_partial(const byte*& data, int& size, vector<FrameSpan>& frames);
+    // add 'size' bytes of 'data' to the partial frame
+    void append_partial(const byte* data, int size);
+    void reserve_partial(int size);
+    void release(byte*& buffer, int& capacity);
+
+    // the beginning of a frame that was not all received yet. The buffer is
+    // null when there is no such frame, so an idle stream holds no memory.
+    byte* partial_data_;
+    int partial_capacity_;
+    int partial_size_;
+    // a frame that was completed from 'partial_data_' by the last read
+    byte* completed_data_;
+    int completed_capacity_;
     const byte* new_data_;
     int new_data_size_;
+    vector<pair<byte*, size_t>> inflated_; // the decompressed messages of the last read
 };
 
 }
@@ -0,0 +1,46 @@
+/**
+ * @file OutboundQueue.cc
+ * Bounds and statistics of the outbound queue of a message sender
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include "OutboundQueue.h"
+#include "ManaException.h"
+
+namespace mana {
+
+OutboundQueueLimits OutboundQueueLimits::from_url(const URL& url) {
+    OutboundQueueLimits l;
+    l.max_messages_ = url.size_option("queue_msgs");
+    l.max_bytes_ = url.size_option("queue_bytes");
+    l.max_batch_messages_ = url.size_option("batch_msgs", DEFAULT_WRITE_BATCH_MESSAGES);
+    l.max_batch_bytes_ = url.size_option("batch_bytes", DEFAULT_WRITE_BATCH_BYTES);
+    const string policy = url.option("overflow", "drop_newest");
+    if(policy == "block")
+        l.policy_ = overflow_block;
+    else if(policy == "drop_newest")
+        l.policy_ = overflow_drop_newest;
+    else if(policy == "drop_oldest")
+        l.policy_ = overflow_drop_oldest;
+    else if(policy == "disconnect")
+        l.policy_ = overflow_disconnect;
+    else
+        throw ManaException("Invalid overflow policy in " + url.url());
+    return l;
+}
+
+} /* namespace mana */
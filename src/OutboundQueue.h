@@ -0,0 +1,102 @@
+/**
+ * @file OutboundQueue.h
+ * Bounds and statistics of the outbound queue of a message sender
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef OUTBOUNDQUEUE_H_
+#define OUTBOUNDQUEUE_H_
+
+#include <string>
+#include <chrono>
+#include "URL.h"
+
+using namespace std;
+
+namespace mana {
+
+const unsigned int DEFAULT_OVERFLOW_BLOCK_MILLISECONDS = 100; // with overflow_block
+// a sender waits at most this long for room before it drops the message
+const size_t DEFAULT_WRITE_BATCH_MESSAGES = 64; // a stream sender writes at most
+// this many queued messages ...
+const size_t DEFAULT_WRITE_BATCH_BYTES = 64 * 1024; // ... or this many bytes with one write
+
+/** @brief What a sender does with a message that does not fit in its outbound queue */
+enum OverflowPolicy {
+    overflow_block, // wait for room, at most DEFAULT_OVERFLOW_BLOCK_MILLISECONDS, then drop it.
+    // A thread that runs the write handlers of the sender drops it without waiting
+    overflow_drop_newest, // drop the message
+    overflow_drop_oldest, // drop the oldest queued messages that are not being written yet
+    overflow_disconnect // drop the message and close the connection
+};
+
+/**
+ * @brief Bounds of an outbound queue, in messages and in bytes. Zero means
+ * no bound. A message is always queued if the queue is empty, whatever its
+ * size.
+ *
+ * Senders that can gather (TCP) write up to max_batch_messages_ queued
+ * messages, but no more than max_batch_bytes_, with a single write. The
+ * first message is written whatever its size. One message per write turns
+ * this off.
+ */
+struct OutboundQueueLimits {
+    OutboundQueueLimits() : max_messages_(0), max_bytes_(0), policy_(overflow_drop_newest),
+        max_batch_messages_(DEFAULT_WRITE_BATCH_MESSAGES), max_batch_bytes_(DEFAULT_WRITE_BATCH_BYTES) {}
+
+    /**
+     * @brief Read the limits from the options of 'url', e.g.,
+     * tcp:0.0.0.0:2350?queue_msgs=1000&queue_bytes=10000000&overflow=drop_oldest
+     * where overflow is one of block, drop_newest, drop_oldest or disconnect.
+     * The batch limits are batch_msgs and batch_bytes.
+     * Throws a ManaException if an option has an invalid value.
+     */
+    static OutboundQueueLimits from_url(const URL& url);
+
+    bool is_bounded() const {
+        return max_messages_ > 0 || max_bytes_ > 0;
+    }
+
+    size_t max_messages_;
+    size_t max_bytes_;
+    OverflowPolicy policy_;
+    size_t max_batch_messages_;
+    size_t max_batch_bytes_;
+};
+
+/** @brief A snapshot of the state of an outbound queue */
+struct OutboundQueueStats {
+    OutboundQueueStats() : messages_(0), bytes_(0), max_messages_(0), dropped_(0),
+        flag_disconnected_(false), avg_write_latency_(0), max_write_latency_(0), oldest_age_(0),
+        writes_(0), written_messages_(0), max_write_batch_(0) {}
+    size_t messages_; // messages waiting to be written, including the one being written
+    size_t bytes_;
+    size_t max_messages_; // the most messages that were ever queued
+    unsigned long dropped_; // messages dropped because the queue was full
+    bool flag_disconnected_; // the connection was closed because the queue was full
+    // from queuing a message to having written it
+    std::chrono::microseconds avg_write_latency_; // moving average
+    std::chrono::microseconds max_write_latency_;
+    std::chrono::microseconds oldest_age_; // how long the oldest queued message has been waiting
+    unsigned long writes_; // write operations
+    unsigned long written_messages_; // messages (or datagrams) written by them
+    size_t max_write_batch_; // the most messages written at once
+};
+
+} /* namespace mana */
+
+#endif /* OUTBOUNDQUEUE_H_ */
@@ -0,0 +1,47 @@
+/**
+ * @file PipelineStage.cc
+ * A stage of worker threads fed through lock-free queues
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include "PipelineStage.h"
+
+namespace mana {
+
+namespace {
+thread_local size_t this_producer_index = NO_PRODUCER_INDEX;
+}
+
+size_t producer_index() {
+    return this_producer_index;
+}
+
+void set_producer_index(size_t i) {
+    this_producer_index = i;
+}
+
+bool pin_to_core(size_t core) {
+    unsigned int cores = thread::hardware_concurrency();
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cores == 0 ? 0 : core % cores, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+} /* namespace mana */
@@ -0,0 +1,222 @@
+/**
+ * @file PipelineStage.h
+ * A stage of worker threads fed through lock-free queues
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef PIPELINESTAGE_H_
+#define PIPELINESTAGE_H_
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include "SPSCQueue.h"
+#include "Log.h"
+
+using namespace std;
+
+namespace mana {
+
+const size_t DEFAULT_STAGE_QUEUE_CAPACITY = 4096; // items per queue
+
+const size_t NO_PRODUCER_INDEX = static_cast<size_t>(-1);
+
+/*
+ * The index of the calling thread among the producers of the stage it
+ * feeds. Every thread that pushes into a stage sets this once, before it
+ * pushes anything. Threads that don't are served through a shared queue.
+ */
+size_t producer_index();
+void set_producer_index(size_t i);
+
+/*
+ * Pin the calling thread to core 'core' % (number of cores). Returns false
+ * if this fails.
+ */
+bool pin_to_core(size_t core);
+
+/**
+ * @brief A number of worker threads that run 'handler' on the items pushed
+ * to them.
+ *
+ * Every (producer, worker) pair has its own bounded SPSCQueue, so pushing
+ * and popping never takes a lock. A producer that finds the queue full
+ * waits for room (back pressure). Workers look for work in their queues
+ * and back off to yielding and then short sleeps when there is none.
+ *
+ * Worker i of a stage is producer i for the next stage.
+ */
+template <class T>
+class PipelineStage {
+public:
+    typedef std::function<void(size_t worker, T& item)> Handler;
+
+    /** @brief Queue statistics of a stage */
+    struct Stats {
+        Stats() : depth_(0), max_depth_(0), processed_(0), stalls_(0) {}
+        size_t depth_; // items waiting in the queues right now
+        size_t max_depth_; // the most items seen in a single queue
+        unsigned long processed_;
+        unsigned long stalls_; // number of times a producer found a queue full
+    };
+
+    /**
+     * @param name used in logs
+     * @param workers number of worker threads
+     * @param producers number of threads that push items
+     * @param capacity capacity of each queue
+     * @param first_core if 'flag_pin' is set worker i is pinned to core first_core + i
+     */
+    PipelineStage(const string& name, size_t workers, size_t producers, size_t capacity,
+        bool flag_pin, size_t first_core, Handler h) :
+        name_(name), producers_(producers + 1), flag_pin_(flag_pin), first_core_(first_core),
+        handler_(std::move(h)), flag_stop_(false), max_depth_(0), processed_(0), stalls_(0) {
+        // the last queue of every worker is for the threads without a producer index
+        for(size_t i = 0; i < workers * producers_; i++)
+            queues_.push_back(unique_ptr<SPSCQueue<T>>(new SPSCQueue<T>(capacity)));
+        threads_.resize(workers);
+    }
+
+    PipelineStage(const PipelineStage&) = delete;
+    PipelineStage& operator=(const PipelineStage&) = delete;
+
+    virtual ~PipelineStage() {
+        stop();
+    }
+
+    void start() {
+        for(size_t i = 0; i < threads_.size(); i++)
+            if(!threads_[i].joinable())
+                threads_[i] = thread(&PipelineStage<T>::run, this, i);
+    }
+
+    /** @brief Stop the workers. Items that are still queued are dropped. */
+    void stop() {
+        flag_stop_ = true;
+        for(auto& t : threads_)
+            if(t.joinable())
+                t.join();
+    }
+
+    size_t size() const {
+        return threads_.size();
+    }
+
+    /**
+     * @brief Queue 'item' for worker 'worker'. If the queue is full, wait
+     * until there is room (or the stage is stopped).
+     */
+    void push(size_t worker, T&& item) {
+        size_t p = producer_index();
+        if(p >= producers_ - 1) {
+            lock_guard<mutex> lock(shared_producer_mutex_);
+            do_push(queue(worker, producers_ - 1), std::move(item));
+        } else
+            do_push(queue(worker, p), std::move(item));
+    }
+
+    Stats stats() const {
+        Stats st;
+        for(auto& q : queues_)
+            st.depth_ += q->size();
+        st.max_depth_ = max_depth_;
+        st.processed_ = processed_;
+        st.stalls_ = stalls_;
+        return st;
+    }
+
+    const string& name() const {
+        return name_;
+    }
+
+private:
+    SPSCQueue<T>& queue(size_t worker, size_t producer) {
+        return *queues_[worker * producers_ + producer];
+    }
+
+    void do_push(SPSCQueue<T>& q, T&& item) {
+        if(!q.push(std::move(item))) {
+            stalls_++;
+            while(!flag_stop_ && !q.push(std::move(item)))
+                std::this_thread::yield();
+        }
+        size_t depth = q.size();
+        size_t m = max_depth_.load(std::memory_order_relaxed);
+        while(depth > m && !max_depth_.compare_exchange_weak(m, depth, std::memory_order_relaxed))
+            ;
+    }
+
+    void run(size_t worker) {
+        set_producer_index(worker);
+        if(flag_pin_ && !pin_to_core(first_core_ + worker)) {
+            FILE_LOG(logWARNING) << "PipelineStage::run(): could not pin " << name_ << " worker " << worker << " to a core.";
+        }
+        T item;
+        unsigned int idle = 0;
+        while(!flag_stop_) {
+            bool flag_found = false;
+            for(size_t p = 0; p < producers_; p++) {
+                SPSCQueue<T>& q = queue(worker, p);
+                // take a bounded number of items from each queue so that
+                // no producer can starve the others
+                for(size_t n = 0; n < MAX_ITEMS_PER_TURN && q.pop(item); n++) {
+                    handler_(worker, item);
+                    processed_.fetch_add(1, std::memory_order_relaxed);
+                    flag_found = true;
+                }
+            }
+            if(flag_found) {
+                idle = 0;
+                continue;
+            }
+            // back off: spin a little, then yield, then sleep
+            if(++idle < SPIN_TURNS)
+                continue;
+            if(idle < SPIN_TURNS + YIELD_TURNS)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(IDLE_SLEEP_MICROSECONDS));
+        }
+    }
+
+    static const size_t MAX_ITEMS_PER_TURN = 64;
+    static const unsigned int SPIN_TURNS = 64;
+    static const unsigned int YIELD_TURNS = 256;
+    static const unsigned int IDLE_SLEEP_MICROSECONDS = 50;
+
+    const string name_;
+    const size_t producers_;
+    const bool flag_pin_;
+    const size_t first_core_;
+    Handler handler_;
+    vector<unique_ptr<SPSCQueue<T>>> queues_;
+    vector<thread> threads_;
+    atomic<bool> flag_stop_;
+    mutex shared_producer_mutex_;
+    atomic<size_t> max_depth_;
+    atomic<unsigned long> processed_;
+    atomic<unsigned long> stalls_;
+};
+
+} /* namespace mana */
+
+#endif /* PIPELINESTAGE_H_ */
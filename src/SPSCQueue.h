@@ -0,0 +1,106 @@
+/**
+ * @file SPSCQueue.h
+ * Bounded lock-free single producer/single consumer queue
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef SPSCQUEUE_H_
+#define SPSCQUEUE_H_
+
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <assert.h>
+
+using namespace std;
+
+namespace mana {
+
+const size_t CACHE_LINE_SIZE = 64; // Bytes
+
+/**
+ * @brief A bounded ring buffer for exactly one producer thread and one
+ * consumer thread.
+ *
+ * push() is only called by the producer and pop() only by the consumer;
+ * neither ever blocks or takes a lock. size() may be called by any thread
+ * and is only an estimate while the queue is in use.
+ * The capacity is rounded up to a power of two.
+ */
+template <class T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t capacity) : head_(0), tail_(0) {
+        size_t c = 2;
+        while(c < capacity)
+            c <<= 1;
+        slots_.resize(c);
+        mask_ = c - 1;
+    }
+
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+    /** @brief Add 'item' to the queue. Returns false if the queue is full. */
+    bool push(T&& item) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail - head_.load(std::memory_order_acquire) > mask_)
+            return false;
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** @brief Take the oldest item out of the queue. Returns false if the queue is empty. */
+    bool pop(T& item) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if(head == tail_.load(std::memory_order_acquire))
+            return false;
+        item = std::move(slots_[head & mask_]);
+        // do not keep whatever the item holds alive in the ring
+        slots_[head & mask_] = T();
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        // head first: the tail never falls behind a head that was read earlier
+        const size_t head = head_.load(std::memory_order_acquire);
+        return tail_.load(std::memory_order_acquire) - head;
+    }
+
+    size_t capacity() const {
+        return mask_ + 1;
+    }
+
+private:
+    // head_ and tail_ are on separate cache lines so the producer and the
+    // consumer do not invalidate each other's line on every operation. This
+    // is done with padding rather than alignas, so that the queue can be
+    // allocated with plain new before C++17.
+    char pad_head_[CACHE_LINE_SIZE];
+    atomic<size_t> head_; // written by the consumer
+    char pad_tail_[CACHE_LINE_SIZE - sizeof(atomic<size_t>)];
+    atomic<size_t> tail_; // written by the producer
+    char pad_slots_[CACHE_LINE_SIZE - sizeof(atomic<size_t>)];
+    vector<T> slots_;
+    size_t mask_;
+};
+
+} /* namespace mana */
+
+#endif /* SPSCQUEUE_H_ */
@@ -22,6 +22,7 @@
 
 #include <chrono>
 #include <memory>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <siena/fwdtable.h>
 #include "MessageReceiver.h"
@@ -34,6 +35,7 @@
 #include "URL.h"
 #include "Log.h"
 #include "StateMachine.h"
+#include "FrameFormat.h"
 
 using namespace std;
 
@@ -51,12 +53,15 @@ namespace mana {
  *   \li void handle_session_termination(Session<T>& s);
  *
  *   Which is called when the session timesout (i.e., no heartbeat messages
- *   were received from the endpoint).
+ *   were received from the endpoint). The session holds a reference to itself
+ *   during the call, so the host may drop its own references to it there. A
+ *   session must therefore be owned by a shared_ptr, and is made with create().
  *
  *   \li boost::asio::io_service& io_service();
  *
  *   This is called by the constructor of the Session. The io_service is used
- *   to provide a thread poll for the TaskScheduler instance that Session uses.
+ *   to provide a thread poll for the TaskScheduler instance that Session uses,
+ *   unless the constructor is given an io_service of its own.
  *
  *   \li string& id()
  *
@@ -64,7 +69,7 @@ namespace mana {
  */
 
 template <class T>
-class Session {
+class Session : public enable_shared_from_this<Session<T>> {
 
 public:
 
@@ -83,22 +88,29 @@ Session& operator=(const Session&) = delete;
  * @param rem_url of the remote node
  */
 Session(T& h, const URL& lo_url, const URL& re_url, const string& id, siena::if_t ifc):
+    Session(h, h.io_service(), lo_url, re_url, id, ifc) {}
+
+/**
+ * @brief Constructor of a session whose timers and writes run on 'srv'
+ * instead of the io_service of the host.
+ */
+Session(T& h, boost::asio::io_service& srv, const URL& lo_url, const URL& re_url, const string& id, siena::if_t ifc):
     host_(h), outgress_net_connector_(nullptr),
     remote_id_(id), local_url_(lo_url), remote_url_(re_url),
     remote_endpoint_(boost::asio::ip::address::from_string(remote_url_.address()), remote_url_.port()),
-    iface_(ifc), flg_session_live_(false),
-    task_scheduler_(h.io_service()), state_machine_(3)  {
+    iface_(ifc), local_frame_format_(FrameFormat::from_url(lo_url)), flg_session_live_(false),
+    flag_overflow_terminated_(false), flag_slow_(false), task_scheduler_(srv), state_machine_(3)  {
 
 	setup_state_machine();
 
 	if(remote_url_.protocol() == mana::connection_type::tcp) {
-		outgress_net_connector_ = new TCPMessageSender<T>(h.io_service(), h, remote_url_);
+		outgress_net_connector_ = new TCPMessageSender<T>(srv, h, remote_url_);
 	} else if(remote_url_.protocol() == mana::connection_type::ka) {
-		outgress_net_connector_ = new TCPMessageSender<T>(h.io_service(), h, remote_url_);
+		outgress_net_connector_ = new TCPMessageSender<T>(srv, h, remote_url_);
 		if(!connect())
 			throw ManaException("Could not connect to " + remote_url_.url());
 	} else if(remote_url_.protocol() == mana::connection_type::udp) {
-		outgress_net_connector_ = new UDPMessageSender<T>(h.io_service(), h, remote_url_);
+		outgress_net_connector_ = new UDPMessageSender<T>(srv, h, remote_url_);
 	} else {
 		FILE_LOG(logERROR) << "Malformed URL or method not supported: " << remote_url_.url();
 		throw ManaException("Malformed URL or method not supported: " + remote_url_.url());
@@ -106,20 +118,24 @@ Session(T& h, const URL& lo_url, const URL& re_url, const string& id, siena::if_
 
 	//establish();
 
-    try {
-        task_scheduler_.schedule_at_periods(std::bind(&Session<T>::check_session_liveness, this),
-                DEFAULT_HEARTBEAT_INTERVAL_SECONDS, TimeUnit::second);
-        unsigned int t = static_cast<unsigned int>((1 - DEFAULT_HEARTBEAT_SEND_INTERVAL_ADJ) * DEFAULT_HEARTBEAT_INTERVAL_SECONDS);
-        task_scheduler_.schedule_at_periods(std::bind(&Session<T>::send_heartbeat, this), t, TimeUnit::second);
-        //
-        update_hb_reception_ts();
-    } catch(const exception& e) {}
+    update_hb_reception_ts();
+}
 
+/**
+ * @brief Make a session and start its heartbeats. The arguments are those of
+ * the constructors.
+ */
+template <typename... Args>
+static shared_ptr<Session<T>> create(Args&&... args) {
+    auto s = make_shared<Session<T>>(std::forward<Args>(args)...);
+    s->schedule_heartbeats();
+    return s;
 }
 
 virtual ~Session() {
 	if(outgress_net_connector_ != nullptr ) {
-		delete outgress_net_connector_;
+		// a write may still be in progress, see MessageSender::release()
+		outgress_net_connector_->release();
 		outgress_net_connector_ = nullptr;
 	}
 }
@@ -145,6 +161,48 @@ void send(ManaMessageProtobuf const & msg) {
     outgress_net_connector_->send(msg);
 }
 
+/**
+ * @brief Send an already framed message. The frame is shared, not copied.
+ * If the outbound queue overflowed and its policy is to disconnect, the host
+ * is told that the session is terminated.
+ */
+void send(const FrameBufferPtr& frame) {
+    if(!outgress_net_connector_->send(frame) && outgress_net_connector_->is_overflow_disconnected()
+        && !flag_overflow_terminated_.exchange(true)) {
+        FILE_LOG(logWARNING) << "Session::send(): outbound queue to " << remote_id_ << " overflowed. Terminating the session.";
+        auto self = this->shared_from_this();
+        host_.handle_session_termination(*this);
+    }
+}
+
+/** @brief Bound the outbound queue of this session */
+void set_queue_limits(const OutboundQueueLimits& limits) {
+    outgress_net_connector_->set_queue_limits(limits);
+}
+
+OutboundQueueStats queue_stats() const {
+    return outgress_net_connector_->queue_stats();
+}
+
+/**
+ * @brief Write to the remote node from 'slow_lane' instead of the io_service
+ * of the host, or from the io_service of the host again if it is nullptr.
+ */
+void set_slow_lane(boost::asio::io_service* slow_lane) {
+    outgress_net_connector_->set_write_executor(slow_lane);
+    flag_slow_ = (slow_lane != nullptr);
+}
+
+/** @brief The format of the frames sent to the remote node */
+FrameFormat frame_format() const {
+    return outgress_net_connector_->frame_format();
+}
+
+/** @brief True if the session writes from a slow lane */
+bool is_slow() const {
+    return flag_slow_;
+}
+
 void establish() {
     if(this->is_active())
     	return;
@@ -155,11 +213,28 @@ void establish() {
     auto p = msg.mutable_key_value_map()->Add();
     p->set_key("url");
     p->set_value(local_url_.url());
+    local_frame_format_.add_to_message(msg);
     send(msg);
     assert(state_machine_.current_state() == NOT_ESTABLISHED);
     //state_machine_.process(REQ_SENT);
 }
 
+/**
+ * @brief Answer the START_SESSION 'start' of the remote node with the frame
+ * format both sides are to use, and send in that format from now on. The
+ * answer itself is sent in v1 frames, which every node takes.
+ */
+void accept(const ManaMessageProtobuf& start) {
+    FrameFormat f = FrameFormat::agree(local_frame_format_, FrameFormat::from_message(start));
+    ManaMessageProtobuf msg;
+    msg.set_sender(host_.id());
+    msg.set_type(ManaMessageProtobuf_message_type_t_START_SESSION_ACK);
+    f.add_to_message(msg);
+    send(msg);
+    outgress_net_connector_->set_frame_format(f);
+    FILE_LOG(logDEBUG1) << "Session::accept(): frames to " << remote_id_ << " are " << frame_format_name(f);
+}
+
 void terminate() {
     // FIXME:
     // send termination message
@@ -172,8 +247,16 @@ void handle_session_msg(const ManaMessageProtobuf& msg) {
 		update_hb_reception_ts();
 		FILE_LOG(logDEBUG2) << "Session::handle_session_msg: Received heartbeat from " << msg.sender();
 		break;
+    case ManaMessageProtobuf_message_type_t_START_SESSION_ACK : {
+        // the remote node chose from the formats we listed, but a node
+        // that does not know of them does not list any
+        FrameFormat f = FrameFormat::answered(local_frame_format_, FrameFormat::from_message(msg));
+        outgress_net_connector_->set_frame_format(f);
+        FILE_LOG(logDEBUG1) << "Session::handle_session_msg(): frames to " << remote_id_ << " are "
+            << frame_format_name(f);
+        break;
+    }
 	case ManaMessageProtobuf_message_type_t_START_SESSION:
-    case ManaMessageProtobuf_message_type_t_START_SESSION_ACK :
     case ManaMessageProtobuf_message_type_t_START_SESSION_ACK_ACK:
     case ManaMessageProtobuf_message_type_t_TERMINATE_SESSION :
     case ManaMessageProtobuf_message_type_t_TERMINATE_SESSION_ACK :
@@ -204,11 +287,31 @@ void send_heartbeat() {
     send(msg);
 }
 
+/*
+ * The tasks only hold the session while they run, since a task may still be
+ * running on one thread when another drops the last reference to the session.
+ */
+void schedule_heartbeats() {
+    weak_ptr<Session<T>> self = this->shared_from_this();
+    try {
+        task_scheduler_.schedule_at_periods([self]() {
+            if(auto s = self.lock())
+                s->check_session_liveness();
+        }, DEFAULT_HEARTBEAT_INTERVAL_SECONDS, TimeUnit::second);
+        unsigned int t = static_cast<unsigned int>((1 - DEFAULT_HEARTBEAT_SEND_INTERVAL_ADJ) * DEFAULT_HEARTBEAT_INTERVAL_SECONDS);
+        task_scheduler_.schedule_at_periods([self]() {
+            if(auto s = self.lock())
+                s->send_heartbeat();
+        }, t, TimeUnit::second);
+    } catch(const exception& e) {}
+}
+
 void check_session_liveness() {
 	FILE_LOG(logDEBUG2) << "Session::check_neighbors_and_send_hb: checking neighbors...";
     std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
     if(now - this->last_hb_reception_ts_ > std::chrono::seconds(DEFAULT_HEARTBEAT_INTERVAL_SECONDS)) {
         flg_session_live_ = false;
+        auto self = this->shared_from_this();
         host_.handle_session_termination(*this);
     }
 }
@@ -245,7 +348,10 @@ const URL local_url_;
 const URL remote_url_;
 const boost::asio::ip::udp::endpoint remote_endpoint_;
 const siena::if_t iface_; // interface id in the forwarding table
+const FrameFormat local_frame_format_; // the frames we support, see FrameFormat
 bool flg_session_live_; // true, if the session is active (based on HB messages)
+atomic<bool> flag_overflow_terminated_; // handle_session_termination was called after an overflow
+atomic<bool> flag_slow_; // see set_slow_lane()
 std::chrono::time_point<std::chrono::system_clock> last_hb_reception_ts_; /* The
 	time at which we last received a heartbeat from this neighbor */
 TaskScheduler<std::function<void()>> task_scheduler_;
@@ -0,0 +1,245 @@
+/**
+ * @file SessionRegistry.h
+ * Concurrent index of sessions by interface number and by remote id
+ *
+ * @author Amir Malekpour
+ * @version 0.1
+ *
+ * Copyright © 2012 Amir Malekpour
+ *
+ *  Mana is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mana is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE. For more details see the GNU General Public License
+ *  at <http: *www.gnu.org/licenses/>
+ */
+
+#ifndef SESSIONREGISTRY_H_
+#define SESSIONREGISTRY_H_
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <array>
+#include <functional>
+#include <unordered_map>
+#include <stdint.h>
+#include <siena/fwdtable.h>
+#include "ManaException.h"
+
+using namespace std;
+
+namespace mana {
+
+const size_t SESSION_REGISTRY_CHUNK_SIZE = 1024; // slots per chunk of the interface array
+const size_t SESSION_REGISTRY_MAX_CHUNKS = 4096; // so at most 4M interfaces
+const size_t SESSION_REGISTRY_ID_SHARDS = 64; // the id index is split in this many locked shards
+
+/**
+ * @brief Sessions indexed by interface number and by the id of the remote
+ * node.
+ *
+ * The interface index is a dense array of shared pointers, written with the
+ * atomic shared_ptr operations. Those take a lock in libstdc++, so find(iface),
+ * the lookup done for every delivery, does not read the array directly: each
+ * thread keeps weak references to the sessions it looked up and reads the
+ * array again only after a session was added or removed, which bumps a
+ * version counter. A steady-state lookup takes no lock. The array grows in
+ * chunks that are never moved or freed while the registry lives, so a reader
+ * never sees a chunk go away. Interface numbers are small and reused (see
+ * IFaceNoGenerator) so the array stays dense.
+ *
+ * The id index is a hash map split in shards, each with its own lock, so
+ * session churn and lookups by id on different shards do not contend.
+ *
+ * All the methods are thread safe.
+ */
+template <class S>
+class SessionRegistry {
+public:
+    typedef shared_ptr<S> SessionPtr;
+
+    SessionRegistry() : max_iface_(0), size_(0), version_(0), id_(next_id()++) {
+        for(auto& c : chunks_)
+            c.store(nullptr, std::memory_order_relaxed);
+    }
+
+    SessionRegistry(const SessionRegistry&) = delete;
+    SessionRegistry& operator=(const SessionRegistry&) = delete;
+
+    ~SessionRegistry() {
+        for(auto& c : chunks_)
+            delete c.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Add 'session' under both 'id' and 'iface'. Returns false, and
+     * adds nothing, if there is a session with the same id already.
+     * Throws a ManaException if 'iface' is out of range.
+     */
+    bool insert(const string& id, siena::if_t iface, const SessionPtr& session) {
+        auto& sl = make_slot(iface);
+        IdShard& sh = shard(id);
+        lock_guard<mutex> lock(sh.mutex_);
+        if(!sh.map_.emplace(id, session).second)
+            return false;
+        std::atomic_store(&sl, session);
+        version_.fetch_add(1, std::memory_order_release);
+        size_t m = max_iface_.load(std::memory_order_relaxed);
+        while(iface > m && !max_iface_.compare_exchange_weak(m, iface))
+            ;
+        size_++;
+        return true;
+    }
+
+    /**
+     * @brief Remove the session at 'iface' and return it. Returns nullptr if
+     * there is none.
+     */
+    SessionPtr erase(siena::if_t iface, const string& id) {
+        auto* sl = find_slot(iface);
+        if(sl == nullptr)
+            return nullptr;
+        IdShard& sh = shard(id);
+        lock_guard<mutex> lock(sh.mutex_);
+        SessionPtr session = std::atomic_exchange(sl, SessionPtr());
+        if(session == nullptr)
+            return nullptr;
+        version_.fetch_add(1, std::memory_order_release);
+        // the id may have been taken by a newer session since
+        auto it = sh.map_.find(id);
+        if(it != sh.map_.end() && it->second == session)
+            sh.map_.erase(it);
+        size_--;
+        return session;
+    }
+
+    /**
+     * @brief The session at 'iface' or nullptr. Takes no lock unless a
+     * session was added or removed since the calling thread last looked
+     * 'iface' up.
+     */
+    SessionPtr find(siena::if_t iface) const {
+        static thread_local vector<CachedSessions> cache;
+        // read the version before the slot, so a change made after we read
+        // the slot bumps the version past the one we record
+        const uint64_t version = version_.load(std::memory_order_acquire);
+        CachedSessions* c = nullptr;
+        for(auto& e : cache)
+            if(e.registry_ == id_) {
+                c = &e;
+                break;
+            }
+        if(c == nullptr) {
+            cache.push_back(CachedSessions{id_, version, {}});
+            c = &cache.back();
+        } else if(c->version_ != version) {
+            c->version_ = version;
+            c->sessions_.clear();
+        }
+        if(iface < c->sessions_.size() && c->sessions_[iface].known_)
+            return c->sessions_[iface].session_.lock();
+        auto* sl = find_slot(iface);
+        SessionPtr session = sl == nullptr ? nullptr : std::atomic_load(sl);
+        if(iface >= c->sessions_.size())
+            c->sessions_.resize(iface + 1);
+        c->sessions_[iface].known_ = true;
+        c->sessions_[iface].session_ = session;
+        return session;
+    }
+
+    /** @brief The session of the remote node 'id' or nullptr */
+    SessionPtr find(const string& id) const {
+        IdShard& sh = shard(id);
+        lock_guard<mutex> lock(sh.mutex_);
+        auto it = sh.map_.find(id);
+        return it == sh.map_.end() ? nullptr : it->second;
+    }
+
+    /** @brief Append all the sessions to 'sessions' */
+    void sessions(vector<SessionPtr>& sessions) const {
+        const size_t m = max_iface_.load();
+        for(size_t i = 0; i <= m; i++) {
+            auto s = find(static_cast<siena::if_t>(i));
+            if(s != nullptr)
+                sessions.push_back(std::move(s));
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    typedef array<SessionPtr, SESSION_REGISTRY_CHUNK_SIZE> Chunk;
+
+    struct IdShard {
+        mutable mutex mutex_;
+        unordered_map<string, SessionPtr> map_;
+    };
+
+    // What one thread saw of the interface index of one registry. The
+    // references are weak so a thread that goes idle keeps no removed
+    // session alive.
+    struct CachedSlot {
+        bool known_ = false;
+        weak_ptr<S> session_;
+    };
+
+    struct CachedSessions {
+        uint64_t registry_;
+        uint64_t version_;
+        vector<CachedSlot> sessions_;
+    };
+
+    static atomic<uint64_t>& next_id() {
+        static atomic<uint64_t> id(1);
+        return id;
+    }
+
+    SessionPtr* find_slot(siena::if_t iface) const {
+        const size_t c = iface / SESSION_REGISTRY_CHUNK_SIZE;
+        if(c >= SESSION_REGISTRY_MAX_CHUNKS)
+            return nullptr;
+        Chunk* chunk = chunks_[c].load(std::memory_order_acquire);
+        return chunk == nullptr ? nullptr : &(*chunk)[iface % SESSION_REGISTRY_CHUNK_SIZE];
+    }
+
+    // the slot of 'iface', allocating its chunk if needed
+    SessionPtr& make_slot(siena::if_t iface) {
+        const size_t c = iface / SESSION_REGISTRY_CHUNK_SIZE;
+        if(c >= SESSION_REGISTRY_MAX_CHUNKS)
+            throw ManaException("SessionRegistry: interface number out of range");
+        Chunk* chunk = chunks_[c].load(std::memory_order_acquire);
+        if(chunk == nullptr) {
+            Chunk* fresh = new Chunk();
+            // another thread may have added the chunk meanwhile
+            if(chunks_[c].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+                chunk = fresh;
+            else
+                delete fresh;
+        }
+        return (*chunk)[iface % SESSION_REGISTRY_CHUNK_SIZE];
+    }
+
+    IdShard& shard(const string& id) const {
+        return id_shards_[std::hash<string>()(id) % SESSION_REGISTRY_ID_SHARDS];
+    }
+
+    array<atomic<Chunk*>, SESSION_REGISTRY_MAX_CHUNKS> chunks_;
+    mutable array<IdShard, SESSION_REGISTRY_ID_SHARDS> id_shards_;
+    atomic<size_t> max_iface_; // no session has a larger interface number
+    atomic<size_t> size_;
+    atomic<uint64_t> version_; // bumped after every change of the interface index
+    const uint64_t id_; // tells the registries apart in the per-thread caches
+};
+
+} /* namespace mana */
+
+#endif /* SESSIONREGISTRY_H_ */
@@ -28,6 +28,8 @@
 #include <boost/program_options/options_description.hpp>
 #include "Broker.h"
 #include "URL.h"
+#include "OutboundQueue.h"
+#include "FrameFormat.h"
 #include "Log.h"
 
 using namespace std;
@@ -57,7 +59,20 @@ static void setup_signal_hndlr() {
 static void start_broker(const boost::program_options::variables_map& vm) {
     const auto id = vm["id"].as<string>();
     const auto tr = vm["threads"].as<int>();
-    broker = make_shared<mana::Broker>(id, tr);
+    const auto workers = vm["match-workers"].as<size_t>();
+    broker = make_shared<mana::Broker>(id, tr, workers);
+    broker->set_write_workers(vm["write-workers"].as<size_t>());
+    broker->set_queue_capacity(vm["queue-size"].as<size_t>());
+    broker->set_pin_workers(vm.count("no-pin") == 0);
+    broker->set_rebuild_window(vm["rebuild-window"].as<unsigned int>(), vm["rebuild-batch"].as<size_t>());
+    broker->set_stats_interval(vm["stats"].as<unsigned int>());
+    broker->set_passthrough(vm.count("no-passthrough") == 0);
+    broker->set_slow_consumer_thresholds(vm["slow-latency"].as<unsigned int>(), vm["slow-queue"].as<size_t>());
+    broker->set_slow_lane_threads(vm["slow-lane-threads"].as<size_t>());
+    if(vm["dispatch"].as<string>() == "publisher-hash")
+        broker->set_dispatch_policy(mana::DispatchPolicy::publisher_hash);
+    if(vm["io-model"].as<string>() == "per-core")
+        broker->set_execution_model(mana::ExecutionModel::io_service_per_core);
     //
     auto url_list = vm["url"].as<vector<string>>();
     for(auto& url : url_list)
@@ -79,9 +94,46 @@ desc.add_options()
     ("url,u", boost::program_options::value<vector<string>>(), "transport URL."
          " You can specify multiple trnaports by repeating \"--url <url>\". The syntax for"
          " a valid url is \"protocol:ip-address:port\" where protocol is one of \"tcp\", \"udp\" or \"ka\""
-         " e.g., tcp:127.0.0.1:2350.")
+         " e.g., tcp:127.0.0.1:2350. The outbound queue of every session that connects through a transport"
+         " can be bounded with URL options, e.g., tcp:127.0.0.1:2350?queue_msgs=1000&queue_bytes=10000000&overflow=drop_oldest"
+         " where overflow is one of block, drop_newest (default), drop_oldest or disconnect. Over TCP up to"
+         " batch_msgs queued messages (default 64) but no more than batch_bytes bytes (default 65536) are"
+         " written with one system call. Over UDP that many datagrams are sent with one sendmmsg, and up to"
+         " recv_batch datagrams (default 32, at most 64) are read with one recvmmsg. With reuseport=N, N sockets"
+         " bound with SO_REUSEPORT listen on the port, each with its own reader, e.g., udp:0.0.0.0:2350?reuseport=8."
+         " Sessions use v2 frames with clients that support them unless frame=1 is given, and with crc=1 every"
+         " v2 frame carries a CRC-32C of its message. With compression=lz4 the messages of at least compress_min"
+         " bytes (default 512) sent over v2 frames are compressed; a client can ask for it with the same options."
+         " The notifications of a batch a client published are matched together, and those that match a session"
+         " are sent to it in one batch frame unless batches=0 is given.")
     ("log,l", boost::program_options::value<string>()->default_value(default_log_severity), "logging level (error, warn, info, debug, debug1-4)")
-    ("threads,t", boost::program_options::value<int>()->default_value(default_num_threads), "number of threads (default = 4)");
+    ("threads,t", boost::program_options::value<int>()->default_value(default_num_threads), "number of io threads; they read and decode messages (default = 4)")
+    ("io-model", boost::program_options::value<string>()->default_value("shared"),
+         "how the io threads run: shared (they all run one io_service) or per-core (each runs its own,"
+         " pinned to a core, and every connection stays on one of them)")
+    ("rebuild-window", boost::program_options::value<unsigned int>()->default_value(mana::DEFAULT_REBUILD_WINDOW_MILLISECONDS),
+         "subscription changes are batched for at most this many milliseconds before the forwarding table is rebuilt")
+    ("rebuild-batch", boost::program_options::value<size_t>()->default_value(mana::DEFAULT_REBUILD_MAX_BATCH),
+         "maximum number of subscription changes in one forwarding table rebuild")
+    ("stats", boost::program_options::value<unsigned int>()->default_value(mana::DEFAULT_STATS_INTERVAL_SECONDS),
+         "interval in seconds between statistics reports in the log (0 disables them)")
+    ("no-passthrough", "decode and encode again every forwarded notification instead of forwarding it as received")
+    ("match-workers", boost::program_options::value<size_t>()->default_value(0),
+         "number of matching workers, each with its own copy of the forwarding table (0 = match on the io threads)")
+    ("dispatch", boost::program_options::value<string>()->default_value("round-robin"),
+         "how notifications are spread over the matching workers: round-robin or publisher-hash"
+         " (keeps the notifications of a publisher in order)")
+    ("write-workers", boost::program_options::value<size_t>()->default_value(0),
+         "number of workers that send matched notifications to subscribers (0 = send on the matching threads)")
+    ("queue-size", boost::program_options::value<size_t>()->default_value(mana::DEFAULT_STAGE_QUEUE_CAPACITY),
+         "capacity of each queue between the broker's stages")
+    ("no-pin", "do not pin the matching and writing workers, and the per-core io threads, to cores")
+    ("slow-latency", boost::program_options::value<unsigned int>()->default_value(mana::DEFAULT_SLOW_LATENCY_MILLISECONDS),
+         "a subscriber whose write latency in milliseconds goes past this is written to from the slow lane (0 disables it)")
+    ("slow-queue", boost::program_options::value<size_t>()->default_value(mana::DEFAULT_SLOW_QUEUE_MESSAGES),
+         "a subscriber with more messages than this in its outbound queue is written to from the slow lane (0 disables it)")
+    ("slow-lane-threads", boost::program_options::value<size_t>()->default_value(mana::DEFAULT_SLOW_LANE_THREADS),
+         "number of threads that write to slow subscribers");
 }
 
 static void validate_opts(const boost::program_options::variables_map& vm) {
@@ -97,12 +149,31 @@ static void validate_opts(const boost::program_options::variables_map& vm) {
         print_help();
         exit(-1);
     }
+    const auto dispatch = vm["dispatch"].as<string>();
+    if(dispatch != "round-robin" && dispatch != "publisher-hash") {
+        cout << "Invalid dispatch policy: " << dispatch << endl;
+        exit(-1);
+    }
+    const auto io_model = vm["io-model"].as<string>();
+    if(io_model != "shared" && io_model != "per-core") {
+        cout << "Invalid io model: " << io_model << endl;
+        exit(-1);
+    }
     // validate URL formats
     for(auto& url : vm["url"].as<vector<string>>()) {
         if(mana::URL::is_valid(url) == false) {
            cout << "URL is not valid: " << url << endl;
             exit(-1);
         }
+        try {
+            mana::OutboundQueueLimits::from_url(mana::URL(url));
+            mana::URL(url).size_option("recv_batch");
+            mana::URL(url).size_option("reuseport");
+            mana::FrameFormat::from_url(mana::URL(url));
+        } catch(const exception& e) {
+            cout << "Invalid options in URL: " << url << endl;
+            exit(-1);
+        }
     }
 }
 
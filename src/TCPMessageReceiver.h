@@ -72,6 +72,8 @@ virtual void start() override {
         boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), this->url_.port());
         acceptor_ptr_->open(endpoint.protocol());
         acceptor_ptr_->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        if(this->is_reuse_port())
+            acceptor_ptr_->set_option(reuse_port(true));
         acceptor_ptr_->bind(endpoint);
         acceptor_ptr_->listen();
         this->flag_runing_ = true;
@@ -95,7 +97,7 @@ virtual connection_type transport_type() const {
 
 void begin_accept() {
     try {
-		next_connection_socket_ = make_shared<boost::asio::ip::tcp::socket>(this->io_service_);
+		next_connection_socket_ = make_shared<boost::asio::ip::tcp::socket>(this->next_connection_io_service());
 		acceptor_ptr_->async_accept(*next_connection_socket_, boost::bind(&TCPMessageReceiver<T>::accept_handler,
 						this, boost::asio::placeholders::error));
     } catch(const exception& e) {
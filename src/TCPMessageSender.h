@@ -157,11 +157,12 @@ virtual void send_buffer(const byte* data, size_t length) override {
 			connect(); // fixme: because connect is syncronized this whole method is synced. Must be fixed.
 		} catch(const exception& e) {
 			FILE_LOG(logWARNING)  << "TCPMessageSender::send_buffer(): socket could not connected. not sending.";
+			fail_write();
 			return;
 		}
 	}
     boost::asio::async_write(*socket_, boost::asio::buffer(data, length),
-        this->write_hndlr_strand_.wrap(boost::bind(&TCPMessageSender<T>::write_handler,
+        this->write_strand_->wrap(boost::bind(&TCPMessageSender<T>::write_handler,
         this, boost::asio::placeholders::error,
         boost::asio::placeholders::bytes_transferred)));
     FILE_LOG(logDEBUG3) << "TCPMessageSender::send_buffer(): sent " << length << " bytes.";
@@ -169,6 +170,45 @@ virtual void send_buffer(const byte* data, size_t length) override {
     //disconnect();
 }
 
+/**
+ * Write all the buffers with one gathered write, so that a burst of small
+ * messages costs one system call rather than one per message.
+ */
+virtual void send_buffers(const vector<boost::asio::const_buffer>& buffers) override {
+	assert(this->write_buff_item_qu_.try_lock() == false);
+	if(!is_connected()) {
+		try {
+			connect();
+		} catch(const exception& e) {
+			FILE_LOG(logWARNING)  << "TCPMessageSender::send_buffers(): socket could not connected. not sending.";
+			fail_write();
+			return;
+		}
+	}
+    boost::asio::async_write(*socket_, buffers,
+        this->write_strand_->wrap(boost::bind(&TCPMessageSender<T>::write_handler,
+        this, boost::asio::placeholders::error,
+        boost::asio::placeholders::bytes_transferred)));
+}
+
+/*
+ * Give up the write that start_write() asked for. The write handler drops
+ * the items in flight as for any failed write, and goes on with the rest
+ * of the queue. It is posted since the queue is locked.
+ */
+void fail_write() {
+    this->write_strand_->post(boost::bind(&TCPMessageSender<T>::write_handler, this,
+        boost::system::error_code(boost::asio::error::not_connected), 0));
+}
+
+virtual bool can_gather() const override {
+    return true;
+}
+
+virtual size_t max_write_size() const override {
+    return MAX_MSG_SIZE;
+}
+
 // properties
 shared_ptr<boost::asio::ip::tcp::socket> socket_;
 bool flag_try_reconnect_; // this flag specifies the behavior in case
@@ -11,6 +11,7 @@
 #include <memory.h>
 #include "boost/bind.hpp"
 #include "ManaException.h"
+#include "BufferPool.h"
 #include "Log.h"
 
 namespace mana {
@@ -29,8 +30,11 @@ public:
  * This constructor is used when we need to manually create a connection.
  */
 TCPSession(const shared_ptr<boost::asio::ip::tcp::socket>& s, T& c, TCPMessageReceiver<T>* mr) :
-	MessageReceiver<T>(mr->io_service(), c, mr->url()),
+	MessageReceiver<T>(s->get_io_service(), c, mr->url()),
 	socket_(s), client_(c), message_receiver_(mr) {
+	// the socket is read only once it has data, see start_read()
+	boost::system::error_code ignored_ec;
+	socket_->non_blocking(true, ignored_ec);
 	start_read();
 
 }
@@ -73,39 +77,47 @@ virtual connection_type transport_type() const {
 	return connection_type::tcp;
 }
 
-void read_handler(const boost::system::error_code& ec, std::size_t bytes_num) {
-	if(!ec && ec.value() != 0) {
-		FILE_LOG(logDEBUG2) << "TCPSession::read_handler(): error reading:" << ec.message();
+void read_handler(const boost::system::error_code& ec) {
+	if(ec) {
+		FILE_LOG(logDEBUG2) << "TCPSession::read_handler(): error waiting for data:" << ec.message();
+		return;
+	}
+	PooledBuffer buffer(READ_BUFFER_SIZE);
+	boost::system::error_code read_ec;
+	std::size_t bytes_num = socket_->read_some(boost::asio::buffer(buffer.data(), buffer.size()), read_ec);
+	if(read_ec == boost::asio::error::would_block || read_ec == boost::asio::error::try_again) {
+		start_read();
 		return;
 	}
 	// TODO: i'm using the number of bytes as a hint that the connection
     // terminated. I'm not sure this is a good way though. For some
     // reason socket.is_open() does not do it's job...
-	if(bytes_num == 0) {
+	if(read_ec || bytes_num == 0) {
         //this->flag_is_connected = false;
         FILE_LOG(logDEBUG2) << "TCPSession::read_handler(): connection seems to be closed.";
         return;
 	}
 	FILE_LOG(logDEBUG2) << "TCPSession::read_handler(): read " << bytes_num << " bytes.";
-    ManaMessageProtobuf msg;
     // Note: message_stream MUST be accessed by only one thread at a time - it's
     // not thread safe. Here the assumption is that read_handler is run only
     // by one thread at a time. This is guaranteed by using strand_ for async
-    // read.
-    this->message_stream_.consume(this->read_buffer_.data(), bytes_num);
-    while(this->message_stream_.produce(msg)) {
-    	this->client_.handle_message(msg, message_receiver_);
-    	msg.Clear();
-    }
+    // read. The messages are handed to the client as coming from us rather
+    // than the acceptor: the client may need their raw data, which is ours.
+    this->handle_data(buffer.data(), bytes_num);
 
     if(is_connected())
     	start_read();
 }
 
+/*
+ * Wait for the socket to have data rather than reading into a buffer, so
+ * that an idle connection holds no read buffer. read_handler() borrows one
+ * from the buffer pool for as long as it takes to handle the data.
+ */
 void start_read() {
-    socket_->async_read_some(boost::asio::buffer(this->read_buffer_, MAX_MSG_SIZE),
+    socket_->async_wait(boost::asio::ip::tcp::socket::wait_read,
             this->read_hndlr_strand_.wrap(boost::bind(&TCPSession<T>::read_handler, this,
-    boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+    boost::asio::placeholders::error)));
 }
 
 const shared_ptr<boost::asio::ip::tcp::socket> socket_;
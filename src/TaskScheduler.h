@@ -52,6 +52,13 @@ enum TimeUnit {
 *
 * The scheduler uses boost::asio::io_servie to run tasks. This way we use the same
 * thread pool that the io_service provides to us.
+*
+* The timer and the task queue are shared with the pending timer handler, so
+* the scheduler may be destroyed while a handler is queued, even by one of its
+* own tasks. No task starts once the scheduler is destroyed, but one that
+* already started on another thread runs to its end, so a task must not rely
+* on the owner of the scheduler alone to keep what it uses alive (a Session
+* binds its tasks to a weak_ptr to itself).
 */
 template <class T>
 class TaskScheduler {
@@ -62,12 +69,13 @@ public:
 *  @brief Constructor
 *  @param srv is the io_service whose thread pool we want to use to run tasks
 *  */
-TaskScheduler(boost::asio::io_service& srv) : io_service_(srv), timer_(srv),
-    flag_task_schedueled_(false) {}
+TaskScheduler(boost::asio::io_service& srv) : io_service_(srv), state_(make_shared<State>(srv)) {}
 
 virtual ~TaskScheduler() {
     try{
-        cancell_all();
+        lock_guard<mutex> lock(state_->task_q_mutex_);
+        state_->flag_stopped_ = true;
+        cancel(*state_);
     } catch(const exception& e){
         // ignore
     }
@@ -90,7 +98,7 @@ void schedule_after_duration(F&& f, unsigned int dur, TimeUnit tu) {
     // if time unit if seconds convert 'dur' to milliseconds
     unsigned t_milisec = (tu == TimeUnit::second ? dur * 1000 : dur);
     auto task = make_shared<TaskWrapper>(std::forward<F>(f), t_milisec);
-    insert_task(std::move(task));
+    insert_task(state_, std::move(task));
 }
 
 /**
@@ -112,15 +120,12 @@ void schedule_at_periods(F&& f, unsigned int period, TimeUnit tu) {
     unsigned t_milisec = (tu == TimeUnit::second ? period * 1000 : period);
     auto task = make_shared<TaskWrapper>(std::forward<F>(f), t_milisec);
     task->flag_is_recurrent_ = true;
-    insert_task(std::move(task));
+    insert_task(state_, std::move(task));
 }
 
 void cancell_all() {
-    timer_.cancel();
-    // std::priority_queue does not have a clear() method.
-    // Go figure why.
-    while(!task_queue_.empty())
-        task_queue_.pop();
+    lock_guard<mutex> lock(state_->task_q_mutex_);
+    cancel(*state_);
 }
 
 // delete copy const. and assignment
@@ -149,13 +154,48 @@ struct TaskWrapper {
 
 typedef shared_ptr<TaskWrapper> TaskWrapperPointer;
 
-void insert_task(TaskWrapperPointer&& t) {
-    lock_guard<mutex> lock(task_q_mutex_);
+/**  Comparator between to task wrappers. The one with the smaller execution time
+ *  is less that the other. We need this because we want to arrange task wrappers
+ *  in a priority queue */
+struct task_wrapper_comparator {
+    bool operator()(const TaskWrapperPointer& t1, const TaskWrapperPointer& t2) {
+        return t1->exec_time_ > t2->exec_time_;
+    }
+};
+
+/* What the timer handler works on. It is kept alive by the pending handler
+ * after the scheduler is gone. */
+struct State {
+    State(boost::asio::io_service& srv) : timer_(srv), flag_task_schedueled_(false),
+        flag_stopped_(false) {}
+    priority_queue<TaskWrapperPointer, vector<TaskWrapperPointer>, task_wrapper_comparator> task_queue_;
+    mutex task_q_mutex_;
+    boost::asio::high_resolution_timer timer_;
+    bool flag_task_schedueled_;
+    bool flag_stopped_; // the scheduler was destroyed
+};
+
+typedef shared_ptr<State> StatePointer;
+
+/* NOTE: this method must be called with 'task_q_mutex_' locked. */
+static void cancel(State& st) {
+    st.timer_.cancel();
+    // std::priority_queue does not have a clear() method.
+    // Go figure why.
+    while(!st.task_queue_.empty())
+        st.task_queue_.pop();
+    st.flag_task_schedueled_ = false;
+}
+
+static void insert_task(const StatePointer& st, TaskWrapperPointer&& t) {
+    lock_guard<mutex> lock(st->task_q_mutex_);
+    if(st->flag_stopped_)
+        return;
     // if there's no task already schedueled then we simply insert the new task
     // into the queue and schedule a dispatch
-    if(flag_task_schedueled_ == false) {
-        task_queue_.push(t);
-        schedule_next_task();
+    if(st->flag_task_schedueled_ == false) {
+        st->task_queue_.push(t);
+        schedule_next_task(st);
         return;
     }
     /* otherwise we need to consider two cases:
@@ -168,72 +208,64 @@ void insert_task(TaskWrapperPointer&& t) {
      * to achieve the proper ordering of the tasks in the priority queue.
      */
     bool flag_resched = false;
-    if(task_queue_.top()->exec_time_ > t->exec_time_)
+    if(st->task_queue_.top()->exec_time_ > t->exec_time_)
         flag_resched = true;
-    task_queue_.push(t);
+    st->task_queue_.push(t);
     if(flag_resched == true) {
-        timer_.cancel();
-        schedule_next_task();
+        st->timer_.cancel();
+        schedule_next_task(st);
     }
 }
 
 /* NOTE: this method must be called with 'mutex_' locked.
  * Both methods that call TaskScheduler::scheduele_next have already locked the
  * mutex_ */
-void schedule_next_task() {
+static void schedule_next_task(const StatePointer& st) {
     // The mutex must be locked before calling this method
-    assert(task_q_mutex_.try_lock() == false);
-    auto& time_of_next_task =  task_queue_.top()->exec_time_;
-    timer_.expires_from_now(time_of_next_task - std::chrono::system_clock::now());
+    assert(st->task_q_mutex_.try_lock() == false);
+    auto& time_of_next_task =  st->task_queue_.top()->exec_time_;
+    st->timer_.expires_from_now(time_of_next_task - std::chrono::system_clock::now());
     //Start an asynchronous wait.
-    timer_.async_wait(std::bind(&TaskScheduler::timer_handler, this, std::placeholders::_1));
-    flag_task_schedueled_ = true;
+    st->timer_.async_wait(std::bind(&TaskScheduler::timer_handler, st, std::placeholders::_1));
+    st->flag_task_schedueled_ = true;
 }
 
-void timer_handler(const boost::system::error_code& e) {
+static void timer_handler(const StatePointer& st, const boost::system::error_code& e) {
     if (e != boost::asio::error::operation_aborted) {
         // Timer was not cancelled
         bool flag_reinsert = false;
         TaskWrapperPointer trp = nullptr;
         TaskWrapperPointer temp;
         {
-            lock_guard<mutex> lock(task_q_mutex_);
-            trp = task_queue_.top();
-            temp = task_queue_.top();
+            lock_guard<mutex> lock(st->task_q_mutex_);
+            // the expiry may have been queued before the tasks were cancelled
+            if(st->flag_stopped_ || st->task_queue_.empty())
+                return;
+            trp = st->task_queue_.top();
+            temp = st->task_queue_.top();
             // if this is not a recurrent (periodical) task just
             // remove it from the queue
-            task_queue_.pop();
+            st->task_queue_.pop();
             if(trp->flag_is_recurrent_) {
                 trp->exec_time_ += trp->interval_millisec_;
                 flag_reinsert = true;
             }
-            flag_task_schedueled_ = false;
+            st->flag_task_schedueled_ = false;
         }
         if(flag_reinsert) {
-            insert_task(std::move(temp));
+            insert_task(st, std::move(temp));
         } else { // if we did not re-insert the task we need to manually call 'scheddule_next_task()'
-            lock_guard<mutex> lock(task_q_mutex_);
-            schedule_next_task();
+            lock_guard<mutex> lock(st->task_q_mutex_);
+            if(!st->task_queue_.empty())
+                schedule_next_task(st);
         }
         trp->p_functor_();
     }
 }
 
-/**  Comparator between to task wrappers. The one with the smaller execution time
- *  is less that the other. We need this because we want to arrange task wrappers
- *  in a priority queue */
-struct task_wrapper_comparator {
-    bool operator()(const TaskWrapperPointer& t1, const TaskWrapperPointer& t2) {
-        return t1->exec_time_ > t2->exec_time_;
-    }
-};
-
 // class properties of TaskScheduler
 boost::asio::io_service& io_service_;
-priority_queue<TaskWrapperPointer, vector<TaskWrapperPointer>, task_wrapper_comparator> task_queue_;
-mutex task_q_mutex_;
-boost::asio::high_resolution_timer timer_;
-bool flag_task_schedueled_;
+StatePointer state_;
 };
 
 } /* namespace mana */
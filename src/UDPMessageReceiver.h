@@ -9,9 +9,14 @@
 #define UDPMESSAGERECEIVER_H_
 
 #include <functional>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include "MessageReceiver.h"
+#include "DatagramReassembler.h"
 #include "Log.h"
 
 using namespace std;
@@ -22,16 +27,36 @@ template <class T>
 class UDPMessageReceiver: public MessageReceiver<T> {
 public:
 
+	/**
+	 * The URL option recv_batch sets how many datagrams are read with one
+	 * recvmmsg (default DEFAULT_UDP_RECV_BATCH). With 1 they are read one by one.
+	 */
 	UDPMessageReceiver(boost::asio::io_service& srv, T& client, const URL& url):
-		MessageReceiver<T>(srv, client, url) {
+		MessageReceiver<T>(srv, client, url), reads_(0), datagrams_(0), max_read_batch_(0) {
 		this->connection_type_ = mana::udp;
+		// the datagrams are read into slices of the read buffer
+		const size_t batch = min(url.size_option("recv_batch", DEFAULT_UDP_RECV_BATCH), UDP_MAX_RECV_BATCH);
+		read_buffer_.resize(max<size_t>(batch, 1) * UDP_MAX_DATAGRAM_SIZE);
+		if(batch > 1) {
+			mmsg_headers_.resize(batch);
+			mmsg_iovecs_.resize(batch);
+			sources_.resize(batch);
+			for(size_t i = 0; i < batch; i++) {
+				mmsg_iovecs_[i].iov_base = read_buffer_.data() + i * UDP_MAX_DATAGRAM_SIZE;
+				mmsg_iovecs_[i].iov_len = UDP_MAX_DATAGRAM_SIZE;
+			}
+		}
 	}
 
 virtual ~UDPMessageReceiver() {}
 
 virtual void start() override {
 	boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::udp::v4(), this->url_.port());
-	socket_ = make_shared<boost::asio::ip::udp::socket>(this->io_service_, endpoint);
+	socket_ = make_shared<boost::asio::ip::udp::socket>(this->io_service_);
+	socket_->open(endpoint.protocol());
+	if(this->is_reuse_port())
+		socket_->set_option(reuse_port(true));
+	socket_->bind(endpoint);
 	start_read();
 	this->flag_runing_ = true;
 }
@@ -42,10 +67,30 @@ virtual connection_type transport_type() const {
 	return connection_type::udp;
 }
 
+virtual void report_stats() override {
+	// the reassembler is only touched from the read strand
+	this->read_hndlr_strand_.post([this]() {
+		const auto& st = reassembler_.stats();
+		FILE_LOG(logINFO) << "UDPMessageReceiver " << this->url_.url() << ": datagrams per read: "
+			<< (reads_ > 0 ? static_cast<double>(datagrams_) / reads_ : 0.0) << " (max " << max_read_batch_ << ")"
+			<< ", reassembled messages: " << st.completed_
+			<< ", incomplete (messages/bytes): " << st.pending_messages_ << "/" << st.pending_bytes_
+			<< ", dropped (timed out/over the memory cap): " << st.expired_ << "/" << st.evicted_
+			<< ", duplicate fragments: " << st.duplicates_ << ", malformed fragments: " << st.malformed_;
+	});
+}
+
 private:
 
 void start_read() {
-    socket_->async_receive_from(boost::asio::buffer(this->read_buffer_, MAX_MSG_SIZE),
+    if(!mmsg_headers_.empty()) {
+        // read once the socket has datagrams, and then as many as there are
+        socket_->async_wait(boost::asio::ip::udp::socket::wait_read,
+            this->read_hndlr_strand_.wrap(boost::bind(&UDPMessageReceiver<T>::read_ready_handler, this,
+            boost::asio::placeholders::error)));
+        return;
+    }
+    socket_->async_receive_from(boost::asio::buffer(read_buffer_.data(), UDP_MAX_DATAGRAM_SIZE),
     	all_endpoints_,
     	this->read_hndlr_strand_.wrap(boost::bind(&UDPMessageReceiver<T>::read_handler, this,
     boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
@@ -66,24 +111,89 @@ void read_handler(const boost::system::error_code& ec, std::size_t bytes_num) {
         return;
 	}
 	FILE_LOG(logDEBUG2) << "UDPMessageSender::read_handler(): read " << bytes_num << " bytes.";
+    reads_++;
+    datagrams_++;
+    max_read_batch_ = max<size_t>(max_read_batch_, 1);
+    handle_datagram(read_buffer_.data(), bytes_num, all_endpoints_);
+    start_read();
+}
+
+void read_ready_handler(const boost::system::error_code& ec) {
+    if(ec) {
+        FILE_LOG(logERROR) << "UDPMessageReceiver::read_ready_handler(): error waiting for datagrams: " << ec.message();
+        return;
+    }
+    for(size_t i = 0; i < mmsg_headers_.size(); i++) {
+        msghdr& m = mmsg_headers_[i].msg_hdr;
+        m.msg_name = sources_[i].data();
+        m.msg_namelen = sources_[i].capacity();
+        m.msg_iov = &mmsg_iovecs_[i];
+        m.msg_iovlen = 1;
+        m.msg_control = nullptr;
+        m.msg_controllen = 0;
+        m.msg_flags = 0;
+    }
+    int r = ::recvmmsg(socket_->native_handle(), mmsg_headers_.data(), mmsg_headers_.size(), MSG_DONTWAIT, nullptr);
+    if(r < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            FILE_LOG(logERROR) << "UDPMessageReceiver::read_ready_handler(): error reading: " << strerror(errno);
+        }
+        start_read();
+        return;
+    }
+    FILE_LOG(logDEBUG2) << "UDPMessageReceiver::read_ready_handler(): read " << r << " datagrams.";
+    reads_++;
+    datagrams_ += r;
+    max_read_batch_ = max(max_read_batch_, static_cast<size_t>(r));
+    for(int i = 0; i < r; i++) {
+        sources_[i].resize(mmsg_headers_[i].msg_hdr.msg_namelen);
+        handle_datagram(static_cast<const byte*>(mmsg_iovecs_[i].iov_base), mmsg_headers_[i].msg_len, sources_[i]);
+    }
+    start_read();
+}
 
-    ManaMessageProtobuf msg;
+/*
+ * Decode the frames in a datagram from 'from', putting fragmented messages
+ * back together first.
+ */
+void handle_datagram(const byte* data, size_t bytes_num, const boost::asio::ip::udp::endpoint& from) {
+    DatagramFragmentHeader h;
+    if(decode_fragment_header(data, bytes_num, h)) {
+        // a fragment of a larger message. Go on once all of it is here.
+        if(!reassembler_.add(from, data, bytes_num, reassembled_))
+            return;
+        data = reassembled_.data();
+        bytes_num = reassembled_.size();
+    }
     // Note: message_stream MUST be accessed by only one thread at a time - it's
     // not thread safe. Here the assumption is that read_handler is run only
     // by one thread at a time. This is guaranteed by using strand_ for async
     // read.
-    this->message_stream_.consume(this->read_buffer_.data(), bytes_num);
-    while(this->message_stream_.produce(msg)) {
-    	this->client_.handle_message(msg, this);
-    	msg.Clear();
+    this->handle_data(data, bytes_num);
+    // a datagram holds whole frames, and the next one may come from another
+    // peer. What is left of a frame is lost.
+    if(this->message_stream_.pending_size() > 0) {
+        FILE_LOG(logWARNING) << "UDPMessageReceiver::handle_datagram(): discarded an incomplete frame of "
+            << this->message_stream_.pending_size() << " bytes from " << from;
+        this->message_stream_.discard_pending();
     }
-
-    start_read();
 }
 
 	// properties
     shared_ptr<boost::asio::ip::udp::socket> socket_;
 	boost::asio::ip::udp::endpoint all_endpoints_;
+	DatagramReassembler reassembler_;
+	vector<byte> reassembled_; // the last message the reassembler completed
+	// a UDP port has one receiver, whatever the number of peers, so it keeps
+	// a read buffer of its own: a datagram worth for each one of a batch
+	vector<byte> read_buffer_;
+	// for reading a batch of datagrams with recvmmsg; empty if reading one by one
+	vector<mmsghdr> mmsg_headers_;
+	vector<iovec> mmsg_iovecs_;
+	vector<boost::asio::ip::udp::endpoint> sources_;
+	unsigned long reads_;
+	unsigned long datagrams_;
+	size_t max_read_batch_;
 };
 
 } /* namespace mana */
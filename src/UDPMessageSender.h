@@ -9,10 +9,14 @@
 #define UDPMessageSender_H_
 
 #include <memory.h>
+#include <errno.h>
+#include <sys/socket.h>
 #include <thread>
+#include <vector>
 #include <boost/algorithm/string.hpp>
 #include <boost/bind.hpp>
 #include "MessageSender.h"
+#include "DatagramReassembler.h"
 #include "ManaException.h"
 #include "Log.h"
 #include "common.h"
@@ -77,15 +81,129 @@ private:
 virtual void send_buffer(const byte* data, size_t length) {
 	assert(this->write_buff_item_qu_.try_lock() == false);
     socket_->async_send_to(boost::asio::buffer(data, length), remote_endpoint_,
-        this->write_hndlr_strand_.wrap(boost::bind(&UDPMessageSender<T>::write_handler,
+        this->write_strand_->wrap(boost::bind(&UDPMessageSender<T>::write_handler,
         this, boost::asio::placeholders::error,
         boost::asio::placeholders::bytes_transferred)));
     FILE_LOG(logDEBUG3)  << "UDPMessageSender::send_buffer(): sent " << length << " bytes.";
 }
 
+virtual size_t fragment_header_size() const override {
+    return DATAGRAM_FRAGMENT_HEADER_SIZE;
+}
+
+/**
+ * A message that was split is sent as fragments, each with a header that
+ * lets the receiver put the message back together.
+ */
+virtual void send_item(const WriteBufferItem& item) override {
+	assert(this->write_buff_item_qu_.try_lock() == false);
+	if(item.fragment_count_ <= 1) {
+		send_buffer(item.buffer_->data() + item.offset_, item.size_);
+		return;
+	}
+	DatagramFragmentHeader h;
+	h.message_id_ = item.message_id_;
+	h.count_ = item.fragment_count_;
+	h.index_ = item.fragment_index_;
+	// only one datagram is in flight at a time, so one header buffer will do
+	encode_fragment_header(h, fragment_header_.data());
+	array<boost::asio::const_buffer, 2> buffers = {{
+		boost::asio::buffer(fragment_header_),
+		boost::asio::buffer(item.buffer_->data() + item.offset_, item.size_)}};
+    socket_->async_send_to(buffers, remote_endpoint_,
+        this->write_strand_->wrap(boost::bind(&UDPMessageSender<T>::write_handler,
+        this, boost::asio::placeholders::error,
+        boost::asio::placeholders::bytes_transferred)));
+    FILE_LOG(logDEBUG3)  << "UDPMessageSender::send_item(): sent fragment " << h.index_ << " of " << h.count_
+        << " of message " << h.message_id_ << ".";
+}
+
+virtual bool can_gather() const override {
+	return true;
+}
+
+/**
+ * Send the first 'n' items of the queue, a datagram each, with a single
+ * sendmmsg. The items the kernel does not take are sent by the next write.
+ */
+virtual void send_items(size_t n) override {
+	assert(this->write_buff_item_qu_.try_lock() == false);
+	auto& qu = this->write_buff_item_qu_.qu();
+	n = min(n, UDP_MAX_SEND_BATCH);
+	this->items_in_flight_ = n;
+	mmsg_headers_.assign(n, mmsghdr());
+	mmsg_iovecs_.resize(2 * n);
+	fragment_headers_.resize(n);
+	for(size_t i = 0; i < n; i++) {
+		const auto& item = qu[i];
+		iovec* iov = &mmsg_iovecs_[2 * i];
+		size_t iovlen = 0;
+		if(item.fragment_count_ > 1) {
+			DatagramFragmentHeader h;
+			h.message_id_ = item.message_id_;
+			h.count_ = item.fragment_count_;
+			h.index_ = item.fragment_index_;
+			encode_fragment_header(h, fragment_headers_[i].data());
+			iov[iovlen].iov_base = fragment_headers_[i].data();
+			iov[iovlen++].iov_len = DATAGRAM_FRAGMENT_HEADER_SIZE;
+		}
+		iov[iovlen].iov_base = const_cast<byte*>(item.buffer_->data() + item.offset_);
+		iov[iovlen++].iov_len = item.size_;
+		msghdr& m = mmsg_headers_[i].msg_hdr;
+		m.msg_name = remote_endpoint_.data();
+		m.msg_namelen = remote_endpoint_.size();
+		m.msg_iov = iov;
+		m.msg_iovlen = iovlen;
+	}
+	send_datagrams();
+}
+
+/*
+ * Hand the datagrams in 'mmsg_headers_' to the kernel. The write handler
+ * is posted rather than called since the queue is locked.
+ */
+void send_datagrams() {
+	int r = ::sendmmsg(socket_->native_handle(), mmsg_headers_.data(), mmsg_headers_.size(), MSG_DONTWAIT);
+	if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		// the send buffer of the socket is full; try again once it has room
+		socket_->async_wait(boost::asio::ip::udp::socket::wait_write,
+			this->write_strand_->wrap(boost::bind(&UDPMessageSender<T>::wait_write_handler,
+			this, boost::asio::placeholders::error)));
+		return;
+	}
+	boost::system::error_code ec;
+	size_t bytes = 0;
+	if(r < 0) {
+		// the first datagram failed. Drop it as a failed send_to would.
+		ec = boost::system::error_code(errno, boost::system::system_category());
+		r = 1;
+	} else {
+		for(int i = 0; i < r; i++)
+			bytes += mmsg_headers_[i].msg_len;
+	}
+	this->written_messages_ -= this->items_in_flight_ - r;
+	this->items_in_flight_ = r;
+	FILE_LOG(logDEBUG3)  << "UDPMessageSender::send_datagrams(): sent " << r << " datagrams, " << bytes << " bytes.";
+	this->write_strand_->post(boost::bind(&UDPMessageSender<T>::write_handler, this, ec, bytes));
+}
+
+void wait_write_handler(const boost::system::error_code& ec) {
+	lock_guard<WriteBufferItemQueueWrapper> lock(this->write_buff_item_qu_);
+	if(ec) {
+		this->write_strand_->post(boost::bind(&UDPMessageSender<T>::write_handler, this, ec, 0));
+		return;
+	}
+	send_datagrams();
+}
+
 // properties
 shared_ptr<boost::asio::ip::udp::socket> socket_;
 boost::asio::ip::udp::endpoint remote_endpoint_;
+array<byte, DATAGRAM_FRAGMENT_HEADER_SIZE> fragment_header_;
+// of the datagrams being sent with sendmmsg
+vector<mmsghdr> mmsg_headers_;
+vector<iovec> mmsg_iovecs_; // two per datagram: fragment header and data
+vector<array<byte, DATAGRAM_FRAGMENT_HEADER_SIZE>> fragment_headers_;
 };
 
 } /* namespace mana */
@@ -27,8 +27,23 @@
 namespace mana {
 
 URL::URL(const string& str_url) : url_(str_url) {
+	// options come after '?'
+	string base = url_;
+	auto q = url_.find('?');
+	if(q != string::npos) {
+		base = url_.substr(0, q);
+		const string query = url_.substr(q + 1);
+		vector<string> opts;
+		boost::split(opts, query, boost::is_any_of("&"));
+		for(auto& o : opts) {
+			auto eq = o.find('=');
+			if(o.empty() || eq == 0 || eq == string::npos)
+				throw ManaException("Malformed option in URL: " + url_);
+			options_[o.substr(0, eq)] = o.substr(eq + 1);
+		}
+	}
 	vector<string> tokens;
-	boost::split(tokens, url_, boost::is_any_of(":"));
+	boost::split(tokens, base, boost::is_any_of(":"));
         if(tokens.size() < 3)
 	    throw ManaException("Malformed URL or method not supported: " + url_);
 	// convert to lowercase e.g., TCP -> tcp
@@ -54,6 +69,7 @@ URL::URL(const URL& url) {
     protocol_ = url.protocol();
     address_ = url.address();
     port_ = url.port();
+    options_ = url.options_;
 }
 
 URL& URL::operator=(const URL& url) {
@@ -62,6 +78,7 @@ URL& URL::operator=(const URL& url) {
         protocol_ = url.protocol();
         address_ = url.address();
         port_ = url.port();
+        options_ = url.options_;
     }
     return *this;
 }
@@ -84,6 +101,28 @@ const string& URL::url() const {
 	return url_;
 }
 
+const map<string, string>& URL::options() const {
+	return options_;
+}
+
+string URL::option(const string& name, const string& default_value) const {
+	auto it = options_.find(name);
+	return it == options_.end() ? default_value : it->second;
+}
+
+size_t URL::size_option(const string& name, size_t default_value) const {
+	const string value = option(name, to_string(default_value));
+	try {
+		size_t pos = 0;
+		unsigned long long v = stoull(value, &pos);
+		if(pos != value.size())
+			throw ManaException();
+		return static_cast<size_t>(v);
+	} catch(const exception& e) {
+		throw ManaException("Invalid value for option " + name + " in " + url_);
+	}
+}
+
 bool URL::is_valid(const string& str) {
 	try {
 		URL url(str);
@@ -21,6 +21,7 @@
 #define URL_H_
 
 #include <string>
+#include <map>
 #include "common.h"
 
 using namespace std;
@@ -34,6 +35,7 @@ class URL {
 public:
     /**
      * @brief Takes a URL string in the form of <b>protocol:ip_address:port</b>
+     * optionally followed by options as in <b>?name1=value1&name2=value2</b>
      *
      * protocol is must be a member of {@link mana::connection_type}. If the input string is not valid
      * an instance of {@link ManaException} will be thrown.
@@ -46,6 +48,15 @@ public:
     unsigned int port() const;
     const string& address() const;
     connection_type protocol() const;
+    /** @brief All the options of the URL, by name */
+    const map<string, string>& options() const;
+    /** @brief The value of option 'name' or 'default_value' if the URL does not have it */
+    string option(const string& name, const string& default_value = "") const;
+    /**
+     * @brief The value of option 'name' as a size, or 'default_value' if the URL
+     * does not have it. Throws {@link ManaException} if the value is not a number.
+     */
+    size_t size_option(const string& name, size_t default_value = 0) const;
     /** static method. Returns true of the argument string
      * represents a valid URL in the form of protocol:address:port.
      */
@@ -56,6 +67,7 @@ private:
     string ip_;
     string address_;
     connection_type protocol_;
+    map<string, string> options_;
 };
 
 } // namespace mana
@@ -73,6 +73,22 @@ const unsigned int DEFAULT_HEARTBEAT_INTERVAL_SECONDS = 5; // session liveness
 const float DEFAULT_HEARTBEAT_SEND_INTERVAL_ADJ = 0.25f; // heart beat messages
 // are sent every DEFAULT_HEARTBEAT_INTERVAL_SECONDS * (1-DEFAULT_HEARTBEAT_INTERVAL_ADJ)
 // time units
+const unsigned int DEFAULT_STATS_INTERVAL_SECONDS = 60; // the broker logs its
+// statistics every DEFAULT_STATS_INTERVAL_SECONDS seconds
+const unsigned int DEFAULT_SLOW_LATENCY_MILLISECONDS = 200; // a session whose
+// write latency goes past this is moved to the slow lane
+const size_t DEFAULT_SLOW_QUEUE_MESSAGES = 1000; // ... as is a session with this
+// many messages in its outbound queue
+const unsigned int DEFAULT_SLOW_CHECK_INTERVAL_MILLISECONDS = 500; // sessions are
+// checked every DEFAULT_SLOW_CHECK_INTERVAL_MILLISECONDS milliseconds
+const size_t DEFAULT_SLOW_LANE_THREADS = 1;
+const size_t UDP_MAX_DATAGRAM_SIZE = 64 * 1024; // Bytes, room for any UDP payload
+const size_t DEFAULT_UDP_RECV_BATCH = 32; // datagrams a UDP receiver reads with one
+// system call, up to UDP_MAX_RECV_BATCH
+const size_t UDP_MAX_RECV_BATCH = 64;
+const size_t UDP_MAX_SEND_BATCH = 1024; // datagrams a UDP sender sends with one system call
+const size_t READ_BUFFER_SIZE = 64 * 1024; // Bytes a stream connection reads at once.
+// The buffer is borrowed from the buffer pool only while there is data to read.
 }
 
 #endif /* COMMON_H_ */
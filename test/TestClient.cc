@@ -41,6 +41,9 @@ public:
                     } else if (tokens[3] == "sub") {
                         cout << endl << "Subscribing: " << line;
                         context_->subscribe(str);
+                    } else if (tokens[3] == "unsub") {
+                        cout << endl << "Unsubscribing: " << line;
+                        context_->unsubscribe(str);
                     }
                 }
             } catch (const exception& e) {
@@ -0,0 +1,157 @@
+/*
+ * TestCompression.cc
+ *
+ * Checks that the LZ4 codec gives back what it was given, for empty, tiny,
+ * incompressible and highly repetitive data, and that it rejects truncated
+ * blocks, matches that point before the data and lengths beyond the input
+ * or the output.
+ */
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "Compression.h"
+
+using namespace std;
+using namespace mana;
+
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)) { cout << __FILE__ << ":" << __LINE__ << ": failed: " #cond << endl; failures++; } } while(0)
+
+static vector<byte> bytes(const string& s) {
+    return vector<byte>(s.begin(), s.end());
+}
+
+static vector<byte> random_bytes(size_t size, unsigned int seed) {
+    std::mt19937 gen(seed);
+    vector<byte> data(size);
+    for(auto& b : data)
+        b = static_cast<byte>(gen());
+    return data;
+}
+
+// 'data' comes back from an LZ4 block, and from a compressed message if it
+// compresses. Returns the size of the block.
+static size_t check_round_trip(const vector<byte>& data) {
+    vector<byte> block(compressed_message_bound(data.size()));
+    size_t n = lz4_compress(data.data(), data.size(), block.data(), block.size());
+    CHECK(n > 0);
+    vector<byte> out(data.size() + 1);
+    CHECK(lz4_decompress(block.data(), n, out.data(), data.size()) == static_cast<long>(data.size()));
+    out.resize(data.size());
+    CHECK(out == data);
+
+    vector<byte> message(compressed_message_bound(data.size()));
+    size_t m = compress_message(compression_lz4, data.data(), data.size(), message.data());
+    if(m > 0) {
+        CHECK(m < data.size());
+        CHECK(uncompressed_message_size(message.data(), m) == static_cast<long>(data.size()));
+        vector<byte> plain(data.size());
+        CHECK(decompress_message(message.data(), m, plain.data()));
+        CHECK(plain == data);
+    }
+    return n;
+}
+
+static void test_round_trips() {
+    // empty and tiny inputs are all literals, and no smaller compressed
+    vector<byte> message(compressed_message_bound(16));
+    for(size_t size = 0; size <= 16; size++) {
+        auto data = random_bytes(size, 1);
+        check_round_trip(data);
+        CHECK(compress_message(compression_lz4, data.data(), data.size(), message.data()) == 0);
+    }
+    check_round_trip(bytes("aaaaaaaaaaaaa"));
+    // incompressible: the block is a little larger than the data, and the
+    // message is sent as it is
+    for(size_t size : {100, 4096, 100000}) {
+        auto data = random_bytes(size, 2);
+        CHECK(check_round_trip(data) > size);
+        vector<byte> out(compressed_message_bound(size));
+        CHECK(compress_message(compression_lz4, data.data(), size, out.data()) == 0);
+    }
+    // highly repetitive: runs of one byte (matches that overlap what they
+    // copy), a short pattern, and repeats further apart than the largest offset
+    CHECK(check_round_trip(vector<byte>(100000, 0)) < 1000);
+    string pattern;
+    for(int i = 0; i < 10000; i++)
+        pattern += "abc";
+    CHECK(check_round_trip(bytes(pattern)) < 1000);
+    auto chunk = random_bytes(70000, 3);
+    vector<byte> far(chunk);
+    far.insert(far.end(), chunk.begin(), chunk.end());
+    check_round_trip(far);
+    string text;
+    const char* words[] = {"subscription ", "notification ", "broker ", "session ", "filter ", "= ", "42 "};
+    std::mt19937 gen(4);
+    while(text.size() < 50000)
+        text += words[gen() % 7];
+    CHECK(check_round_trip(bytes(text)) < text.size() / 2);
+}
+
+static void test_rejects() {
+    string pattern;
+    for(int i = 0; i < 1000; i++)
+        pattern += "abcdefgh" + to_string(i % 10);
+    const auto data = bytes(pattern);
+    vector<byte> message(compressed_message_bound(data.size()));
+    size_t m = compress_message(compression_lz4, data.data(), data.size(), message.data());
+    CHECK(m > 0);
+    vector<byte> out(data.size());
+    // truncated
+    for(size_t n = 0; n < m; n++)
+        CHECK(!decompress_message(message.data(), n, out.data()));
+    // a match before the start of the data: one literal then offset 2, and offset 0
+    const vector<byte> before = {0x10, 'a', 2, 0};
+    CHECK(lz4_decompress(before.data(), before.size(), out.data(), out.size()) == -1);
+    const vector<byte> zero = {0x10, 'a', 0, 0};
+    CHECK(lz4_decompress(zero.data(), zero.size(), out.data(), out.size()) == -1);
+    // a match with its offset cut short
+    const vector<byte> short_offset = {0x10, 'a', 1};
+    CHECK(lz4_decompress(short_offset.data(), short_offset.size(), out.data(), out.size()) == -1);
+    // more literals than the block holds, and a length that runs off its end
+    const vector<byte> literals = {0x50, 'a', 'b'};
+    CHECK(lz4_decompress(literals.data(), literals.size(), out.data(), out.size()) == -1);
+    const vector<byte> run_off = {0xF0, 255, 255};
+    CHECK(lz4_decompress(run_off.data(), run_off.size(), out.data(), out.size()) == -1);
+    // more output than there is room for: literals, then a match
+    const vector<byte> long_literals = {0x30, 'a', 'b', 'c'};
+    CHECK(lz4_decompress(long_literals.data(), long_literals.size(), out.data(), 2) == -1);
+    const vector<byte> long_match = {0x1F, 'a', 1, 0, 200};
+    CHECK(lz4_decompress(long_match.data(), long_match.size(), out.data(), 100) == -1);
+    CHECK(lz4_decompress(long_match.data(), long_match.size(), out.data(), out.size()) == 1 + 15 + 200 + 4);
+    // a message that claims more or less than its block holds
+    vector<byte> bigger(message.begin(), message.begin() + m);
+    bigger[1] += 1;
+    CHECK(!decompress_message(bigger.data(), bigger.size(), out.data()));
+    // a size beyond MAX_MSG_SIZE, an unknown codec and a size that runs off the end
+    const vector<byte> oversized = {compression_lz4, 0xFF, 0xFF, 0xFF, 0x7F, 0x00};
+    CHECK(uncompressed_message_size(oversized.data(), oversized.size()) == -1);
+    CHECK(!decompress_message(oversized.data(), oversized.size(), out.data()));
+    const vector<byte> unknown = {7, 1, 0x10, 'a'};
+    CHECK(uncompressed_message_size(unknown.data(), unknown.size()) == -1);
+    const vector<byte> cut = {compression_lz4, 0x80};
+    CHECK(uncompressed_message_size(cut.data(), cut.size()) == -1);
+    // damaged blocks are rejected or decompressed, but never written past 'out'
+    std::mt19937 gen(5);
+    vector<byte> damaged;
+    for(int i = 0; i < 2000; i++) {
+        damaged.assign(message.begin(), message.begin() + m);
+        for(int k = 0; k < 3; k++)
+            damaged[2 + gen() % (m - 2)] = static_cast<byte>(gen());
+        decompress_message(damaged.data(), damaged.size(), out.data());
+    }
+}
+
+int main() {
+    test_round_trips();
+    test_rejects();
+    if(failures > 0) {
+        cout << "Test failed: " << failures << " checks failed." << endl;
+        return 1;
+    }
+    cout << "Test passed successfully." << endl;
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * TestFrameFormat.cc
+ *
+ * Checks the CRC-32C, on the crc32 instruction and on the tables, and the
+ * decoding of frame headers, including headers that arrive in pieces and
+ * headers with corrupted lengths.
+ */
+
+#include <iostream>
+#include <random>
+#include <vector>
+#include <string.h>
+#include "Crc32c.h"
+#include "FrameFormat.h"
+
+using namespace std;
+using namespace mana;
+
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)) { cout << __FILE__ << ":" << __LINE__ << ": failed: " #cond << endl; failures++; } } while(0)
+
+static void test_crc32c() {
+    const char* digits = "123456789";
+    const byte* d = reinterpret_cast<const byte*>(digits);
+    // the check value of CRC-32C
+    CHECK(crc32c(d, 9) == 0xE3069283);
+    CHECK(crc32c_table(d, 9) == 0xE3069283);
+    CHECK(crc32c(d, 0) == 0);
+    cout << "CRC-32C runs on " << (crc32c_is_hardware() ? "the crc32 instruction" : "tables") << endl;
+    // both implementations agree at every length and alignment, and
+    // checksums can be continued
+    std::mt19937 gen(7);
+    vector<byte> data(1000);
+    for(auto& b : data)
+        b = static_cast<byte>(gen());
+    for(size_t offset = 0; offset < 8; offset++)
+        for(size_t size = 0; size + offset <= 300; size++) {
+            const byte* p = data.data() + offset;
+            uint32_t c = crc32c(p, size);
+            CHECK(c == crc32c_table(p, size));
+            CHECK(c == crc32c(p + size / 3, size - size / 3, crc32c(p, size / 3)));
+        }
+}
+
+// the frame header of 'f' for a message of 'size' bytes
+static vector<byte> header(const FrameFormat& f, size_t size) {
+    vector<byte> h(FRAME_MAX_HEADER_SIZE);
+    h.resize(encode_frame_header(f, size, h.data()));
+    return h;
+}
+
+// 'h' is read as a header of a message of 'size' bytes, but none of its prefixes is
+static void check_header(const vector<byte>& h, int size, byte version, int trailer) {
+    FrameHeader fh = FrameHeader();
+    for(size_t n = 0; n < h.size(); n++)
+        CHECK(decode_frame_header(h.data(), static_cast<int>(n), fh) == 0);
+    CHECK(decode_frame_header(h.data(), static_cast<int>(h.size()), fh) == 1);
+    CHECK(fh.version_ == version);
+    CHECK(fh.header_size_ == static_cast<int>(h.size()));
+    CHECK(fh.message_size_ == size);
+    CHECK(fh.trailer_size_ == trailer);
+}
+
+static void test_decode_frame_header() {
+    const int sizes[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152, MAX_MSG_SIZE - 100};
+    for(int size : sizes) {
+        check_header(header(FrameFormat(FRAME_VERSION_1), size), size, FRAME_VERSION_1, 0);
+        check_header(header(FrameFormat(FRAME_VERSION_2), size), size, FRAME_VERSION_2, 0);
+        check_header(header(FrameFormat(FRAME_VERSION_2, true), size), size, FRAME_VERSION_2, FRAME_CRC_SIZE);
+        CHECK(header(FrameFormat(FRAME_VERSION_2), size).size() == 2 + varint_size(size));
+    }
+    FrameHeader fh = FrameHeader();
+    // a length in a 5 byte varint is taken, even if it would fit in fewer
+    const vector<byte> five = {FRAME_V2_MAGIC, 0, 0x85, 0x80, 0x80, 0x80, 0x00};
+    check_header(five, 5, FRAME_VERSION_2, 0);
+    // but a sixth byte is not
+    const vector<byte> six = {FRAME_V2_MAGIC, 0, 0x85, 0x80, 0x80, 0x80, 0x80, 0x00};
+    CHECK(decode_frame_header(six.data(), static_cast<int>(six.size()), fh) == -1);
+    CHECK(decode_frame_header(six.data(), FRAME_V2_MAX_HEADER_SIZE, fh) == -1);
+    // lengths beyond MAX_MSG_SIZE are corrupted
+    vector<byte> big = {FRAME_V2_MAGIC, 0};
+    big.resize(2 + varint_size(MAX_MSG_SIZE));
+    encode_varint(MAX_MSG_SIZE, big.data() + 2);
+    CHECK(decode_frame_header(big.data(), static_cast<int>(big.size()), fh) == -1);
+    const vector<byte> huge = {FRAME_V2_MAGIC, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F};
+    CHECK(decode_frame_header(huge.data(), static_cast<int>(huge.size()), fh) == -1);
+    // the room for the checksum counts against MAX_MSG_SIZE
+    vector<byte> edge = {FRAME_V2_MAGIC, 0};
+    const size_t edge_size = MAX_MSG_SIZE - 2 - varint_size(MAX_MSG_SIZE - 8);
+    edge.resize(2 + varint_size(edge_size));
+    encode_varint(edge_size, edge.data() + 2);
+    CHECK(decode_frame_header(edge.data(), static_cast<int>(edge.size()), fh) == 1);
+    edge[1] = FRAME_FLAG_CRC32C;
+    CHECK(decode_frame_header(edge.data(), static_cast<int>(edge.size()), fh) == -1);
+    vector<byte> v1 = header(FrameFormat(FRAME_VERSION_1), 0);
+    int length = -1;
+    memcpy(v1.data() + BUFF_SEPERATOR_LEN_BYTE, &length, sizeof(length));
+    CHECK(decode_frame_header(v1.data(), static_cast<int>(v1.size()), fh) == -1);
+    length = MAX_MSG_SIZE;
+    memcpy(v1.data() + BUFF_SEPERATOR_LEN_BYTE, &length, sizeof(length));
+    CHECK(decode_frame_header(v1.data(), static_cast<int>(v1.size()), fh) == -1);
+    // neither v1 nor v2
+    const vector<byte> other = {FRAME_MAGIC | 3, 0, 1};
+    CHECK(decode_frame_header(other.data(), static_cast<int>(other.size()), fh) == -1);
+}
+
+int main() {
+    test_crc32c();
+    test_decode_frame_header();
+    if(failures > 0) {
+        cout << "Test failed: " << failures << " checks failed." << endl;
+        return 1;
+    }
+    cout << "Test passed successfully." << endl;
+    return 0;
+}
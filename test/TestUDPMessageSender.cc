@@ -22,7 +22,11 @@ public:
 	void handle_message(ManaMessageProtobuf& msg) {}
 };
 
-int main() {
+/*
+ * Usage: TestUDPMessageSender [payload size]. Payloads larger than a
+ * datagram are sent in fragments that the receiver puts back together.
+ */
+int main(int argc, char* argv[]) {
 	Log::ReportingLevel() = logWARNING;
 	URL url("udp:127.0.0.1:2350");
 	boost::asio::io_service io_srv;
@@ -33,8 +37,8 @@ int main() {
 	UDPMessageSender<MessageHandler> ms(io_srv, hndlr, url);
 	// create a message and fill in some fields
 	std::hash<std::string> hash_fn;
-	const int num_chars = 1200;
-	char payload[num_chars+1];
+	const int num_chars = (argc > 1 ? atoi(argv[1]) : 1200);
+	vector<char> payload(num_chars+1);
 	payload[num_chars] = 0; // null-ended string
 	ManaMessageProtobuf msg;
 	for(int k = 0; k < 10; k++) {
@@ -47,12 +51,16 @@ int main() {
 		std::uniform_int_distribution<> dis(33, 253);
 		for(int i = 0; i < num_chars; i++)
 			payload[i] = dis(gen);
-		auto hash = hash_fn(payload);
-		msg.set_payload(payload);
+		auto hash = hash_fn(payload.data());
+		msg.set_payload(payload.data());
 		auto p = msg.mutable_key_value_map()->Add();
 		p->set_key("hash");
 		p->set_value(to_string(hash));
 		ms.send(msg);
+		// give the receiver time to read the fragments of a large
+		// message before the next one fills its socket buffer
+		if(num_chars > MAX_PCKT_SIZE)
+			usleep(50000);
 	}
 	sleep(3);
         io_srv.stop();
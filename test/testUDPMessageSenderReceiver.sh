@@ -2,17 +2,6 @@
 
 echo "Testing UDPMessageReceiver and UDPMessageSender..."
 
-./TestUDPMessageReceiver > out.txt &
-receiver_pid=$!
-
-sleep 0.2
-
-./TestUDPMessageSender > /dev/null
-sender_pid=$!
-
-sleep 0.2
-kill $receiver_pid
-
 read -d '' res <<"EOF"
 Payload hash verified.
 Payload hash verified.
@@ -26,15 +15,32 @@ Payload hash verified.
 Payload hash verified.
 EOF
 
-echo "$res" | diff out.txt - > fail.txt
+# $1 is the payload size. Payloads larger than a datagram are sent in
+# fragments that the receiver puts back together.
+run_test() {
+    ./TestUDPMessageReceiver > out.txt &
+    receiver_pid=$!
 
-if [ $? -eq 0 ]
-then
-    echo "Test passed successfully."
-else
-    echo "Test failed. See fail.txt"
-    return -1
-fi
+    sleep 0.2
 
-rm -rf out.txt
+    ./TestUDPMessageSender $1 > /dev/null
 
+    sleep 0.2
+    kill $receiver_pid
+
+    echo "$res" | diff out.txt - > fail.txt
+}
+
+for size in 1200 100000
+do
+    run_test $size
+    if [ $? -ne 0 ]
+    then
+        echo "Test failed with $size byte payloads. See fail.txt"
+        exit 1
+    fi
+done
+
+echo "Test passed successfully."
+
+rm -rf out.txt